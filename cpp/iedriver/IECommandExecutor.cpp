@@ -108,7 +108,8 @@ LRESULT IECommandExecutor::OnCreate(UINT uMsg,
   this->PopulateCommandHandlers();
   this->PopulateElementFinderMethods();
   this->current_browser_id_ = "";
-  this->serialized_response_ = "";
+  this->is_response_ready_ = false;
+  this->is_waiting_ = false;
   this->enable_element_cache_cleanup_ = true;
   this->enable_persistent_hover_ = true;
   this->unexpected_alert_behavior_ = IGNORE_UNEXPECTED_ALERTS;
@@ -130,6 +131,19 @@ LRESULT IECommandExecutor::OnDestroy(UINT uMsg,
                                      BOOL& bHandled) {
   LOG(DEBUG) << "Entering IECommandExecutor::OnDestroy";
 
+  // Nothing more will be executed, but whoever is waiting for the current
+  // and queued commands must still hear about them.
+  Response response(this->session_id_);
+  response.SetErrorResponse(ENOSUCHDRIVER, "Session has been shut down");
+  if (this->current_completion_) {
+    this->current_completion_->Complete(&response, false);
+    this->current_completion_.reset();
+  }
+  while (!this->command_queue_.empty()) {
+    this->command_queue_.front()->completion->Complete(&response, false);
+    this->command_queue_.pop();
+  }
+
   LOG(DEBUG) << "Clearing managed element cache";
   this->managed_elements_.Clear();
   LOG(DEBUG) << "Closing input manager";
@@ -144,53 +158,24 @@ LRESULT IECommandExecutor::OnDestroy(UINT uMsg,
   return 0;
 }
 
-LRESULT IECommandExecutor::OnSetCommand(UINT uMsg,
-                                        WPARAM wParam,
-                                        LPARAM lParam,
-                                        BOOL& bHandled) {
-  LOG(TRACE) << "Entering IECommandExecutor::OnSetCommand";
-
-  LPCSTR json_command = reinterpret_cast<LPCSTR>(lParam);
-  this->current_command_.Populate(json_command);
-  return 0;
-}
-
 LRESULT IECommandExecutor::OnExecCommand(UINT uMsg,
                                          WPARAM wParam,
                                          LPARAM lParam,
                                          BOOL& bHandled) {
   LOG(TRACE) << "Entering IECommandExecutor::OnExecCommand";
 
-  this->DispatchCommand();
-  return 0;
-}
-
-LRESULT IECommandExecutor::OnGetResponseLength(UINT uMsg,
-                                               WPARAM wParam,
-                                               LPARAM lParam,
-                                               BOOL& bHandled) {
-  // Not logging trace entering IECommandExecutor::OnGetResponseLength,
-  // because it is polled repeatedly for a non-zero return value.
-  size_t response_length = 0;
-  if (!this->is_waiting_) {
-    response_length = this->serialized_response_.size();
+  // A NULL lParam means the previous command has completed, and the next
+  // one in the queue should start.
+  QueuedCommand* queued_command = reinterpret_cast<QueuedCommand*>(lParam);
+  if (queued_command != NULL) {
+    this->command_queue_.push(QueuedCommandHandle(queued_command));
   }
-  return response_length;
-}
-
-LRESULT IECommandExecutor::OnGetResponse(UINT uMsg,
-                                         WPARAM wParam,
-                                         LPARAM lParam,
-                                         BOOL& bHandled) {
-  LOG(TRACE) << "Entering IECommandExecutor::OnGetResponse";
-
-  LPSTR str = reinterpret_cast<LPSTR>(lParam);
-  strcpy_s(str,
-           this->serialized_response_.size() + 1,
-           this->serialized_response_.c_str());
 
-  // Reset the serialized response for the next command.
-  this->serialized_response_ = "";
+  // Calls out to the browser can dispatch messages on this thread, so a
+  // command may arrive while another is executing. It waits its turn.
+  if (!this->current_completion_) {
+    this->ExecuteNextCommand();
+  }
   return 0;
 }
 
@@ -202,11 +187,19 @@ LRESULT IECommandExecutor::OnWait(UINT uMsg,
 
   BrowserHandle browser;
   int status_code = this->GetCurrentBrowser(&browser);
-  if (status_code == WD_SUCCESS && !browser->is_closing()) {
+  if (this->current_completion_ && this->current_completion_->is_cancelled()) {
+    // Nobody is waiting for the page to load any longer.
+    LOG(DEBUG) << "Command was cancelled, no longer waiting for page load";
+    this->is_waiting_ = false;
+    if (status_code == WD_SUCCESS) {
+      browser->set_wait_required(false);
+    }
+  } else if (status_code == WD_SUCCESS && !browser->is_closing()) {
     if (this->page_load_timeout_ >= 0 && this->wait_timeout_ < clock()) {
       Response timeout_response;
       timeout_response.SetErrorResponse(ETIMEOUT, "Timed out waiting for page to load.");
-      this->serialized_response_ = timeout_response.Serialize();
+      this->current_response_.Swap(&timeout_response);
+      this->is_response_ready_ = true;
       this->is_waiting_ = false;
       browser->set_wait_required(false);
     } else {
@@ -234,6 +227,7 @@ LRESULT IECommandExecutor::OnWait(UINT uMsg,
   } else {
     this->is_waiting_ = false;
   }
+  this->CompleteCommandIfReady();
   return 0;
 }
 
@@ -444,25 +438,92 @@ unsigned int WINAPI IECommandExecutor::ThreadProc(LPVOID lpParameter) {
   }
 
   LOG(DEBUG) << "Exited IECommandExecutor thread message loop";
+
+  // Commands posted after the shutdown message was queued never reach the
+  // window. Their senders are still waiting on the completion, and the
+  // QueuedCommand is owned by the message, so finish and free them here.
+  while (::PeekMessage(&msg, NULL, WD_EXEC_COMMAND, WD_EXEC_COMMAND, PM_REMOVE)) {
+    QueuedCommand* queued_command = reinterpret_cast<QueuedCommand*>(msg.lParam);
+    if (queued_command != NULL) {
+      LOG(DEBUG) << "Discarding command posted after shutdown";
+      Response response(new_session.session_id());
+      response.SetErrorResponse(ENOSUCHDRIVER, "Session has been shut down");
+      queued_command->completion->Complete(&response, false);
+      delete queued_command;
+    }
+  }
+
   ::CoUninitialize();
   delete session_context;
   return 0;
 }
 
+void IECommandExecutor::ExecuteNextCommand() {
+  LOG(TRACE) << "Entering IECommandExecutor::ExecuteNextCommand";
+
+  while (!this->command_queue_.empty()) {
+    QueuedCommandHandle next_command = this->command_queue_.front();
+    this->command_queue_.pop();
+    if (next_command->completion->is_cancelled()) {
+      LOG(DEBUG) << "Skipping cancelled command "
+                 << webdriver::CommandType::GetName(
+                        next_command->command.command_type());
+      continue;
+    }
+
+    // The JSON values built while executing the command are mostly
+    // short-lived; take their memory from an arena.
+    Json::ValueArena value_arena;
+    this->current_command_.Swap(&next_command->command);
+    this->current_completion_ = next_command->completion;
+    this->DispatchCommand();
+    this->CompleteCommandIfReady();
+    return;
+  }
+}
+
+// Reports the outcome of the current command once its response is ready
+// and any page load it started has finished, then moves on to the next
+// command. Posting a message rather than executing the next command here
+// lets waiting browser events be processed first.
+void IECommandExecutor::CompleteCommandIfReady() {
+  if (!this->current_completion_ ||
+      !this->is_response_ready_ ||
+      this->is_waiting_) {
+    return;
+  }
+  LOG(TRACE) << "Entering IECommandExecutor::CompleteCommandIfReady";
+
+  Response response;
+  response.Swap(&this->current_response_);
+
+  // Reset the response for the next command.
+  this->current_response_.SetSuccessResponse(Json::Value::null);
+  this->is_response_ready_ = false;
+
+  CommandCompletionHandle completion = this->current_completion_;
+  this->current_completion_.reset();
+  completion->Complete(&response, this->is_valid_);
+
+  if (!this->command_queue_.empty()) {
+    ::PostMessage(this->m_hWnd, WD_EXEC_COMMAND, NULL, NULL);
+  }
+}
+
 void IECommandExecutor::DispatchCommand() {
   LOG(TRACE) << "Entering IECommandExecutor::DispatchCommand";
 
   Response response(this->session_id_);
-  CommandHandlerMap::const_iterator found_iterator = 
-      this->command_handlers_.find(this->current_command_.command_type());
+  webdriver::CommandType::Id command_type = this->current_command_.command_type();
+  CommandHandlerHandle command_handler = this->command_handlers_[command_type];
 
-  if (found_iterator == this->command_handlers_.end()) {
-    LOG(WARN) << "Unable to find command handler for " << this->current_command_.command_type();
+  if (!command_handler) {
+    LOG(WARN) << "Unable to find command handler for " << webdriver::CommandType::GetName(command_type);
     response.SetErrorResponse(501, "Command not implemented");
   } else {
     BrowserHandle browser;
     int status_code = WD_SUCCESS;
-    if (this->current_command_.command_type() != webdriver::CommandType::NewSession) {
+    if (command_type != webdriver::CommandType::NewSession) {
       // There should never be a modal dialog or alert to check for if the command
       // is the "newSession" command.
       status_code = this->GetCurrentBrowser(&browser);
@@ -470,7 +531,6 @@ void IECommandExecutor::DispatchCommand() {
         HWND alert_handle = NULL;
         bool alert_is_active = this->IsAlertActive(browser, &alert_handle);
         if (alert_is_active) {
-          std::string command_type = this->current_command_.command_type();
           if (command_type == webdriver::CommandType::GetAlertText ||
               command_type == webdriver::CommandType::SendKeysToAlert ||
               command_type == webdriver::CommandType::AcceptAlert ||
@@ -488,7 +548,8 @@ void IECommandExecutor::DispatchCommand() {
               response_value["message"] = "Modal dialog present";
               response_value["alert"]["text"] = alert_text;
               response.SetResponse(EMODALDIALOGOPENED, response_value);
-              this->serialized_response_ = response.Serialize();
+              this->current_response_.Swap(&response);
+              this->is_response_ready_ = true;
               return;
             } else {
               LOG(DEBUG) << "Quit command was issued. Continuing with command after automatically closing alert.";
@@ -499,7 +560,6 @@ void IECommandExecutor::DispatchCommand() {
         LOG(WARN) << "Unable to find current browser";
       }
     }
-    CommandHandlerHandle command_handler = found_iterator->second;
     command_handler->Execute(*this, this->current_command_, &response);
 
     status_code = this->GetCurrentBrowser(&browser);
@@ -512,13 +572,14 @@ void IECommandExecutor::DispatchCommand() {
         ::PostMessage(this->m_hWnd, WD_WAIT, NULL, NULL);
       }
     } else {
-      if (this->current_command_.command_type() != webdriver::CommandType::Quit) {
+      if (command_type != webdriver::CommandType::Quit) {
         LOG(WARN) << "Unable to get current browser";
       }
     }
   }
 
-  this->serialized_response_ = response.Serialize();
+  this->current_response_.Swap(&response);
+  this->is_response_ready_ = true;
 }
 
 bool IECommandExecutor::IsAlertActive(BrowserHandle browser, HWND* alert_handle) {
@@ -756,6 +817,7 @@ void IECommandExecutor::PopulateElementFinderMethods(void) {
 void IECommandExecutor::PopulateCommandHandlers() {
   LOG(TRACE) << "Entering IECommandExecutor::PopulateCommandHandlers";
 
+  this->command_handlers_.resize(webdriver::CommandType::Count);
   this->command_handlers_[webdriver::CommandType::NoCommand] = CommandHandlerHandle(new IECommandHandler);
   this->command_handlers_[webdriver::CommandType::GetCurrentWindowHandle] = CommandHandlerHandle(new GetCurrentWindowHandleCommandHandler);
   this->command_handlers_[webdriver::CommandType::GetWindowHandles] = CommandHandlerHandle(new GetAllWindowHandlesCommandHandler);
@@ -18,6 +18,8 @@
 #include <algorithm>
 #include <ctime>
 #include <map>
+#include <memory>
+#include <queue>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -33,6 +35,7 @@
 #include "ProxyManager.h"
 #include "messages.h"
 #include "response.h"
+#include "session.h"
 
 #define WAIT_TIME_IN_MILLISECONDS 200
 #define FIND_ELEMENT_WAIT_TIME_IN_MILLISECONDS 250
@@ -52,6 +55,16 @@ struct IECommandExecutorThreadContext {
   int port;
 };
 
+// A command posted to the executor window with WD_EXEC_COMMAND, and the
+// means to report its outcome. The window takes ownership of it, and
+// queues it by handle, so that the command parameters are never copied.
+struct QueuedCommand {
+  Command command;
+  CommandCompletionHandle completion;
+};
+
+typedef std::tr1::shared_ptr<QueuedCommand> QueuedCommandHandle;
+
 // We use a CWindowImpl (creating a hidden window) here because we
 // want to synchronize access to the command handler. For that we
 // use SendMessage() most of the time, and SendMessage() requires
@@ -63,10 +76,7 @@ class IECommandExecutor : public CWindowImpl<IECommandExecutor> {
   BEGIN_MSG_MAP(Session)
     MESSAGE_HANDLER(WM_CREATE, OnCreate)
     MESSAGE_HANDLER(WM_DESTROY, OnDestroy)
-    MESSAGE_HANDLER(WD_SET_COMMAND, OnSetCommand)
     MESSAGE_HANDLER(WD_EXEC_COMMAND, OnExecCommand)
-    MESSAGE_HANDLER(WD_GET_RESPONSE_LENGTH, OnGetResponseLength)
-    MESSAGE_HANDLER(WD_GET_RESPONSE, OnGetResponse)
     MESSAGE_HANDLER(WD_WAIT, OnWait)
     MESSAGE_HANDLER(WD_BROWSER_NEW_WINDOW, OnBrowserNewWindow)
     MESSAGE_HANDLER(WD_BROWSER_QUIT, OnBrowserQuit)
@@ -79,10 +89,7 @@ class IECommandExecutor : public CWindowImpl<IECommandExecutor> {
 
   LRESULT OnCreate(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
   LRESULT OnDestroy(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
-  LRESULT OnSetCommand(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
   LRESULT OnExecCommand(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
-  LRESULT OnGetResponseLength(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
-  LRESULT OnGetResponse(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
   LRESULT OnWait(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
   LRESULT OnBrowserNewWindow(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
   LRESULT OnBrowserQuit(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
@@ -193,11 +200,14 @@ class IECommandExecutor : public CWindowImpl<IECommandExecutor> {
  private:
   typedef std::tr1::unordered_map<std::string, BrowserHandle> BrowserMap;
   typedef std::map<std::string, std::wstring> ElementFindMethodMap;
-  typedef std::map<std::string, CommandHandlerHandle> CommandHandlerMap;
+  // Indexed by command type; empty for commands that are not implemented.
+  typedef std::vector<CommandHandlerHandle> CommandHandlerList;
 
   void AddManagedBrowser(BrowserHandle browser_wrapper);
 
+  void ExecuteNextCommand(void);
   void DispatchCommand(void);
+  void CompleteCommandIfReady(void);
 
   void PopulateCommandHandlers(void);
   void PopulateElementFinderMethods(void);
@@ -228,9 +238,16 @@ class IECommandExecutor : public CWindowImpl<IECommandExecutor> {
   std::string initial_browser_url_;
   std::string unexpected_alert_behavior_;
 
+  // Commands waiting for the current command to complete, in the order
+  // they were received.
+  std::queue<QueuedCommandHandle> command_queue_;
   Command current_command_;
-  std::string serialized_response_;
-  CommandHandlerMap command_handlers_;
+  // Reports the outcome of the current command; empty when no command is
+  // executing.
+  CommandCompletionHandle current_completion_;
+  Response current_response_;
+  bool is_response_ready_;
+  CommandHandlerList command_handlers_;
   bool is_waiting_;
   bool is_valid_;
   bool is_quitting_;
@@ -21,7 +21,14 @@ IEServer::IEServer(int port,
                    const std::string& host,
                    const std::string& log_level,
                    const std::string& log_file,
-                   const std::string& version) : Server(port, host, log_level, log_file) {
+                   const std::string& version,
+                   int thread_count,
+                   int queue_size) : Server(port,
+                                            host,
+                                            log_level,
+                                            log_file,
+                                            thread_count,
+                                            queue_size) {
   LOG(TRACE) << "Entering IEServer::IEServer";
 
   this->version_ = version;
@@ -39,7 +46,7 @@ SessionHandle IEServer::InitializeSession() {
   return session_handle;
 }
 
-std::string IEServer::GetStatus() {
+void IEServer::GetStatus(Response* response) {
   LOG(TRACE) << "Entering IEServer::GetStatus";
   //SYSTEM_INFO system_info;
   //::ZeroMemory(&system_info, sizeof(SYSTEM_INFO));
@@ -71,9 +78,7 @@ std::string IEServer::GetStatus() {
   Json::Value status;
   status["build"] = build;
   status["os"] = os;
-  Response response;
-  response.SetSuccessResponse(status);
-  return response.Serialize();
+  response->SetSuccessResponse(status);
 }
 
 void IEServer::ShutDown() {
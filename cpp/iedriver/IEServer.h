@@ -26,12 +26,14 @@ class IEServer : public Server {
            const std::string& host,
            const std::string& log_level,
            const std::string& log_file,
-           const std::string& version);
+           const std::string& version,
+           int thread_count,
+           int queue_size);
   virtual ~IEServer(void);
 
  protected:
   virtual SessionHandle InitializeSession(void);
-  virtual std::string GetStatus(void);
+  virtual void GetStatus(Response* response);
   virtual void ShutDown(void);
  private:
   std::string version_;
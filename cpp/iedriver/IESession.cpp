@@ -182,52 +182,82 @@ bool IESession::WaitForCommandExecutorExit(int timeout_in_milliseconds) {
   return is_quitting == 0;
 }
 
-bool IESession::ExecuteCommand(const std::string& serialized_command,
-                               std::string* serialized_response) {
+bool IESession::ExecuteCommand(const Command& command, Response* response) {
   LOG(TRACE) << "Entering IESession::ExecuteCommand";
 
-  // Sending a command consists of five actions:
-  // 1. Setting the command to be executed
-  // 2. Executing the command
-  // 3. Waiting for the response to be populated
-  // 4. Retrieving the response
-  // 5. Retrieving whether the command sent caused the session to be ready for shutdown
-  ::SendMessage(this->executor_window_handle_,
-                WD_SET_COMMAND,
-                NULL,
-                reinterpret_cast<LPARAM>(serialized_command.c_str()));
-  ::PostMessage(this->executor_window_handle_,
-                WD_EXEC_COMMAND,
-                NULL,
-                NULL);
-  
-  int response_length = static_cast<int>(::SendMessage(this->executor_window_handle_,
-                                                       WD_GET_RESPONSE_LENGTH,
-                                                       NULL,
-                                                       NULL));
-  LOG(TRACE) << "Beginning wait for response length to be not zero";
-  while (response_length == 0) {
-    // Sleep a short time to prevent thread starvation on single-core machines.
-    ::Sleep(10);
-    response_length = static_cast<int>(::SendMessage(this->executor_window_handle_,
-                                                     WD_GET_RESPONSE_LENGTH,
-                                                     NULL,
-                                                     NULL));
+  std::tr1::shared_ptr<SynchronousCompletion> completion(
+      new SynchronousCompletion(this->executor_window_handle_,
+                                this->session_id()));
+  this->ExecuteCommandAsync(command, completion);
+  return completion->Wait(response);
+}
+
+void IESession::ExecuteCommandAsync(const Command& command,
+                                    CommandCompletionHandle completion) {
+  LOG(TRACE) << "Entering IESession::ExecuteCommandAsync";
+
+  // The executor window queues the command behind any it is already
+  // executing, and reports the outcome through the completion from its
+  // own thread once the command, and any page load it starts, is done.
+  QueuedCommand* queued_command = new QueuedCommand;
+  queued_command->command = command;
+  queued_command->completion = completion;
+  if (!::PostMessage(this->executor_window_handle_,
+                     WD_EXEC_COMMAND,
+                     NULL,
+                     reinterpret_cast<LPARAM>(queued_command))) {
+    LOGERR(WARN) << "Unable to post command to executor window";
+    delete queued_command;
+    Response response(this->session_id());
+    response.SetErrorResponse(ENOSUCHDRIVER, "Session has been shut down");
+    completion->Complete(&response, false);
+  }
+}
+
+IESession::SynchronousCompletion::SynchronousCompletion(
+    HWND executor_window_handle,
+    const std::string& session_id)
+    : executor_window_handle_(executor_window_handle),
+      session_id_(session_id),
+      session_is_valid_(false) {
+  this->event_handle_ = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+IESession::SynchronousCompletion::~SynchronousCompletion(void) {
+  ::CloseHandle(this->event_handle_);
+}
+
+void IESession::SynchronousCompletion::Complete(Response* response,
+                                                bool session_is_valid) {
+  this->response_.Swap(response);
+  this->session_is_valid_ = session_is_valid;
+  ::SetEvent(this->event_handle_);
+}
+
+bool IESession::SynchronousCompletion::Wait(Response* response) {
+  LOG(TRACE) << "Beginning wait for response to be ready";
+  // The executor completes every command it receives, even when it is
+  // shutting down, so only a window that is gone can leave this waiting.
+  while (::WaitForSingleObject(this->event_handle_,
+                               EXECUTOR_EXIT_WAIT_INTERVAL) == WAIT_TIMEOUT) {
+    if (!::IsWindow(this->executor_window_handle_)) {
+      // The executor thread finishes leftover commands after destroying
+      // the window, so give it the same time it gets to exit.
+      if (::WaitForSingleObject(this->event_handle_,
+                                EXECUTOR_EXIT_WAIT_TIMEOUT) == WAIT_OBJECT_0) {
+        break;
+      }
+      LOG(WARN) << "Executor window is gone, abandoning wait for response";
+      Response error_response(this->session_id_);
+      error_response.SetErrorResponse(ENOSUCHDRIVER,
+                                      "Session has been shut down");
+      response->Swap(&error_response);
+      return false;
+    }
   }
-  LOG(TRACE) << "Found non-zero response length";
-
-  // Must add one to the length to handle the terminating character.
-  std::vector<char> response_buffer(response_length + 1);
-  ::SendMessage(this->executor_window_handle_,
-                WD_GET_RESPONSE,
-                NULL,
-                reinterpret_cast<LPARAM>(&response_buffer[0]));
-  *serialized_response = &response_buffer[0];
-  bool session_is_valid = ::SendMessage(this->executor_window_handle_,
-                                        WD_IS_SESSION_VALID,
-                                        NULL,
-                                        NULL) != 0;
-  return session_is_valid;
+  LOG(TRACE) << "Found response ready";
+  response->Swap(&this->response_);
+  return this->session_is_valid_;
 }
 
 } // namespace webdriver
@@ -36,10 +36,32 @@ public:
 
   void Initialize(void* init_params);
   void ShutDown(void);
-  bool ExecuteCommand(const std::string& serialized_command,
-                      std::string* serialized_response);
+  bool ExecuteCommand(const Command& command, Response* response);
+  void ExecuteCommandAsync(const Command& command,
+                           CommandCompletionHandle completion);
 
 private:
+  // Lets a caller of ExecuteCommand wait for the outcome of a command
+  // executed asynchronously. The wait gives up with an error response
+  // if the executor window goes away without completing the command.
+  class SynchronousCompletion : public CommandCompletion {
+   public:
+    SynchronousCompletion(HWND executor_window_handle,
+                          const std::string& session_id);
+    virtual ~SynchronousCompletion(void);
+
+    void Complete(Response* response, bool session_is_valid);
+    bool is_cancelled(void) { return false; }
+    bool Wait(Response* response);
+
+   private:
+    HANDLE event_handle_;
+    HWND executor_window_handle_;
+    std::string session_id_;
+    Response response_;
+    bool session_is_valid_;
+  };
+
   bool WaitForCommandExecutorExit(int timeout_in_milliseconds);
   HWND executor_window_handle_;
 };
@@ -18,7 +18,9 @@ webdriver::Server* StartServer(int port,
                                const std::wstring& host,
                                const std::wstring& log_level,
                                const std::wstring& log_file,
-                               const std::wstring& version) {
+                               const std::wstring& version,
+                               int thread_count,
+                               int queue_size) {
   LOG(TRACE) << "Entering StartServer";
   if (server == NULL) {
     LOG(DEBUG) << "Instantiating webdriver server";
@@ -31,7 +33,9 @@ webdriver::Server* StartServer(int port,
                                      converted_host,
                                      converted_log_level,
                                      converted_log_file,
-                                     converted_version);
+                                     converted_version,
+                                     thread_count,
+                                     queue_size);
     if (!server->Start()) {
       LOG(TRACE) << "Starting of IEServer is failed";
       delete server;
@@ -28,7 +28,9 @@ EXPORT webdriver::Server* StartServer(int port,
                                       const std::wstring& host,
                                       const std::wstring& log_level,
                                       const std::wstring& log_file,
-                                      const std::wstring& version);
+                                      const std::wstring& version,
+                                      int thread_count,
+                                      int queue_size);
 EXPORT void StopServer(void);
 
 #ifdef __cplusplus
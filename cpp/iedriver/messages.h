@@ -12,10 +12,7 @@
 // limitations under the License.
 
 #define WD_INIT WM_APP + 1
-#define WD_SET_COMMAND WM_APP + 2
 #define WD_EXEC_COMMAND WM_APP + 3
-#define WD_GET_RESPONSE_LENGTH WM_APP + 4
-#define WD_GET_RESPONSE WM_APP + 5
 #define WD_WAIT WM_APP + 6
 #define WD_BROWSER_NEW_WINDOW WM_APP + 7
 #define WD_BROWSER_QUIT WM_APP + 8
@@ -24,7 +24,7 @@
 // by the .dll produced by the IEDriver project in this solution.
 // The definitions of these functions can be found in WebDriver.h
 // in that project.
-typedef void* (__cdecl *STARTSERVERPROC)(int, const std::wstring&, const std::wstring&, const std::wstring&, const std::wstring&);
+typedef void* (__cdecl *STARTSERVERPROC)(int, const std::wstring&, const std::wstring&, const std::wstring&, const std::wstring&, int, int);
 typedef void (__cdecl *STOPSERVERPROC)(void);
 
 #define ERR_DLL_EXTRACT_FAIL 1
@@ -43,6 +43,8 @@ typedef void (__cdecl *STOPSERVERPROC)(void);
 #define LOGFILE_COMMAND_LINE_ARG L"log-file"
 #define SILENT_COMMAND_LINE_ARG L"silent"
 #define EXTRACTPATH_COMMAND_LINE_ARG L"extract-path"
+#define THREADS_COMMAND_LINE_ARG L"threads"
+#define QUEUESIZE_COMMAND_LINE_ARG L"queue-size"
 #define BOOLEAN_COMMAND_LINE_ARG_MISSING_VALUE L"value-not-specified"
 
 bool ExtractResource(unsigned short resource_id,
@@ -158,6 +160,7 @@ void ShowUsage(void) {
              << std::endl
              << L"IEDriverServer [/port=<port>] [/host=<host>] [/log-level=<level>]" << std::endl
              << L"               [/log-file=<file>] [/extract-path=<path>] [/silent]" << std::endl
+             << L"               [/threads=<count>] [/queue-size=<count>]" << std::endl
              << std::endl
              << L"  /port=<port>  Specifies the port on which the server will listen for" << std::endl
              << L"                commands. Defaults to 5555 if not specified." << std::endl
@@ -174,7 +177,15 @@ void ShowUsage(void) {
              << L"                Specifies the full path to the directory used to extract" << std::endl
              << L"                supporting files used by the server. Defaults to the TEMP" << std::endl
              << L"                directory if not specified." << std::endl
-             << L"  /silent       Suppresses diagnostic output when the server is started." << std::endl;
+             << L"  /silent       Suppresses diagnostic output when the server is started." << std::endl
+             << L"  /threads=<count>" << std::endl
+             << L"                Specifies the number of threads handling connections to the" << std::endl
+             << L"                server. Each client connection in use needs its own thread." << std::endl
+             << L"                Defaults to 10 if not specified." << std::endl
+             << L"  /queue-size=<count>" << std::endl
+             << L"                Specifies the number of connections that may wait for a free" << std::endl
+             << L"                thread. Further connections are refused with HTTP 503." << std::endl
+             << L"                Defaults to 20 if not specified." << std::endl;
 }
 
 int _tmain(int argc, _TCHAR* argv[]) {
@@ -230,6 +241,8 @@ int _tmain(int argc, _TCHAR* argv[]) {
   std::wstring host_address = args.GetValue(HOST_COMMAND_LINE_ARG, L"");
   std::wstring log_level = args.GetValue(LOGLEVEL_COMMAND_LINE_ARG, L"");
   std::wstring log_file = args.GetValue(LOGFILE_COMMAND_LINE_ARG, L"");
+  int thread_count = _wtoi(args.GetValue(THREADS_COMMAND_LINE_ARG, L"0").c_str());
+  int queue_size = _wtoi(args.GetValue(QUEUESIZE_COMMAND_LINE_ARG, L"0").c_str());
   bool silent = args.GetValue(SILENT_COMMAND_LINE_ARG,
       BOOLEAN_COMMAND_LINE_ARG_MISSING_VALUE).size() == 0;
   std::wstring executable_version = GetExecutableVersion();
@@ -237,13 +250,17 @@ int _tmain(int argc, _TCHAR* argv[]) {
                                             host_address,
                                             log_level,
                                             log_file,
-                                            executable_version);
+                                            executable_version,
+                                            thread_count,
+                                            queue_size);
   if (server_value == NULL) {
     std::wcout << L"Failed to start the server with: "
                << L"port = '" << port << L"', "
                << L"host = '" << host_address << L"', "
                << L"log level = '" << log_level << L"', "
-               << L"log file = '" << log_file << L"'.";
+               << L"log file = '" << log_file << L"', "
+               << L"threads = '" << thread_count << L"', "
+               << L"queue size = '" << queue_size << L"'.";
     return ERR_SERVER_START;
   }
   if (!silent) {
@@ -268,6 +285,16 @@ int _tmain(int argc, _TCHAR* argv[]) {
                  << log_file
                  << std::endl;
     }
+    if (thread_count > 0) {
+      std::wcout << L"Worker thread count is set to "
+                 << thread_count
+                 << std::endl;
+    }
+    if (queue_size > 0) {
+      std::wcout << L"Connection queue size is set to "
+                 << queue_size
+                 << std::endl;
+    }
     if (extraction_path_arg.size() > 0) {
       std::wcout << L"Library extracted to "
                  << extraction_path_arg
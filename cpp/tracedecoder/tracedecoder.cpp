@@ -0,0 +1,357 @@
+// Copyright 2013 Software Freedom Conservancy
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Turns a log file written in binary mode (see LOG::Binary in
+// webdriver-interactions/logging.h) back into the text lines the logger
+// would have written, with times shown in the local time zone.
+//
+// Usage: tracedecoder [-t] [file]
+//   -t  Shows the ID of the thread that logged each message.
+// Reads from stdin if no file is given.
+//
+// Built on its own, for example with
+//   g++ -I../webdriver-interactions -o tracedecoder tracedecoder.cpp
+//   cl /EHsc /I..\webdriver-interactions tracedecoder.cpp
+
+#include <stdio.h>
+#include <map>
+#include <sstream>
+#include <string>
+#include "logging.h"
+
+#ifdef _WIN32
+ #include <fcntl.h>
+#endif
+
+namespace {
+
+struct CallSite {
+  unsigned long long level;
+  unsigned long long line;
+  std::string file;
+};
+
+typedef std::map<unsigned long long, CallSite> CallSiteMap;
+typedef std::map<unsigned long long, std::string> LiteralMap;
+
+// Reads the parts of one record, failing once it runs out of bytes.
+class RecordReader {
+ public:
+  RecordReader(const char* data, size_t size)
+      : data_(data), size_(size), position_(0), is_valid_(true) {}
+
+  bool is_valid(void) const { return this->is_valid_; }
+  bool at_end(void) const { return this->position_ >= this->size_; }
+  size_t position(void) const { return this->position_; }
+
+  char ReadByte(void) {
+    if (this->position_ >= this->size_) {
+      this->is_valid_ = false;
+      return 0;
+    }
+    return this->data_[this->position_++];
+  }
+
+  unsigned long long ReadUnsigned(void) {
+    unsigned long long value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      unsigned char byte = static_cast<unsigned char>(this->ReadByte());
+      value |= static_cast<unsigned long long>(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    this->is_valid_ = false;
+    return value;
+  }
+
+  long long ReadSigned(void) {
+    unsigned long long value = this->ReadUnsigned();
+    return static_cast<long long>(value >> 1) ^ -static_cast<long long>(value & 1);
+  }
+
+  double ReadDouble(void) {
+    unsigned long long bits = 0;
+    for (int i = 0; i < 8; ++i) {
+      bits |= static_cast<unsigned long long>(
+          static_cast<unsigned char>(this->ReadByte())) << (i * 8);
+    }
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+  std::string ReadString(void) {
+    unsigned long long length = this->ReadUnsigned();
+    if (!this->is_valid_ || length > this->size_ - this->position_) {
+      this->is_valid_ = false;
+      return std::string();
+    }
+    std::string value(this->data_ + this->position_,
+                      static_cast<size_t>(length));
+    this->position_ += static_cast<size_t>(length);
+    return value;
+  }
+
+ private:
+  const char* data_;
+  size_t size_;
+  size_t position_;
+  bool is_valid_;
+};
+
+// Calls handler(type, body, body size) for each record in the trace.
+// Returns false if the trace ends in the middle of a record.
+template <class Handler>
+bool ForEachRecord(const std::string& trace, Handler* handler) {
+  const std::string header = LOG_TRACE_HEADER;
+  size_t position = 0;
+  while (position < trace.size()) {
+    if (trace.compare(position, header.size(), header) == 0) {
+      position += header.size();
+      continue;
+    }
+    RecordReader reader(trace.data() + position, trace.size() - position);
+    char type = reader.ReadByte();
+    unsigned long long length = reader.ReadUnsigned();
+    size_t prefix_size = reader.position();
+    if (!reader.is_valid() ||
+        length > trace.size() - position - prefix_size) {
+      return false;
+    }
+    handler->HandleRecord(type,
+                          trace.data() + position + prefix_size,
+                          static_cast<size_t>(length));
+    position += prefix_size + static_cast<size_t>(length);
+  }
+  return true;
+}
+
+// Collects the call sites and string literals defined in the trace.
+// Definitions can follow the messages that use them, as messages from
+// different threads are not written in the order they were numbered.
+class DefinitionCollector {
+ public:
+  DefinitionCollector(CallSiteMap* sites, LiteralMap* literals)
+      : sites_(sites), literals_(literals) {}
+
+  void HandleRecord(char type, const char* body, size_t size) {
+    RecordReader reader(body, size);
+    if (type == LOG_TRACE_SITE_RECORD) {
+      unsigned long long number = reader.ReadUnsigned();
+      CallSite site;
+      site.level = reader.ReadUnsigned();
+      site.line = reader.ReadUnsigned();
+      site.file = reader.ReadString();
+      if (reader.is_valid()) {
+        (*this->sites_)[number] = site;
+      }
+    } else if (type == LOG_TRACE_LITERAL_RECORD) {
+      unsigned long long number = reader.ReadUnsigned();
+      std::string text = reader.ReadString();
+      if (reader.is_valid()) {
+        (*this->literals_)[number] = text;
+      }
+    }
+  }
+
+ private:
+  CallSiteMap* sites_;
+  LiteralMap* literals_;
+};
+
+// Writes the messages in the trace as text lines.
+class MessageWriter {
+ public:
+  MessageWriter(const CallSiteMap& sites,
+                const LiteralMap& literals,
+                bool show_thread_id,
+                FILE* output)
+      : sites_(sites), literals_(literals),
+        show_thread_id_(show_thread_id), output_(output) {}
+
+  void HandleRecord(char type, const char* body, size_t size) {
+    RecordReader reader(body, size);
+    std::string line;
+    if (type == LOG_TRACE_MESSAGE_RECORD) {
+      line = this->FormatMessage(&reader);
+    } else if (type == LOG_TRACE_DROPPED_RECORD) {
+      unsigned long long time = reader.ReadUnsigned();
+      unsigned long long count = reader.ReadUnsigned();
+      std::ostringstream message;
+      message << "W " << FormatTime(time) << count
+              << " log messages were dropped because the log queue was full";
+      line = message.str();
+    } else {
+      return;
+    }
+    if (!reader.is_valid()) {
+      line.append(" [truncated record]");
+    }
+    line.push_back('\n');
+    fwrite(line.data(), sizeof(char), line.size(), this->output_);
+  }
+
+ private:
+  std::string FormatMessage(RecordReader* reader) {
+    static const char severity[] = { 'F', 'E', 'W', 'I', 'D', 'T' };
+    unsigned long long site_number = reader->ReadUnsigned();
+    unsigned long long thread_id = reader->ReadUnsigned();
+    unsigned long long time = reader->ReadUnsigned();
+
+    CallSite site;
+    site.level = sizeof(severity);
+    site.line = 0;
+    if (site_number == LOG_TRACE_UNNUMBERED_SITE) {
+      // The file, the line and the level lead the values; their value
+      // types are skipped here.
+      reader->ReadByte();
+      site.file = reader->ReadString();
+      reader->ReadByte();
+      site.line = reader->ReadUnsigned();
+      reader->ReadByte();
+      site.level = reader->ReadUnsigned();
+    } else {
+      CallSiteMap::const_iterator found = this->sites_.find(site_number);
+      if (found != this->sites_.end()) {
+        site = found->second;
+      } else {
+        std::ostringstream file;
+        file << "[unknown call site " << site_number << "]";
+        site.file = file.str();
+      }
+    }
+
+    std::ostringstream message;
+    message << (site.level < sizeof(severity) ? severity[site.level] : '?')
+            << ' ' << FormatTime(time);
+    if (this->show_thread_id_) {
+      message << '[' << thread_id << "] ";
+    }
+    if (site.level == 0) {
+      message << "FATAL ";
+    }
+    message << site.file << "(" << site.line << ") ";
+
+    while (reader->is_valid() && !reader->at_end()) {
+      char value_type = reader->ReadByte();
+      if (value_type == LOG_TRACE_SIGNED_VALUE) {
+        message << reader->ReadSigned();
+      } else if (value_type == LOG_TRACE_UNSIGNED_VALUE) {
+        message << reader->ReadUnsigned();
+      } else if (value_type == LOG_TRACE_DOUBLE_VALUE) {
+        message << reader->ReadDouble();
+      } else if (value_type == LOG_TRACE_CHAR_VALUE) {
+        message << reader->ReadByte();
+      } else if (value_type == LOG_TRACE_POINTER_VALUE) {
+        message << reinterpret_cast<const void*>(
+            static_cast<size_t>(reader->ReadUnsigned()));
+      } else if (value_type == LOG_TRACE_STRING_VALUE) {
+        message << reader->ReadString();
+      } else if (value_type == LOG_TRACE_LITERAL_VALUE) {
+        unsigned long long literal_number = reader->ReadUnsigned();
+        LiteralMap::const_iterator found = this->literals_.find(literal_number);
+        if (found != this->literals_.end()) {
+          message << found->second;
+        } else {
+          message << "[unknown string " << literal_number << "]";
+        }
+      } else {
+        message << "[unknown value type " << static_cast<int>(value_type) << "]";
+        break;
+      }
+    }
+    return message.str();
+  }
+
+  static std::string FormatTime(unsigned long long time) {
+    time_t seconds = static_cast<time_t>(time / 1000000);
+    unsigned int milliseconds = static_cast<unsigned int>(time % 1000000 / 1000);
+    struct tm local_time;
+#ifdef _WIN32
+    localtime_s(&local_time, &seconds);
+#else
+    localtime_r(&seconds, &local_time);
+#endif
+    char buffer[LOG_TIME_BUFFER_SIZE];
+    size_t length = strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S:", &local_time);
+    sprintf(buffer + length, "%03u ", milliseconds);
+    return buffer;
+  }
+
+  const CallSiteMap& sites_;
+  const LiteralMap& literals_;
+  bool show_thread_id_;
+  FILE* output_;
+};
+
+bool ReadTrace(FILE* input, std::string* trace) {
+  char buffer[65536];
+  size_t read_count;
+  while ((read_count = fread(buffer, sizeof(char), sizeof(buffer), input)) > 0) {
+    trace->append(buffer, read_count);
+  }
+  return ferror(input) == 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  bool show_thread_id = false;
+  const char* file_name = NULL;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "-t") {
+      show_thread_id = true;
+    } else if (file_name == NULL && arg.size() > 0 && arg[0] != '-') {
+      file_name = argv[i];
+    } else {
+      fprintf(stderr, "Usage: tracedecoder [-t] [file]\n");
+      return 2;
+    }
+  }
+
+  FILE* input = stdin;
+  if (file_name != NULL) {
+    input = fopen(file_name, "rb");
+    if (input == NULL) {
+      fprintf(stderr, "Cannot open %s\n", file_name);
+      return 1;
+    }
+  } else {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  }
+
+  std::string trace;
+  bool was_read = ReadTrace(input, &trace);
+  if (input != stdin) {
+    fclose(input);
+  }
+  if (!was_read) {
+    fprintf(stderr, "Cannot read the trace\n");
+    return 1;
+  }
+
+  CallSiteMap sites;
+  LiteralMap literals;
+  DefinitionCollector collector(&sites, &literals);
+  ForEachRecord(trace, &collector);
+  MessageWriter writer(sites, literals, show_thread_id, stdout);
+  if (!ForEachRecord(trace, &writer)) {
+    fprintf(stderr, "The trace ends in the middle of a record\n");
+    return 1;
+  }
+  return 0;
+}
@@ -30,6 +30,7 @@ limitations under the License.
 #include <stdlib.h>
 #include <assert.h>
 #include <list>
+#include <map>
 #include <algorithm>
 #include <functional>
 
@@ -125,21 +126,21 @@ void XModifierKey::StoreState(guint32* state_store) const
     " state store: " << *state_store << " non-mask bits: " << std::hex << non_mask_bits;
 }
 
-// Definition of a key press, release events pair.
-typedef std::pair<GdkEvent*, GdkEvent*> KeyEventsPair;
 enum KeyEventType { kKeyPress, kKeyRelease };
 // This class handles generation of key press / release events.
 // Events will be generated according to the given key to emulate
-// and state of modifier keys.
+// and state of modifier keys, and added to the given batch of events,
+// which must have been begun for the window.
 class KeypressEventsHandler
 {
 public:
-  KeypressEventsHandler(GdkDrawable* win_handle, guint32 modifiers_state);
+  KeypressEventsHandler(GdkDrawable* win_handle, guint32 modifiers_state,
+                        EventBatch* events);
   virtual ~KeypressEventsHandler();
 
   // Create a series of key release events that were left on at the end of
-  // a sendKeys call.
-  list<GdkEvent*> CreateModifierReleaseEvents();
+  // a sendKeys call. Returns the number of events created.
+  int CreateModifierReleaseEvents();
 
   // Creates a series of key events according to the key to emulate
   // Cases:
@@ -149,7 +150,7 @@ public:
   //    and Shift Up events.
   // 4. Modifier: KeyPress event only, unless it was down
   // already - in which case, a KeyRelease
-  list<GdkEvent*> CreateEventsForKey(wchar_t key_to_emulate);
+  void CreateEventsForKey(wchar_t key_to_emulate);
   // Returns the time of the latest event.
   guint32 get_last_event_time();
   // Returns the state of modifier keys, to be stored between calls.
@@ -157,6 +158,9 @@ public:
 
 
 private:
+  // The events created are added to the batch, and the pointers returned
+  // are valid only until the next event is created.
+
   // Create a keyboard event for a character or a non-modifier key
   // (arrow or tab keys, for example).
   GdkEvent* CreateKeyEvent(wchar_t key_to_emulate, KeyEventType ev_type);
@@ -167,7 +171,7 @@ private:
   // the instance of this class knows about.
   bool IsModifierKey(wchar_t key);
   // Generates key down / up pair for a regular character.
-  KeyEventsPair CreateKeyDownUpEvents(wchar_t key_to_emulate);
+  void CreateKeyDownUpEvents(wchar_t key_to_emulate);
 
   // Creates a generic key event - used by the public methods
   // that generate events. Not used for modifier keys.
@@ -206,6 +210,8 @@ private:
   guint32 last_event_time_;
   // State of modifier keys - initialized from a global
   guint32 modifiers_state_;
+  // The batch the events are added to.
+  EventBatch* events_;
 };
 
 // Sets the is_modifier field of the GdkEvent according to the supplied
@@ -216,9 +222,10 @@ static void SetIsModifierEvent(GdkEvent* p_ev, bool is_modifier)
   p_ev->key.is_modifier = (int) is_modifier;
 }
 
-KeypressEventsHandler::KeypressEventsHandler(GdkDrawable* win_handle, guint32 modifiers_state) :
+KeypressEventsHandler::KeypressEventsHandler(GdkDrawable* win_handle, guint32 modifiers_state,
+                                             EventBatch* events) :
   modifiers_(), win_handle_(win_handle), last_event_time_(TimeSinceBootMsec()),
-  modifiers_state_(modifiers_state)
+  modifiers_state_(modifiers_state), events_(events)
 {
   InitModifiers();
 }
@@ -319,10 +326,10 @@ GdkEvent* KeypressEventsHandler::CreateEmptyKeyEvent(KeyEventType ev_type)
   if (ev_type == kKeyRelease) {
     gdk_ev = GDK_KEY_RELEASE;
   }
-  GdkEvent* p_ev = gdk_event_new(gdk_ev);
-  p_ev->key.window = GDK_WINDOW(g_object_ref(win_handle_));
+  // The window is set by the batch, which holds the reference on it.
+  GdkEvent* p_ev = events_->AddEvent(gdk_ev);
   p_ev->key.send_event = 0; // NOT a synthesized event.
-  p_ev->key.time = TimeSinceBootMsec();
+  p_ev->key.time = NextEventTime();
   // Also update the latest event time
   last_event_time_ = p_ev->key.time;
   // Deprecated.
@@ -345,19 +352,151 @@ GdkEvent* KeypressEventsHandler::CreateEmptyKeyEvent(KeyEventType ev_type)
   return p_ev;
 }
 
-static guint16 get_keycode_for_key(guint for_key)
+// This class maps keysyms to the keycodes of the keys that produce them.
+// It keeps a connection to the X display open, rather than opening one for
+// every key event, and reads the whole keyboard mapping over it with a
+// single request. The X server sends MappingNotify to every client when
+// the mapping changes, so the same connection tells when to read it again.
+class KeycodeCache
+{
+ public:
+  KeycodeCache();
+  ~KeycodeCache();
+  // Connects to the named display, unless connected to it already, and
+  // reads the keyboard mapping again if it has changed. Returns false if
+  // the display cannot be opened.
+  bool Update(const char* display_name);
+  // Returns the keycode of a key that produces the keysym, or 0 if no
+  // key does.
+  KeyCode GetKeycode(KeySym keysym);
+ private:
+  void Disconnect();
+  void LoadKeyboardMapping();
+
+  Display* xdisplay_;
+  string display_name_;
+  map<KeySym, KeyCode> keycodes_;
+};
+
+KeycodeCache::KeycodeCache() : xdisplay_(NULL), display_name_(), keycodes_()
+{
+}
+
+KeycodeCache::~KeycodeCache()
+{
+  Disconnect();
+}
+
+bool KeycodeCache::Update(const char* display_name)
+{
+  if (xdisplay_ != NULL && display_name_ != display_name) {
+    Disconnect();
+  }
+
+  if (xdisplay_ == NULL) {
+    xdisplay_ = XOpenDisplay(display_name);
+    if (xdisplay_ == NULL) {
+      LOG(WARN) << "Unable to open display " << display_name;
+      return false;
+    }
+    display_name_ = display_name;
+    LoadKeyboardMapping();
+    return true;
+  }
+
+  // No events are selected on this connection, so the only events
+  // queued on it are MappingNotify.
+  bool keyboard_mapping_changed = false;
+  XEvent event;
+  while (XCheckTypedEvent(xdisplay_, MappingNotify, &event)) {
+    XRefreshKeyboardMapping(&event.xmapping);
+    if (event.xmapping.request != MappingPointer) {
+      keyboard_mapping_changed = true;
+    }
+  }
+  if (keyboard_mapping_changed) {
+    LoadKeyboardMapping();
+  }
+  return true;
+}
+
+KeyCode KeycodeCache::GetKeycode(KeySym keysym)
+{
+  map<KeySym, KeyCode>::iterator it = keycodes_.find(keysym);
+  if (it != keycodes_.end()) {
+    return it->second;
+  }
+  if (xdisplay_ == NULL) {
+    return 0;
+  }
+
+  // Not in the mapping as read - ask Xlib, which also knows of keysyms
+  // that are only the other case of one in the mapping, and remember
+  // the answer, even if there is no such key.
+  KeyCode kc = XKeysymToKeycode(xdisplay_, keysym);
+  keycodes_[keysym] = kc;
+  return kc;
+}
+
+void KeycodeCache::Disconnect()
+{
+  if (xdisplay_ != NULL) {
+    XCloseDisplay(xdisplay_);
+    xdisplay_ = NULL;
+  }
+  display_name_.clear();
+  keycodes_.clear();
+}
+
+void KeycodeCache::LoadKeyboardMapping()
+{
+  keycodes_.clear();
+
+  int min_keycode = 0;
+  int max_keycode = 0;
+  XDisplayKeycodes(xdisplay_, &min_keycode, &max_keycode);
+  int keycode_count = max_keycode - min_keycode + 1;
+  int keysyms_per_keycode = 0;
+  KeySym* keysyms = XGetKeyboardMapping(xdisplay_, min_keycode, keycode_count,
+                                        &keysyms_per_keycode);
+  if (keysyms == NULL) {
+    LOG(WARN) << "Unable to get the keyboard mapping";
+    return;
+  }
+
+  // Like XKeysymToKeycode, prefer a key that produces the keysym without
+  // modifiers: go through the first keysym of every key, then the second,
+  // and so on, keeping the first key found for each keysym.
+  for (int column = 0; column < keysyms_per_keycode; ++column) {
+    for (int i = 0; i < keycode_count; ++i) {
+      KeySym keysym = keysyms[i * keysyms_per_keycode + column];
+      if (keysym != NoSymbol) {
+        keycodes_.insert(make_pair(keysym, (KeyCode) (min_keycode + i)));
+      }
+    }
+  }
+  XFree(keysyms);
+
+  LOG(DEBUG) << "Loaded keyboard mapping: " << keycodes_.size()
+             << " keysyms on keycodes " << min_keycode << " to " << max_keycode;
+}
+
+// Kept for the life of the process, so that the display connection and
+// the keyboard mapping are shared by all calls.
+static KeycodeCache gKeycodeCache;
+
+static void update_keycode_cache()
 {
-  guint16 ret_kc;
   const char* display_name = gdk_display_get_name(gdk_display_get_default());
-  Display* xdisplay = XOpenDisplay(display_name);
-  assert(xdisplay != NULL);
+  gKeycodeCache.Update(display_name);
+}
 
-  KeyCode kc = XKeysymToKeycode(xdisplay, for_key);
+static guint16 get_keycode_for_key(guint for_key)
+{
+  KeyCode kc = gKeycodeCache.GetKeycode(for_key);
   LOG(DEBUG) << "Got keycode: " << (int) kc;
-  XCloseDisplay(xdisplay);
-  ret_kc = (int) kc;
 
-  return ret_kc;
+  return (guint16) kc;
 }
 
 GdkEvent* KeypressEventsHandler::CreateGenericKeyEvent(wchar_t key_to_emulate,
@@ -404,12 +543,11 @@ GdkEvent* KeypressEventsHandler::CreateKeyEvent(wchar_t key_to_emulate,
     return CreateGenericKeyEvent(key_to_emulate, ev_type);
 }
 
-KeyEventsPair KeypressEventsHandler::CreateKeyDownUpEvents(
+void KeypressEventsHandler::CreateKeyDownUpEvents(
     wchar_t key_to_emulate)
 {
-  GdkEvent* down = CreateKeyEvent(key_to_emulate, kKeyPress);
-  GdkEvent* up = CreateKeyEvent(key_to_emulate, kKeyRelease);
-  return std::make_pair(down, up);
+  CreateKeyEvent(key_to_emulate, kKeyPress);
+  CreateKeyEvent(key_to_emulate, kKeyRelease);
 }
 
 GdkEvent* KeypressEventsHandler::CreateModifierKeyEvent(
@@ -430,22 +568,21 @@ GdkEvent* KeypressEventsHandler::CreateModifierKeyEvent(
     return ret_event;
 }
 
-list<GdkEvent*> KeypressEventsHandler::CreateModifierReleaseEvents()
+int KeypressEventsHandler::CreateModifierReleaseEvents()
 {
-  list<GdkEvent*> ret_list;
+  int num_released = 0;
   for (list<XModifierKey>::iterator it = modifiers_.begin();
        it != modifiers_.end(); ++it) {
     if (it->get_toggle()) {
-      GdkEvent* rel_event =
-          CreateGenericModifierKeyEvent(it->get_associated_key(), kKeyRelease);
-      ret_list.push_back(rel_event);
+      CreateGenericModifierKeyEvent(it->get_associated_key(), kKeyRelease);
+      num_released++;
       it->ClearModifier();
     }
   }
 
   StoreModifiersState();
 
-  return ret_list;
+  return num_released;
 }
 
 bool is_lowercase_symbol(wchar_t key_to_emulate)
@@ -470,14 +607,14 @@ bool is_lowercase_symbol(wchar_t key_to_emulate)
   return true;
 }
 
-list<GdkEvent*> KeypressEventsHandler::CreateEventsForKey(
+void KeypressEventsHandler::CreateEventsForKey(
     wchar_t key_to_emulate)
 {
- list<GdkEvent*> ret_list;
   // First case - is it the NULL symbol? If so, reset modifiers and exit.
   if (key_to_emulate == gNullKey) {
     LOG(DEBUG) << "Null key - clearing modifiers.";
-    return CreateModifierReleaseEvents();
+    CreateModifierReleaseEvents();
+    return;
   }
 
   // Now: The key is either a modifier key or character key.
@@ -496,9 +633,7 @@ list<GdkEvent*> KeypressEventsHandler::CreateEventsForKey(
       // Create only two events.
       // Note that if the Shift modifier is set, this character will
       // be converted to uppercase by CreateKeyEvent method.
-      KeyEventsPair ev = CreateKeyDownUpEvents(key_to_emulate);
-      ret_list.push_back(ev.first);
-      ret_list.push_back(ev.second);
+      CreateKeyDownUpEvents(key_to_emulate);
     } else {
       // Uppercase letter/symbol: Fire up shift down event, this key and 
       // shift up event (unless the Shift modifier is already set)
@@ -506,19 +641,15 @@ list<GdkEvent*> KeypressEventsHandler::CreateEventsForKey(
       LOG(DEBUG) << "Uppercase letter. Was shift set? " << shift_was_set;
       if (shift_was_set == false) {
         // push shift down event
-        ret_list.push_front(
-            CreateGenericModifierKeyEvent(GDK_Shift_L, kKeyPress));
+        CreateGenericModifierKeyEvent(GDK_Shift_L, kKeyPress);
         StoreModifierKeyState(GDK_Shift_L);
       }
-      KeyEventsPair ev = CreateKeyDownUpEvents(key_to_emulate);
       // Push the events themselves.
-      ret_list.push_back(ev.first);
-      ret_list.push_back(ev.second);
+      CreateKeyDownUpEvents(key_to_emulate);
 
       if (shift_was_set == false) {
         // push shift up event
-        ret_list.push_back(
-            CreateGenericModifierKeyEvent(GDK_Shift_L, kKeyRelease));
+        CreateGenericModifierKeyEvent(GDK_Shift_L, kKeyRelease);
         // Turn OFF the shift modifier!
         StoreModifierKeyState(GDK_Shift_L);
       }
@@ -529,11 +660,8 @@ list<GdkEvent*> KeypressEventsHandler::CreateEventsForKey(
     // released, the state indeed reflects that it was pressed.
     LOG(DEBUG) << "Key: " << key_to_emulate << " IS a modifier.";
     // generate only one keypress event, either press or release.
-    GdkEvent* p_ev = CreateModifierKeyEvent(key_to_emulate);
-    ret_list.push_back(p_ev);
+    CreateModifierKeyEvent(key_to_emulate);
   }
-
-  return ret_list;
 }
 
 KeypressEventsHandler::~KeypressEventsHandler()
@@ -541,23 +669,8 @@ KeypressEventsHandler::~KeypressEventsHandler()
   modifiers_.clear();
 }
 
-static void submit_and_free_event(GdkEvent* p_key_event, int sleep_time_ms)
-{
-  gdk_event_put(p_key_event);
-  gdk_event_free(p_key_event);
-  sleep_for_ms(sleep_time_ms);
-}
-
-static void submit_and_free_events_list(list<GdkEvent*>& events_list,
-                                        int sleep_time_ms)
-{
-    for_each(events_list.begin(), events_list.end(), print_key_event);
-
-    for_each(events_list.begin(), events_list.end(),
-             bind2nd(ptr_fun(submit_and_free_event), sleep_time_ms));
-
-    events_list.clear();
-}
+// Kept between calls, so that its storage is reused.
+static EventBatch gKeyEvents;
 
 // global variable declared here so it is not used beforehand.
 guint32 gModifiersState = 0;
@@ -578,20 +691,33 @@ void updateLastEventTime(const guint32 lastEventTime) {
   }
 }
 
+// A caller that asks for no time between keys gets all of the events put
+// in the GDK queue at once, without sleeping. Sleeping between events
+// only spaces out their times: they are handled on the thread that puts
+// them, once sendKeys returns. The caller then waits for them to be
+// handled with pending_input_events.
+static bool isBatchedKeyInjection(int requestedTimePerKey)
+{
+  return requestedTimePerKey <= 0;
+}
+
 extern "C"
 {
 void sendKeys(WINDOW_HANDLE windowHandle, const wchar_t* value, int requestedTimePerKey)
 {
   init_logging();
-  int timePerKey = getTimePerKey(requestedTimePerKey);
+  bool batched = isBatchedKeyInjection(requestedTimePerKey);
+  int timePerKey = (batched ? 0 : getTimePerKey(requestedTimePerKey));
 
   LOG(DEBUG) << "---------- starting sendKeys: " << windowHandle << " tpk: " <<
      timePerKey << "---------";
   GdkDrawable* hwnd = (GdkDrawable*) windowHandle;
+  update_keycode_cache();
 
   // The keyp_handler will remember the state of modifier keys and
   // will be used to generate the events themselves.
-  KeypressEventsHandler keyp_handler(hwnd, gModifiersState);
+  gKeyEvents.Begin(hwnd, NULL);
+  KeypressEventsHandler keyp_handler(hwnd, gModifiersState, &gKeyEvents);
 
   struct timespec sleep_time;
   sleep_time.tv_sec = timePerKey / 1000;
@@ -601,14 +727,19 @@ void sendKeys(WINDOW_HANDLE windowHandle, const wchar_t* value, int requestedTim
 
   int i = 0;
   while (value[i] != '\0') {
-    list<GdkEvent*> events_for_key =
-        keyp_handler.CreateEventsForKey(value[i]);
+    keyp_handler.CreateEventsForKey(value[i]);
 
-    submit_and_free_events_list(events_for_key, timePerKey);
+    if (!batched) {
+      gKeyEvents.Submit(timePerKey, print_key_event);
+    }
 
     i++;
   }
 
+  LOG(DEBUG) << "Submitting " << gKeyEvents.size() << " batched events.";
+  gKeyEvents.Submit(0, print_key_event);
+  gKeyEvents.End();
+
   updateLastEventTime(keyp_handler.get_last_event_time());
   gModifiersState = keyp_handler.getModifierKeysState();
 
@@ -619,21 +750,23 @@ void sendKeys(WINDOW_HANDLE windowHandle, const wchar_t* value, int requestedTim
 void releaseModifierKeys(WINDOW_HANDLE windowHandle, int requestedTimePerKey)
 {
   init_logging();
-  int timePerKey = getTimePerKey(requestedTimePerKey);
+  bool batched = isBatchedKeyInjection(requestedTimePerKey);
+  int timePerKey = (batched ? 0 : getTimePerKey(requestedTimePerKey));
 
   LOG(DEBUG) << "---------- starting releaseModifierKeys: " << windowHandle << " tpk: " <<
      timePerKey << "---------";
   GdkDrawable* hwnd = (GdkDrawable*) windowHandle;
+  update_keycode_cache();
 
   // The state of the modifier keys is stored - just calling release will work.
-  KeypressEventsHandler keyp_handler(hwnd, gModifiersState);
+  gKeyEvents.Begin(hwnd, NULL);
+  KeypressEventsHandler keyp_handler(hwnd, gModifiersState, &gKeyEvents);
 
   // Free the remaining modifiers that are still set.
-  list<GdkEvent*> modifier_release_events =
-      keyp_handler.CreateModifierReleaseEvents();
-  int num_released = modifier_release_events.size();
+  int num_released = keyp_handler.CreateModifierReleaseEvents();
 
-  submit_and_free_events_list(modifier_release_events, timePerKey);
+  gKeyEvents.Submit(timePerKey, print_key_event);
+  gKeyEvents.End();
 
   updateLastEventTime(keyp_handler.get_last_event_time());
   gModifiersState = keyp_handler.getModifierKeysState();
@@ -19,21 +19,61 @@ limitations under the License.
 #define _INTERACTIONS_LINUX_H_
 
 #include <gdk/gdk.h>
+#include <vector>
 
 #define INTERACTIONS_DEBUG
 #define INTERACTIONS_LOG_FILE "/tmp/native_ff_events_log"
 
 guint32 TimeSinceBootMsec();
+// Returns the time to stamp the next injected event with: the current
+// time, or just after the latest event injected if that is later, so that
+// event times never go backwards. Records it as the latest event time.
+guint32 NextEventTime();
 void sleep_for_ms(int sleep_time_ms);
 
 bool event_earlier_than(GdkEvent* ev, guint32 compare_time);
 bool is_gdk_keyboard_event(GdkEvent* ev);
 bool is_gdk_mouse_event(GdkEvent* ev);
 void print_key_event(GdkEvent* p_ev);
+// Called after injected events are put in the GDK queue;
+// pending_input_events reports them until GDK has handled them all.
+void notify_events_injected();
 
 void init_logging();
 extern guint32 gModifiersState;
 
+// A batch of events to put in the GDK queue. The events are kept by value
+// in storage that is reused from batch to batch, so that once it has grown
+// to the size needed, creating and sending events allocates nothing.
+// gdk_event_put queues a copy of each event, with references of its own;
+// the events of the batch share the references the batch holds on the
+// window and the device while it is in use.
+class EventBatch
+{
+ public:
+  EventBatch();
+  ~EventBatch();
+  // Starts using the batch for events on the given window, taking a
+  // reference on it. Takes over the caller's reference on the device, if
+  // there is one; the device is only needed for mouse events.
+  void Begin(GdkDrawable* window, GdkDevice* device);
+  // Appends a zeroed event of the given type, with its window (and, for
+  // mouse events, device) set. The event is valid until the next one is
+  // added.
+  GdkEvent* AddEvent(GdkEventType type);
+  size_t size() const;
+  // Puts the events in the GDK queue in order, logging each with
+  // print_event and sleeping for sleep_time_ms after each, then removes
+  // them from the batch.
+  void Submit(int sleep_time_ms, void (*print_event)(GdkEvent*));
+  // Releases the references taken by Begin.
+  void End();
+ private:
+  std::vector<GdkEvent> events_;
+  GdkWindow* window_;
+  GdkDevice* device_;
+};
+
 extern "C"
 {
 bool pending_input_events();
@@ -28,6 +28,7 @@ limitations under the License.
 #include <X11/Xlib.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <list>
 #include <algorithm>
@@ -40,6 +41,15 @@ using namespace std;
 
 guint32 gLatestEventTime = 0;
 
+// Injected events are known to have been handled when an idle callback,
+// added once they are put in the GDK queue, runs. Its priority is lower
+// than that of the GDK event source, which is ready whenever the GDK
+// queue is not empty, so it runs only after every event queued before it.
+// The id of the callback, or 0 if no injected events wait to be handled.
+static guint gEventsHandledSourceId = 0;
+// The time of the latest injected event known to have been handled.
+static guint32 gLatestHandledEventTime = 0;
+
 // This is the timestamp needed in the GDK events.
 guint32 TimeSinceBootMsec()
 {
@@ -56,6 +66,16 @@ guint32 TimeSinceBootMsec()
     return 0;
 }
 
+guint32 NextEventTime()
+{
+  guint32 event_time = TimeSinceBootMsec();
+  if (event_time <= gLatestEventTime) {
+    event_time = gLatestEventTime + 1;
+  }
+  gLatestEventTime = event_time;
+  return event_time;
+}
+
 void sleep_for_ms(int sleep_time_ms)
 {
   struct timespec sleep_time;
@@ -98,11 +118,21 @@ void print_key_event(GdkEvent* p_ev)
              << (int) p_ev->key.hardware_keycode << " ";
 }
 
-bool additional_events_to_wait_for(GdkEvent* p_event)
+static gboolean on_injected_events_handled(gpointer data)
 {
-  return ((p_event->type == GDK_LEAVE_NOTIFY) ||
-          (p_event->type == GDK_ENTER_NOTIFY));
+  gLatestHandledEventTime = gLatestEventTime;
+  gEventsHandledSourceId = 0;
+  LOG(DEBUG) << "Injected events handled. Latest: " << gLatestHandledEventTime;
+  return FALSE;
+}
 
+void notify_events_injected()
+{
+  if (gEventsHandledSourceId == 0) {
+    gEventsHandledSourceId = g_idle_add_full(G_PRIORITY_HIGH_IDLE,
+                                             on_injected_events_handled,
+                                             NULL, NULL);
+  }
 }
 
 void init_logging()
@@ -117,30 +147,85 @@ void init_logging()
 #endif
 }
 
-extern "C"
+EventBatch::EventBatch() : events_(), window_(NULL), device_(NULL)
 {
-bool pending_input_events()
+}
+
+EventBatch::~EventBatch()
+{
+  End();
+}
+
+void EventBatch::Begin(GdkDrawable* window, GdkDevice* device)
+{
+  End();
+  window_ = GDK_WINDOW(g_object_ref(window));
+  device_ = device;
+}
+
+GdkEvent* EventBatch::AddEvent(GdkEventType type)
 {
-  LOG(DEBUG) << "Waiting for all events to be processed. Latest: " << gLatestEventTime;
-  GdkEvent* lastEvent = gdk_event_peek();
-  LOG(DEBUG) << "Got event: " <<
-             (lastEvent != NULL ? lastEvent->type : 0);
-  if ((lastEvent != NULL) && is_gdk_keyboard_event(lastEvent)) {
-    print_key_event(lastEvent);
+  events_.resize(events_.size() + 1);
+  GdkEvent* p_ev = &events_.back();
+  memset(p_ev, 0, sizeof(GdkEvent));
+  p_ev->type = type;
+  p_ev->any.window = window_;
+  if (type == GDK_MOTION_NOTIFY) {
+    p_ev->motion.device = device_;
+  } else if (is_gdk_mouse_event(p_ev)) {
+    p_ev->button.device = device_;
   }
+  return p_ev;
+}
 
-  bool ret_val = false;
-  if (lastEvent != NULL &&
-      (((is_gdk_keyboard_event(lastEvent) || is_gdk_mouse_event(lastEvent)) &&
-      event_earlier_than(lastEvent, gLatestEventTime))
-       || (additional_events_to_wait_for(lastEvent)))) {
-    ret_val = true;
+size_t EventBatch::size() const
+{
+  return events_.size();
+}
+
+void EventBatch::Submit(int sleep_time_ms, void (*print_event)(GdkEvent*))
+{
+  if (events_.empty()) {
+    return;
+  }
+  for (vector<GdkEvent>::iterator it = events_.begin();
+       it != events_.end(); ++it) {
+    print_event(&*it);
+  }
+  for (vector<GdkEvent>::iterator it = events_.begin();
+       it != events_.end(); ++it) {
+    gdk_event_put(&*it);
+    if (sleep_time_ms > 0) {
+      sleep_for_ms(sleep_time_ms);
+    }
   }
+  // Keeps the storage for the next batch.
+  events_.clear();
+  notify_events_injected();
+}
 
-  if (lastEvent != NULL) {
-    gdk_event_free(lastEvent);
+void EventBatch::End()
+{
+  events_.clear();
+  if (window_ != NULL) {
+    g_object_unref(window_);
+    window_ = NULL;
+  }
+  if (device_ != NULL) {
+    g_object_unref(device_);
+    device_ = NULL;
   }
-  LOG(DEBUG) << "Returning: " << ret_val;
+}
+
+extern "C"
+{
+// Called by the driver in a loop that handles events between calls, so it
+// must not block: the events it waits for are handled on this thread.
+bool pending_input_events()
+{
+  bool ret_val = (gEventsHandledSourceId != 0);
+  LOG(DEBUG) << "Pending input events: " << ret_val << " Latest: " <<
+             gLatestEventTime << " handled: " << gLatestHandledEventTime;
 
   return ret_val;
 }
@@ -30,9 +30,7 @@ limitations under the License.
 #include <time.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <list>
 #include <algorithm>
-#include <functional>
 
 #include "translate_keycode_linux.h"
 #include "interactions_linux.h"
@@ -42,18 +40,20 @@ using namespace std;
 
 enum MouseEventType { bMousePress, bMouseRelease, bMouse2ButtonPress };
 // This class handles generation of mouse press / release events.
+// The events are added to the given batch of events, which must have
+// been begun for the window and a device.
 class MouseEventsHandler
 {
 public:
-  MouseEventsHandler(GdkDrawable* win_handle);
+  MouseEventsHandler(GdkDrawable* win_handle, EventBatch* events);
   virtual ~MouseEventsHandler();
 
   // Creates a series of mouse events (i.e mouse up/down)
-  list<GdkEvent*> CreateEventsForMouseMove(long x, long y);
-  list<GdkEvent*> CreateEventsForMouseClick(long x, long y, long button);
-  list<GdkEvent*> CreateEventsForMouseDoubleClick(long x, long y);
-  list<GdkEvent*> CreateEventsForMouseDown(long x, long y, long button);
-  list<GdkEvent*> CreateEventsForMouseUp(long x, long y, long button);
+  void CreateEventsForMouseMove(long x, long y);
+  void CreateEventsForMouseClick(long x, long y, long button);
+  void CreateEventsForMouseDoubleClick(long x, long y);
+  void CreateEventsForMouseDown(long x, long y, long button);
+  void CreateEventsForMouseUp(long x, long y, long button);
   // Returns the time of the latest event.
   guint32 get_last_event_time();
 
@@ -68,10 +68,14 @@ private:
   GdkDrawable* win_handle_;
   // Time of the most recent event created.
   guint32 last_event_time_;
+  // The batch the events are added to.
+  EventBatch* events_;
 };
 
-MouseEventsHandler::MouseEventsHandler(GdkDrawable* win_handle) :
-  win_handle_(win_handle), last_event_time_(TimeSinceBootMsec())
+MouseEventsHandler::MouseEventsHandler(GdkDrawable* win_handle,
+                                       EventBatch* events) :
+  win_handle_(win_handle), last_event_time_(TimeSinceBootMsec()),
+  events_(events)
 {
 }
 
@@ -80,9 +84,9 @@ guint32 MouseEventsHandler::get_last_event_time()
   return last_event_time_;
 }
 
-GdkDevice* getSomeDevice()
+GdkDevice* getSomeDevice(GdkDisplay* display)
 {
-  GList *pList = gdk_devices_list();
+  GList *pList = gdk_display_list_devices(display);
   GList *currNode = pList;
   GdkDevice *currDevice = NULL;
   while ((currNode != NULL) && (currDevice == NULL)) {
@@ -90,21 +94,100 @@ GdkDevice* getSomeDevice()
     currNode = currNode->next;
   }
 
-  return (GdkDevice*) g_object_ref(currDevice);
+  return currDevice;
+}
+
+// This class keeps the device given to mouse events, so that the devices
+// of the display are looked up once rather than for every call. GDK 2
+// adds no devices to a display once it is open, and the core pointer lasts
+// as long as the display, so the device only changes when the display
+// does or is closed.
+class PointerDeviceCache
+{
+ public:
+  PointerDeviceCache();
+  ~PointerDeviceCache();
+  // Returns a new reference on the device to use for the display, or NULL
+  // if it has none.
+  GdkDevice* GetDevice(GdkDisplay* display);
+ private:
+  void Invalidate();
+  static void OnDisplayClosed(GdkDisplay* display, gboolean is_error,
+                              gpointer cache);
+
+  GdkDisplay* display_;
+  GdkDevice* device_;
+  gulong closed_handler_id_;
+};
+
+PointerDeviceCache::PointerDeviceCache() : display_(NULL), device_(NULL),
+  closed_handler_id_(0)
+{
+}
+
+PointerDeviceCache::~PointerDeviceCache()
+{
+  Invalidate();
+}
+
+GdkDevice* PointerDeviceCache::GetDevice(GdkDisplay* display)
+{
+  if (display != display_) {
+    Invalidate();
+    GdkDevice* device = getSomeDevice(display);
+    if (device == NULL) {
+      LOG(WARN) << "No input device found for display " <<
+          gdk_display_get_name(display);
+      return NULL;
+    }
+    LOG(DEBUG) << "Caching input device for display " <<
+        gdk_display_get_name(display);
+    display_ = display;
+    device_ = (GdkDevice*) g_object_ref(device);
+    closed_handler_id_ = g_signal_connect(display, "closed",
+        G_CALLBACK(PointerDeviceCache::OnDisplayClosed), this);
+  }
+
+  return (GdkDevice*) g_object_ref(device_);
+}
+
+void PointerDeviceCache::Invalidate()
+{
+  if (display_ == NULL) {
+    return;
+  }
+  g_signal_handler_disconnect(display_, closed_handler_id_);
+  g_object_unref(device_);
+  display_ = NULL;
+  device_ = NULL;
+  closed_handler_id_ = 0;
+}
+
+void PointerDeviceCache::OnDisplayClosed(GdkDisplay* display,
+                                         gboolean is_error, gpointer cache)
+{
+  static_cast<PointerDeviceCache*>(cache)->Invalidate();
+}
+
+static PointerDeviceCache gPointerDevices;
+
+// Returns a new reference on the device to give mouse events on the window.
+static GdkDevice* get_device_for_window(GdkDrawable* hwnd)
+{
+  return gPointerDevices.GetDevice(gdk_drawable_get_display(hwnd));
 }
 
 GdkEvent* MouseEventsHandler::CreateMouseMotionEvent(long x, long y)
 {
-    GdkEvent* p_ev = gdk_event_new(GDK_MOTION_NOTIFY);
-    p_ev->motion.window = GDK_WINDOW(g_object_ref(win_handle_));
+    // The window and device are set by the batch, which holds the
+    // references on them. It is necessary to provide a device. any device.
+    GdkEvent* p_ev = events_->AddEvent(GDK_MOTION_NOTIFY);
     p_ev->motion.send_event = 0; // NOT a synthesized event.
-    p_ev->motion.time = TimeSinceBootMsec();
+    p_ev->motion.time = NextEventTime();
     p_ev->motion.x = x;
     p_ev->motion.y = y;
     p_ev->motion.axes = NULL;
     p_ev->motion.is_hint = 0;
-    // It is necessary to provide a device. any device.
-    p_ev->motion.device = getSomeDevice();
     p_ev->motion.state = gModifiersState;
 
     // Also update the latest event time
@@ -121,14 +204,12 @@ GdkEvent* MouseEventsHandler::CreateMouseButtonEvent(MouseEventType ev_type, lon
     } else if (ev_type == bMouse2ButtonPress) {
       gdk_ev = GDK_2BUTTON_PRESS;
     }
-    GdkEvent* p_ev = gdk_event_new(gdk_ev);
-    p_ev->button.window = GDK_WINDOW(g_object_ref(win_handle_));
+    GdkEvent* p_ev = events_->AddEvent(gdk_ev);
     p_ev->button.send_event = 0; // NOT a synthesized event.
-    p_ev->button.time = TimeSinceBootMsec();
+    p_ev->button.time = NextEventTime();
     p_ev->button.x = x;
     p_ev->button.y = y;
     p_ev->button.button = button;
-    p_ev->button.device = getSomeDevice();
     p_ev->button.state = gModifiersState;
 
     // Also update the latest event time
@@ -137,73 +218,43 @@ GdkEvent* MouseEventsHandler::CreateMouseButtonEvent(MouseEventType ev_type, lon
 }
 
 
-list<GdkEvent*> MouseEventsHandler::CreateEventsForMouseDown(long x, long y, long button)
+void MouseEventsHandler::CreateEventsForMouseDown(long x, long y, long button)
 {
-  GdkEvent* down = CreateMouseButtonEvent(bMousePress, x, y, button);
-  list<GdkEvent*> ret_list;
-  ret_list.push_back(down);
-  return ret_list;
+  CreateMouseButtonEvent(bMousePress, x, y, button);
 }
 
 
-list<GdkEvent*> MouseEventsHandler::CreateEventsForMouseUp(long x, long y, long button)
+void MouseEventsHandler::CreateEventsForMouseUp(long x, long y, long button)
 {
-  GdkEvent* up = CreateMouseButtonEvent(bMouseRelease, x, y, button);
-  list<GdkEvent*> ret_list;
-  ret_list.push_back(up);
-  return ret_list;
+  CreateMouseButtonEvent(bMouseRelease, x, y, button);
 }
 
-list<GdkEvent*> MouseEventsHandler::CreateEventsForMouseDoubleClick(long x, long y)
+void MouseEventsHandler::CreateEventsForMouseDoubleClick(long x, long y)
 {
   // double click is only possible with the left mouse button
   const int leftMouseButton = 1;
-  list<GdkEvent*> ret_list;
-  ret_list.push_back(CreateMouseButtonEvent(bMousePress, x, y, leftMouseButton));
-  ret_list.push_back(CreateMouseButtonEvent(bMouseRelease, x, y, leftMouseButton));
-  ret_list.push_back(CreateMouseButtonEvent(bMousePress, x, y, leftMouseButton));
-  ret_list.push_back(CreateMouseButtonEvent(bMouse2ButtonPress, x, y, leftMouseButton));
-  ret_list.push_back(CreateMouseButtonEvent(bMouseRelease, x, y, leftMouseButton));
-  return ret_list;
+  CreateMouseButtonEvent(bMousePress, x, y, leftMouseButton);
+  CreateMouseButtonEvent(bMouseRelease, x, y, leftMouseButton);
+  CreateMouseButtonEvent(bMousePress, x, y, leftMouseButton);
+  CreateMouseButtonEvent(bMouse2ButtonPress, x, y, leftMouseButton);
+  CreateMouseButtonEvent(bMouseRelease, x, y, leftMouseButton);
 }
 
-list<GdkEvent*> MouseEventsHandler::CreateEventsForMouseClick(long x, long y, long button)
+void MouseEventsHandler::CreateEventsForMouseClick(long x, long y, long button)
 {
-  GdkEvent* down = CreateMouseButtonEvent(bMousePress, x, y, button);
-  GdkEvent* up = CreateMouseButtonEvent(bMouseRelease, x, y, button);
-
-  list<GdkEvent*> ret_list;
-  ret_list.push_back(down);
-  ret_list.push_back(up);
-  return ret_list;
+  CreateMouseButtonEvent(bMousePress, x, y, button);
+  CreateMouseButtonEvent(bMouseRelease, x, y, button);
 }
 
-list<GdkEvent*> MouseEventsHandler::CreateEventsForMouseMove(long x, long y)
+void MouseEventsHandler::CreateEventsForMouseMove(long x, long y)
 {
-  GdkEvent* move = CreateMouseMotionEvent(x, y);
-  list<GdkEvent*> ret_list;
-  ret_list.push_back(move);
-  return ret_list;
+  CreateMouseMotionEvent(x, y);
 }
 
 MouseEventsHandler::~MouseEventsHandler()
 {
 }
 
-static void submit_and_free_event(GdkEvent* p_mouse_event, int sleep_time_ms)
-{
-  gdk_event_put(p_mouse_event);
-  GdkDevice* usedDevice = NULL;
-  if (p_mouse_event->type == GDK_MOTION_NOTIFY) {
-    usedDevice = p_mouse_event->motion.device;
-  } else {
-    usedDevice = p_mouse_event->button.device;
-  }
-  g_object_unref(usedDevice);
-  gdk_event_free(p_mouse_event);
-  sleep_for_ms(sleep_time_ms);
-}
-
 static void print_mouse_event(GdkEvent* p_ev)
 {
   if (!((p_ev->type == GDK_BUTTON_PRESS) || (p_ev->type == GDK_BUTTON_RELEASE)
@@ -232,16 +283,8 @@ static void print_mouse_event(GdkEvent* p_ev)
              p_ev->key.time;
 }
 
-static void submit_and_free_events_list(list<GdkEvent*>& events_list,
-                                        int sleep_time_ms)
-{
-    for_each(events_list.begin(), events_list.end(), print_mouse_event);
-
-    for_each(events_list.begin(), events_list.end(),
-             bind2nd(ptr_fun(submit_and_free_event), sleep_time_ms));
-
-    events_list.clear();
-}
+// Kept between calls, so that its storage is reused.
+static EventBatch gMouseEvents;
 
 extern "C"
 {
@@ -260,11 +303,13 @@ WD_RESULT clickAt(WINDOW_HANDLE windowHandle, long x, long y, long button)
     button = 1;
   }
 
-  MouseEventsHandler mousep_handler(hwnd);
+  gMouseEvents.Begin(hwnd, get_device_for_window(hwnd));
+  MouseEventsHandler mousep_handler(hwnd, &gMouseEvents);
 
-  list<GdkEvent*> events_for_mouse = mousep_handler.CreateEventsForMouseClick(x, y, button);
+  mousep_handler.CreateEventsForMouseClick(x, y, button);
   const int timePerEvent = 10 /* ms */;
-  submit_and_free_events_list(events_for_mouse, timePerEvent);
+  gMouseEvents.Submit(timePerEvent, print_mouse_event);
+  gMouseEvents.End();
 
 
   if (gLatestEventTime < mousep_handler.get_last_event_time()) {
@@ -282,11 +327,13 @@ WD_RESULT doubleClickAt(WINDOW_HANDLE windowHandle, long x, long y)
   LOG(DEBUG) << "---------- starting doubleClickAt: " << windowHandle <<  "---------";
   GdkDrawable* hwnd = (GdkDrawable*) windowHandle;
 
-  MouseEventsHandler mousep_handler(hwnd);
+  gMouseEvents.Begin(hwnd, get_device_for_window(hwnd));
+  MouseEventsHandler mousep_handler(hwnd, &gMouseEvents);
 
   const int timePerEvent = 10 /* ms */;
-  list<GdkEvent*> events_for_mouse = mousep_handler.CreateEventsForMouseDoubleClick(x, y);
-  submit_and_free_events_list(events_for_mouse, timePerEvent);
+  mousep_handler.CreateEventsForMouseDoubleClick(x, y);
+  gMouseEvents.Submit(timePerEvent, print_mouse_event);
+  gMouseEvents.End();
 
   if (gLatestEventTime < mousep_handler.get_last_event_time()) {
     gLatestEventTime = mousep_handler.get_last_event_time();
@@ -307,7 +354,8 @@ WD_RESULT mouseMoveTo(WINDOW_HANDLE windowHandle, long duration, long fromX, lon
   LOG(DEBUG) << "---------- starting mouseMoveTo: " << windowHandle <<  "---------";
   GdkDrawable* hwnd = (GdkDrawable*) windowHandle;
 
-  MouseEventsHandler mousep_handler(hwnd);
+  gMouseEvents.Begin(hwnd, get_device_for_window(hwnd));
+  MouseEventsHandler mousep_handler(hwnd, &gMouseEvents);
 
   long pointsDistance = distanceBetweenPoints(fromX, fromY, toX, toY);
   const int stepSizeInPixels = 5;
@@ -337,9 +385,10 @@ WD_RESULT mouseMoveTo(WINDOW_HANDLE windowHandle, long duration, long fromX, lon
     int currentX = fromX + ((toX - fromX) * ((double)i) / div_by);
     int currentY = fromY + ((toY - fromY) * ((double)i) / div_by);
     LOG(DEBUG) << "Moving to: (" << currentX << ", " << currentY << ")";
-    list<GdkEvent*> events_for_mouse = mousep_handler.CreateEventsForMouseMove(currentX, currentY);
-    submit_and_free_events_list(events_for_mouse, timePerEvent);
+    mousep_handler.CreateEventsForMouseMove(currentX, currentY);
+    gMouseEvents.Submit(timePerEvent, print_mouse_event);
   }
+  gMouseEvents.End();
 
 
 
@@ -363,7 +412,8 @@ WD_RESULT mouseDownAt(WINDOW_HANDLE windowHandle, long x, long y, long button)
   LOG(DEBUG) << "---------- starting mouseDownAt: " << windowHandle <<  "---------";
   GdkDrawable* hwnd = (GdkDrawable*) windowHandle;
 
-  MouseEventsHandler mousep_handler(hwnd);
+  gMouseEvents.Begin(hwnd, get_device_for_window(hwnd));
+  MouseEventsHandler mousep_handler(hwnd, &gMouseEvents);
 
   struct timespec sleep_time;
   sleep_time.tv_sec = timePerEvent / 1000;
@@ -371,8 +421,9 @@ WD_RESULT mouseDownAt(WINDOW_HANDLE windowHandle, long x, long y, long button)
   LOG(DEBUG) << "Sleep time is " << sleep_time.tv_sec << " seconds and " <<
             sleep_time.tv_nsec << " nanoseconds.";
 
-  list<GdkEvent*> events_for_mouse = mousep_handler.CreateEventsForMouseDown(x, y, button);
-  submit_and_free_events_list(events_for_mouse, timePerEvent);
+  mousep_handler.CreateEventsForMouseDown(x, y, button);
+  gMouseEvents.Submit(timePerEvent, print_mouse_event);
+  gMouseEvents.End();
 
 
   if (gLatestEventTime < mousep_handler.get_last_event_time()) {
@@ -395,7 +446,8 @@ WD_RESULT mouseUpAt(WINDOW_HANDLE windowHandle, long x, long y, long button)
   LOG(DEBUG) << "---------- starting mouseUpAt: " << windowHandle <<  "---------";
   GdkDrawable* hwnd = (GdkDrawable*) windowHandle;
 
-  MouseEventsHandler mousep_handler(hwnd);
+  gMouseEvents.Begin(hwnd, get_device_for_window(hwnd));
+  MouseEventsHandler mousep_handler(hwnd, &gMouseEvents);
 
   struct timespec sleep_time;
   sleep_time.tv_sec = timePerEvent / 1000;
@@ -403,8 +455,9 @@ WD_RESULT mouseUpAt(WINDOW_HANDLE windowHandle, long x, long y, long button)
   LOG(DEBUG) << "Sleep time is " << sleep_time.tv_sec << " seconds and " <<
             sleep_time.tv_nsec << " nanoseconds.";
 
-  list<GdkEvent*> events_for_mouse = mousep_handler.CreateEventsForMouseUp(x, y, button);
-  submit_and_free_events_list(events_for_mouse, timePerEvent);
+  mousep_handler.CreateEventsForMouseUp(x, y, button);
+  gMouseEvents.Submit(timePerEvent, print_mouse_event);
+  gMouseEvents.End();
 
 
   if (gLatestEventTime < mousep_handler.get_last_event_time()) {
@@ -418,23 +471,7 @@ WD_RESULT mouseUpAt(WINDOW_HANDLE windowHandle, long x, long y, long button)
 bool pending_mouse_events()
 {
   init_logging();
-  LOG(DEBUG) << "Waiting for all events to be processed";
-  GdkEvent* lastEvent = gdk_event_peek();
-  LOG(DEBUG) << "Got event: " <<
-             (lastEvent != NULL ? lastEvent->type : 0);
-
-  bool ret_val = false;
-  if (lastEvent != NULL && is_gdk_mouse_event(lastEvent) &&
-         event_earlier_than(lastEvent, gLatestEventTime)) {
-    ret_val = true;
-  }
-
-  if (lastEvent != NULL) {
-    gdk_event_free(lastEvent);
-  }
-  LOG(DEBUG) << "Returning: " << ret_val;
-
-  return ret_val;
+  return pending_input_events();
 }
 
 } // extern C
@@ -30,20 +30,744 @@ limitations under the License.
 #endif
 
 #ifdef unix
+ #include <sys/time.h>
  #include <sys/types.h>
  #include <unistd.h>
 #else
  #include <io.h>
  #include <comdef.h>
 #endif
+#ifdef _WIN32
+ #include <process.h>
+#else
+ #include <pthread.h>
+ #include <sched.h>
+#endif
+#ifdef __linux__
+ #include <sys/syscall.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/timeb.h>
 #include <time.h>
 #include <sstream>
 #include <string>
 #include <iostream>
 
+// Large enough for "YYYY-MM-DD HH:MM:SS:mmm ".
+#define LOG_TIME_BUFFER_SIZE 32
+
+// Atomic operations on values shared between threads, for the parts of
+// the logger that take no lock. Loads acquire, and stores release.
+class LogAtomic {
+ public:
+  static long Load(volatile long* value) {
+#if defined(_WIN32)
+    return InterlockedCompareExchange(value, 0, 0);
+#elif defined(__ATOMIC_ACQUIRE)
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#else
+    return __sync_fetch_and_add(value, 0);
+#endif
+  }
+
+  static void Store(volatile long* value, long new_value) {
+#if defined(_WIN32)
+    InterlockedExchange(value, new_value);
+#elif defined(__ATOMIC_RELEASE)
+    __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+#else
+    __sync_synchronize();
+    *value = new_value;
+    __sync_synchronize();
+#endif
+  }
+
+  static bool CompareAndSwap(volatile long* value, long expected, long new_value) {
+#ifdef _WIN32
+    return InterlockedCompareExchange(value, new_value, expected) == expected;
+#else
+    return __sync_bool_compare_and_swap(value, expected, new_value);
+#endif
+  }
+
+  // Returns the incremented value.
+  static long Increment(volatile long* value) {
+#ifdef _WIN32
+    return InterlockedIncrement(value);
+#else
+    return __sync_add_and_fetch(value, 1);
+#endif
+  }
+
+  static void Yield() {
+#ifdef _WIN32
+    ::Sleep(0);
+#else
+    sched_yield();
+#endif
+  }
+};
+
+// Gives each thread its own value of type T, created the first time the
+// thread asks for it. Variables declared __declspec(thread) are not set
+// up in DLLs loaded with LoadLibrary before Windows Vista, as IEDriver.dll
+// is, so the values are kept in a TLS slot instead. On Windows a value is
+// not freed when its thread exits.
+template <class T>
+class LogThreadLocal {
+ public:
+  // Returns NULL if no slot could be allocated.
+  static T* Get() {
+#ifdef _WIN32
+    DWORD slot = Slot();
+    if (slot == TLS_OUT_OF_INDEXES) {
+      return NULL;
+    }
+    T* value = static_cast<T*>(::TlsGetValue(slot));
+    if (value == NULL) {
+      value = new T();
+      ::TlsSetValue(slot, value);
+    }
+#else
+    pthread_once(&Once(), &LogThreadLocal::CreateKey);
+    if (!IsKeyCreated()) {
+      return NULL;
+    }
+    T* value = static_cast<T*>(pthread_getspecific(Key()));
+    if (value == NULL) {
+      value = new T();
+      pthread_setspecific(Key(), value);
+    }
+#endif
+    return value;
+  }
+
+ private:
+#ifdef _WIN32
+  static DWORD Slot() {
+    // One more than the slot, so that zero means none has been allocated.
+    static volatile long slot_number = 0;
+    long current = LogAtomic::Load(&slot_number);
+    if (current == 0) {
+      DWORD new_slot = ::TlsAlloc();
+      if (new_slot == TLS_OUT_OF_INDEXES) {
+        return TLS_OUT_OF_INDEXES;
+      }
+      if (LogAtomic::CompareAndSwap(&slot_number, 0, new_slot + 1)) {
+        current = new_slot + 1;
+      } else {
+        ::TlsFree(new_slot);
+        current = LogAtomic::Load(&slot_number);
+      }
+    }
+    return static_cast<DWORD>(current - 1);
+  }
+#else
+  static pthread_once_t& Once() {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    return once;
+  }
+
+  static pthread_key_t& Key() {
+    static pthread_key_t key;
+    return key;
+  }
+
+  static bool& IsKeyCreated() {
+    static bool is_key_created = false;
+    return is_key_created;
+  }
+
+  static void CreateKey() {
+    IsKeyCreated() = pthread_key_create(&Key(), &LogThreadLocal::Delete) == 0;
+  }
+
+  static void Delete(void* value) {
+    delete static_cast<T*>(value);
+  }
+#endif
+};
+
+class LogThread {
+ public:
+  // Gets the ID of the current thread.
+  static unsigned long long Id() {
+#if defined(_WIN32)
+    return ::GetCurrentThreadId();
+#else
+    // Asking the kernel takes a system call, so each thread keeps its ID.
+    IdCache* cache = LogThreadLocal<IdCache>::Get();
+    if (cache == NULL) {
+      return CurrentId();
+    }
+    if (cache->thread_id == 0) {
+      cache->thread_id = CurrentId();
+    }
+    return cache->thread_id;
+#endif
+  }
+
+ private:
+#ifndef _WIN32
+  struct IdCache {
+    IdCache() : thread_id(0) {}
+    unsigned long long thread_id;
+  };
+
+  static unsigned long long CurrentId() {
+#if defined(__linux__)
+    return syscall(SYS_gettid);
+#else
+    return (unsigned long long) pthread_self();
+#endif
+  }
+#endif
+};
+
+class LogClock {
+ public:
+  // Gets the time since the epoch.
+  static void Now(time_t* seconds, long* microseconds) {
+#ifdef _WIN32
+    struct timeb tb; ftime(&tb);
+    *seconds = tb.time;
+    *microseconds = static_cast<long>(tb.millitm) * 1000;
+#else
+    struct timeval tv; gettimeofday(&tv, NULL);
+    *seconds = tv.tv_sec;
+    *microseconds = static_cast<long>(tv.tv_usec);
+#endif
+  }
+};
+
+// The binary trace format, written instead of text lines in binary mode,
+// and turned back into text lines by cpp/tracedecoder. A trace is a
+// sequence of records, each made of a type byte, the length of the rest
+// of the record, and the rest of the record. Numbers are written as
+// varints, seven bits to a byte starting with the least significant
+// bits, and signed numbers are zigzag encoded first.
+//
+// Each log file starts with a header. Its first byte is not a record
+// type, so that a header in the middle of a file appended to is skipped.
+#define LOG_TRACE_HEADER "\x89" "SELTRACE\r\n"
+// A call site: its number, the log level, the line, and the file name.
+#define LOG_TRACE_SITE_RECORD 'S'
+// A string literal: its number and its text.
+#define LOG_TRACE_LITERAL_RECORD 'L'
+// A log message: the number of its call site, the thread ID, the time in
+// microseconds since the epoch, and the values streamed into it, each a
+// value type byte followed by the value.
+#define LOG_TRACE_MESSAGE_RECORD 'M'
+// Log messages dropped from the asynchronous queue: the time, and the
+// number of messages.
+#define LOG_TRACE_DROPPED_RECORD 'D'
+#define LOG_TRACE_SIGNED_VALUE 'i'
+#define LOG_TRACE_UNSIGNED_VALUE 'u'
+// Eight bytes of an IEEE 754 double, least significant byte first.
+#define LOG_TRACE_DOUBLE_VALUE 'f'
+#define LOG_TRACE_CHAR_VALUE 'c'
+#define LOG_TRACE_POINTER_VALUE 'p'
+// The length of the string, followed by its bytes.
+#define LOG_TRACE_STRING_VALUE 's'
+// The number of a string literal.
+#define LOG_TRACE_LITERAL_VALUE 'l'
+// The call site number of messages from call sites that could not be
+// given a number. Their values start with the file name, the line, and
+// the log level.
+#define LOG_TRACE_UNNUMBERED_SITE 0
+// The number of call sites and string literals that can be numbered.
+// Must be a power of two.
+#define LOG_TRACE_DICTIONARY_CAPACITY 8192
+
+// Numbers the call sites and string literals of binary trace records, so
+// that each is written in full once in each log file, and by number
+// after that. They are told apart by address, which for __FILE__ and
+// string literals stays the same for the life of the process. Any const
+// character array is taken for a string literal, so the dictionary keeps
+// a copy of each literal's text, and writes an array whose text is no
+// longer the one it was numbered with as a plain string.
+// Looking up a number takes no lock.
+// A number is defined by the first message to use it, and again at the
+// start of every log file opened after that, so that the messages still
+// waiting to be written when a file is opened find it defined there.
+class LogTraceDictionary {
+ public:
+  enum KeyType { kCallSite = 0, kLiteral = 1 };
+
+  struct Definition {
+    KeyType key_type;
+    long number;
+    // The file name, or the dictionary's copy of the text of the literal.
+    const void* address;
+    // The line, or the size of the literal.
+    long size;
+    int level;
+  };
+
+  // Returns the number of a call site, given its file, line and level, or
+  // of a string literal, given its text and size, or 0 if the dictionary
+  // is full or the literal's text has changed. Sets must_define if the
+  // caller must write the definition of the number, because it has just
+  // been numbered.
+  static long Lookup(const void* address,
+                     long size,
+                     KeyType key_type,
+                     int level,
+                     bool* must_define) {
+    long key = size * 2 + key_type;
+    unsigned long hash = static_cast<unsigned long>(
+        reinterpret_cast<size_t>(address) >> 2) * 31 +
+        static_cast<unsigned long>(key);
+    hash ^= hash >> 13;
+    Entry* entries = Entries();
+    for (long probe = 0; probe < LOG_TRACE_DICTIONARY_CAPACITY; ++probe) {
+      Entry* entry = &entries[(hash + probe) & (LOG_TRACE_DICTIONARY_CAPACITY - 1)];
+      long state = LogAtomic::Load(&entry->state);
+      bool is_claimed = state == kEmpty &&
+          LogAtomic::CompareAndSwap(&entry->state, kEmpty, kClaimed);
+      if (is_claimed) {
+        entry->address = address;
+        entry->key = key;
+        entry->level = level;
+        entry->text = NULL;
+        if (key_type == kLiteral) {
+          char* text = static_cast<char*>(malloc(size));
+          if (text != NULL) {
+            memcpy(text, address, size);
+          }
+          entry->text = text;
+        }
+        entry->number = LogAtomic::Increment(&NextNumber());
+        LogAtomic::Store(&entry->state, kNumbered);
+      }
+      while ((state = LogAtomic::Load(&entry->state)) == kClaimed) {
+        LogAtomic::Yield();
+      }
+      if (entry->address == address && entry->key == key) {
+        if (key_type == kLiteral &&
+            (entry->text == NULL || memcmp(entry->text, address, size) != 0)) {
+          break;
+        }
+        *must_define = is_claimed;
+        return entry->number;
+      }
+    }
+    *must_define = false;
+    return 0;
+  }
+
+  // Gets the definition of the number held by an entry of the dictionary,
+  // given the entry's index, from 0 up to LOG_TRACE_DICTIONARY_CAPACITY.
+  // Returns false if the entry holds no number.
+  static bool GetDefinition(long index, Definition* definition) {
+    Entry* entry = &Entries()[index];
+    if (LogAtomic::Load(&entry->state) != kNumbered) {
+      return false;
+    }
+    definition->key_type = static_cast<KeyType>(entry->key & 1);
+    if (definition->key_type == kLiteral && entry->text == NULL) {
+      return false;
+    }
+    definition->number = entry->number;
+    definition->address = definition->key_type == kLiteral ?
+        static_cast<const void*>(entry->text) : entry->address;
+    definition->size = entry->key / 2;
+    definition->level = entry->level;
+    return true;
+  }
+
+ private:
+  enum EntryState { kEmpty = 0, kClaimed, kNumbered };
+
+  struct Entry {
+    volatile long state;
+    const void* address;
+    long key;
+    long number;
+    int level;
+    // A copy of the text of a literal, or NULL.
+    const char* text;
+  };
+
+  static Entry* Entries() {
+    static Entry entries[LOG_TRACE_DICTIONARY_CAPACITY];
+    return entries;
+  }
+
+  static volatile long& NextNumber() {
+    static volatile long number = 0;
+    return number;
+  }
+};
+
+// The stream a log message is written to. Builds a text line, or in
+// binary mode, a trace record, preceded by the definitions of any call
+// site and string literal it is the first to use. Both are built for
+// fatal messages, so that they can be reported as text. Values are
+// written to the text line as they would be to any std::ostream; in
+// trace records, manipulators such as std::hex are ignored, and values of
+// types other than numbers, characters and strings are formatted as text.
+class LogStream {
+ public:
+  LogStream() : is_text_(false), is_binary_(false) {}
+
+  bool is_binary() const { return this->is_binary_; }
+
+  std::ostringstream& BeginText() {
+    this->is_text_ = true;
+    return this->text_;
+  }
+
+  void BeginRecord(int level, const char* file, int line) {
+    this->is_binary_ = true;
+    bool must_define = false;
+    long site = LogTraceDictionary::Lookup(file,
+                                           line,
+                                           LogTraceDictionary::kCallSite,
+                                           level,
+                                           &must_define);
+    if (must_define) {
+      AppendSiteDefinition(&this->record_, site, level, line, file);
+    }
+
+    time_t seconds;
+    long microseconds;
+    LogClock::Now(&seconds, &microseconds);
+    AppendUnsigned(&this->message_, site);
+    AppendUnsigned(&this->message_, LogThread::Id());
+    AppendUnsigned(&this->message_,
+                   static_cast<unsigned long long>(seconds) * 1000000 +
+                   microseconds);
+    if (site == LOG_TRACE_UNNUMBERED_SITE) {
+      this->AppendStringValue(file, strlen(file));
+      this->AppendUnsignedValue(line);
+      this->AppendUnsignedValue(level);
+    }
+  }
+
+  // Ends the text line, and returns it.
+  std::string FinishText() {
+    if (!this->is_text_) {
+      return std::string();
+    }
+    this->text_ << std::endl;
+    return this->text_.str();
+  }
+
+  // Ends the trace record, and returns it with its definitions.
+  const std::string& FinishRecord() {
+    AppendRecord(&this->record_, LOG_TRACE_MESSAGE_RECORD, this->message_);
+    return this->record_;
+  }
+
+  // Appends the definitions of every number in the dictionary, written at
+  // the start of each log file.
+  static void AppendDefinitions(std::string* buffer) {
+    LogTraceDictionary::Definition definition;
+    for (long i = 0; i < LOG_TRACE_DICTIONARY_CAPACITY; ++i) {
+      if (!LogTraceDictionary::GetDefinition(i, &definition)) {
+        continue;
+      }
+      if (definition.key_type == LogTraceDictionary::kCallSite) {
+        AppendSiteDefinition(buffer,
+                             definition.number,
+                             definition.level,
+                             static_cast<int>(definition.size),
+                             static_cast<const char*>(definition.address));
+      } else {
+        AppendLiteralDefinition(buffer,
+                                definition.number,
+                                static_cast<const char*>(definition.address),
+                                definition.size);
+      }
+    }
+  }
+
+  // The trace record reporting that count messages were dropped.
+  static std::string DroppedRecord(long count) {
+    time_t seconds;
+    long microseconds;
+    LogClock::Now(&seconds, &microseconds);
+    std::string dropped;
+    AppendUnsigned(&dropped,
+                   static_cast<unsigned long long>(seconds) * 1000000 +
+                   microseconds);
+    AppendUnsigned(&dropped, count);
+    std::string record;
+    AppendRecord(&record, LOG_TRACE_DROPPED_RECORD, dropped);
+    return record;
+  }
+
+  LogStream& operator<<(bool value) { return this->Unsigned(value); }
+  LogStream& operator<<(char value) { return this->Char(value); }
+  LogStream& operator<<(signed char value) { return this->Char(value); }
+  LogStream& operator<<(unsigned char value) { return this->Char(value); }
+  LogStream& operator<<(short value) { return this->Signed(value); }
+  LogStream& operator<<(unsigned short value) { return this->Unsigned(value); }
+  LogStream& operator<<(int value) { return this->Signed(value); }
+  LogStream& operator<<(unsigned int value) { return this->Unsigned(value); }
+  LogStream& operator<<(long value) { return this->Signed(value); }
+  LogStream& operator<<(unsigned long value) { return this->Unsigned(value); }
+  LogStream& operator<<(long long value) { return this->Signed(value); }
+  LogStream& operator<<(unsigned long long value) { return this->Unsigned(value); }
+  LogStream& operator<<(float value) { return this->Double(value); }
+  LogStream& operator<<(double value) { return this->Double(value); }
+
+  // Character pointers are written as strings, and other pointers as
+  // addresses. The pointer is taken by reference so that string literals,
+  // which are arrays, cannot match, and are left to the overload below
+  // that numbers them.
+  template <class T>
+  LogStream& operator<<(T* const& value) {
+    return this->Pointer(value);
+  }
+
+  LogStream& operator<<(const std::string& value) {
+    if (this->is_text_) {
+      this->text_ << value;
+    }
+    if (this->is_binary_) {
+      this->AppendStringValue(value.data(), value.size());
+    }
+    return *this;
+  }
+
+  // String literals are written by number.
+  template <size_t N>
+  LogStream& operator<<(const char (&value)[N]) {
+    if (this->is_text_) {
+      this->text_ << value;
+    }
+    if (this->is_binary_) {
+      this->AppendLiteralValue(value, N);
+    }
+    return *this;
+  }
+
+  template <size_t N>
+  LogStream& operator<<(char (&value)[N]) {
+    return this->Pointer(const_cast<const char*>(value));
+  }
+
+  LogStream& operator<<(std::ostream& (*manipulator)(std::ostream&)) {
+    if (this->is_text_) {
+      this->text_ << manipulator;
+    }
+    return *this;
+  }
+
+  LogStream& operator<<(std::ios_base& (*manipulator)(std::ios_base&)) {
+    if (this->is_text_) {
+      this->text_ << manipulator;
+    }
+    return *this;
+  }
+
+  template <class T>
+  LogStream& operator<<(const T& value) {
+    if (this->is_binary_) {
+      std::ostringstream formatted;
+      formatted << value;
+      std::string text = formatted.str();
+      this->AppendStringValue(text.data(), text.size());
+      if (this->is_text_) {
+        this->text_ << text;
+      }
+    } else {
+      this->text_ << value;
+    }
+    return *this;
+  }
+
+ private:
+  LogStream& Pointer(const void* value) {
+    if (this->is_text_) {
+      this->text_ << value;
+    }
+    if (this->is_binary_) {
+      this->message_.push_back(LOG_TRACE_POINTER_VALUE);
+      AppendUnsigned(&this->message_, reinterpret_cast<size_t>(value));
+    }
+    return *this;
+  }
+
+  LogStream& Pointer(const char* value) {
+    if (this->is_text_) {
+      this->text_ << value;
+    }
+    if (this->is_binary_ && value != NULL) {
+      this->AppendStringValue(value, strlen(value));
+    }
+    return *this;
+  }
+
+  LogStream& Pointer(char* value) {
+    return this->Pointer(const_cast<const char*>(value));
+  }
+
+  LogStream& Pointer(const signed char* value) {
+    return this->Pointer(reinterpret_cast<const char*>(value));
+  }
+
+  LogStream& Pointer(signed char* value) {
+    return this->Pointer(reinterpret_cast<const char*>(value));
+  }
+
+  LogStream& Pointer(const unsigned char* value) {
+    return this->Pointer(reinterpret_cast<const char*>(value));
+  }
+
+  LogStream& Pointer(unsigned char* value) {
+    return this->Pointer(reinterpret_cast<const char*>(value));
+  }
+
+  template <class T>
+  LogStream& Signed(T value) {
+    if (this->is_text_) {
+      this->text_ << value;
+    }
+    if (this->is_binary_) {
+      this->message_.push_back(LOG_TRACE_SIGNED_VALUE);
+      long long signed_value = value;
+      AppendUnsigned(&this->message_,
+                     (static_cast<unsigned long long>(signed_value) << 1) ^
+                     static_cast<unsigned long long>(signed_value >> 63));
+    }
+    return *this;
+  }
+
+  template <class T>
+  LogStream& Unsigned(T value) {
+    if (this->is_text_) {
+      this->text_ << value;
+    }
+    if (this->is_binary_) {
+      this->AppendUnsignedValue(value);
+    }
+    return *this;
+  }
+
+  template <class T>
+  LogStream& Char(T value) {
+    if (this->is_text_) {
+      this->text_ << value;
+    }
+    if (this->is_binary_) {
+      this->message_.push_back(LOG_TRACE_CHAR_VALUE);
+      this->message_.push_back(static_cast<char>(value));
+    }
+    return *this;
+  }
+
+  LogStream& Double(double value) {
+    if (this->is_text_) {
+      this->text_ << value;
+    }
+    if (this->is_binary_) {
+      unsigned long long bits;
+      memcpy(&bits, &value, sizeof(bits));
+      this->message_.push_back(LOG_TRACE_DOUBLE_VALUE);
+      for (int i = 0; i < 8; ++i) {
+        this->message_.push_back(static_cast<char>(bits >> (i * 8)));
+      }
+    }
+    return *this;
+  }
+
+  void AppendUnsignedValue(unsigned long long value) {
+    this->message_.push_back(LOG_TRACE_UNSIGNED_VALUE);
+    AppendUnsigned(&this->message_, value);
+  }
+
+  void AppendStringValue(const char* value, size_t length) {
+    this->message_.push_back(LOG_TRACE_STRING_VALUE);
+    AppendString(&this->message_, value, length);
+  }
+
+  void AppendLiteralValue(const char* value, size_t size) {
+    bool must_define = false;
+    long literal = LogTraceDictionary::Lookup(value,
+                                              static_cast<long>(size),
+                                              LogTraceDictionary::kLiteral,
+                                              0,
+                                              &must_define);
+    if (literal == 0) {
+      this->AppendStringValue(value, LiteralLength(value, size));
+      return;
+    }
+    if (must_define) {
+      AppendLiteralDefinition(&this->record_, literal, value, size);
+    }
+    this->message_.push_back(LOG_TRACE_LITERAL_VALUE);
+    AppendUnsigned(&this->message_, literal);
+  }
+
+  static void AppendSiteDefinition(std::string* buffer,
+                                   long site,
+                                   int level,
+                                   int line,
+                                   const char* file) {
+    std::string definition;
+    AppendUnsigned(&definition, site);
+    AppendUnsigned(&definition, level);
+    AppendUnsigned(&definition, line);
+    AppendString(&definition, file, strlen(file));
+    AppendRecord(buffer, LOG_TRACE_SITE_RECORD, definition);
+  }
+
+  static void AppendLiteralDefinition(std::string* buffer,
+                                      long literal,
+                                      const char* value,
+                                      size_t size) {
+    std::string definition;
+    AppendUnsigned(&definition, literal);
+    AppendString(&definition, value, LiteralLength(value, size));
+    AppendRecord(buffer, LOG_TRACE_LITERAL_RECORD, definition);
+  }
+
+  // The length of a string literal, given the size of its array.
+  static size_t LiteralLength(const char* value, size_t size) {
+    size_t length = 0;
+    while (length < size && value[length] != '\0') {
+      ++length;
+    }
+    return length;
+  }
+
+  static void AppendUnsigned(std::string* buffer, unsigned long long value) {
+    while (value >= 0x80) {
+      buffer->push_back(static_cast<char>((value & 0x7F) | 0x80));
+      value >>= 7;
+    }
+    buffer->push_back(static_cast<char>(value));
+  }
+
+  static void AppendString(std::string* buffer,
+                           const char* value,
+                           size_t length) {
+    AppendUnsigned(buffer, length);
+    buffer->append(value, length);
+  }
+
+  static void AppendRecord(std::string* buffer,
+                           char type,
+                           const std::string& body) {
+    buffer->push_back(type);
+    AppendUnsigned(buffer, body.size());
+    buffer->append(body);
+  }
+
+  bool is_text_;
+  bool is_binary_;
+  std::ostringstream text_;
+  // The definitions, followed by the message record once it is finished.
+  std::string record_;
+  // The body of the message record.
+  std::string message_;
+};
+
 template <class _LOGGER> class Logger {
  public:
   Logger() : fatal_(false) {}
@@ -52,7 +776,12 @@ template <class _LOGGER> class Logger {
     logFATAL = 0, logERROR, logWARN, logINFO, logDEBUG, logTRACE };
 
   ~Logger() {
-    os_ << std::endl, _LOGGER::Log(os_.str(), fatal_);
+    std::string line = stream_.FinishText();
+    if (stream_.is_binary()) {
+      _LOGGER::Log(stream_.FinishRecord(), fatal_, line);
+    } else {
+      _LOGGER::Log(line, fatal_, line);
+    }
     if (fatal_) {
       exit(EXIT_FAILURE);
     }
@@ -67,26 +796,98 @@ template <class _LOGGER> class Logger {
     return level;
   }
 
-  std::ostringstream& Stream(LogLevel level) {
+  LogStream& Stream(LogLevel level, const char* file, int line) {
     static char severity[] = { 'F', 'E', 'W', 'I', 'D', 'T' };
-    os_ << severity[level] << ' ' << Time();
     if (level == logFATAL)
-      fatal_ = true, os_ << L"FATAL ";
-    return os_;
+      fatal_ = true;
+    if (_LOGGER::Binary()) {
+      stream_.BeginRecord(level, file, line);
+    }
+    if (!_LOGGER::Binary() || fatal_) {
+      char time[LOG_TIME_BUFFER_SIZE];
+      size_t time_length = FormatTime(time);
+      std::ostringstream& text = stream_.BeginText();
+      text << severity[level] << ' ';
+      text.write(time, time_length);
+      if (fatal_)
+        text << "FATAL ";
+      text << file << "(" << line << ") ";
+    }
+    return stream_;
   }
 
   static std::string Time() {
-    struct timeb tb; ftime(&tb);
+    char time[LOG_TIME_BUFFER_SIZE];
+    size_t length = FormatTime(time);
+    return std::string(time, length);
+  }
 
-    char time[26];
-    size_t length = strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S:",
-      localtime(reinterpret_cast<const time_t*>(&tb.time)));
-    sprintf(time + length, "%03u ", tb.millitm);
+  // Writes the current local time, followed by a space, into a buffer of
+  // LOG_TIME_BUFFER_SIZE characters, and returns its length. Each thread
+  // keeps the date and time up to the second from its previous call, so
+  // the time is only broken down, which takes a process-wide lock in the
+  // C library, once a second per thread. Otherwise only the milliseconds
+  // are written.
+  static size_t FormatTime(char* time) {
+    TimeCache uncached;
+    TimeCache* cache = LogThreadLocal<TimeCache>::Get();
+    if (cache == NULL) {
+      cache = &uncached;
+    }
 
-    return time;
+    time_t seconds;
+    long microseconds;
+    LogClock::Now(&seconds, &microseconds);
+    unsigned int milliseconds = static_cast<unsigned int>(microseconds / 1000);
+
+    if (cache->prefix_length == 0 || seconds != cache->seconds) {
+      struct tm local_time;
+#ifdef _WIN32
+      localtime_s(&local_time, &seconds);
+#else
+      localtime_r(&seconds, &local_time);
+#endif
+      cache->prefix_length = strftime(cache->prefix,
+                                      sizeof(cache->prefix),
+                                      "%Y-%m-%d %H:%M:%S:",
+                                      &local_time);
+      cache->seconds = seconds;
+    }
+
+    size_t length = cache->prefix_length;
+    memcpy(time, cache->prefix, length);
+    time[length++] = static_cast<char>('0' + milliseconds / 100);
+    time[length++] = static_cast<char>('0' + milliseconds / 10 % 10);
+    time[length++] = static_cast<char>('0' + milliseconds % 10);
+    time[length++] = ' ';
+    return length;
+  }
+
+  // The message reporting that count messages were dropped from the
+  // asynchronous queue.
+  static std::string DroppedMessage(long count) {
+    if (_LOGGER::Binary()) {
+      // A dropped message may have been the one defining its numbers, so
+      // every number is defined again.
+      std::string record = LogStream::DroppedRecord(count);
+      LogStream::AppendDefinitions(&record);
+      return record;
+    }
+    std::ostringstream message;
+    message << "W " << Time() << count
+            << " log messages were dropped because the log queue was full"
+            << std::endl;
+    return message.str();
   }
 
  private:
+  // The date and time up to the second of a thread's previous log line.
+  struct TimeCache {
+    TimeCache() : seconds(0), prefix_length(0) {}
+    time_t seconds;
+    size_t prefix_length;
+    char prefix[LOG_TIME_BUFFER_SIZE];
+  };
 
   static LogLevel ToLogLevel(const std::string& level) {
     if (level == "ERROR") {
@@ -109,10 +910,308 @@ template <class _LOGGER> class Logger {
     return tmp ? ToLogLevel(std::string(tmp)) : logFATAL;
   }
 
-  std::ostringstream os_;
+  LogStream stream_;
   bool fatal_;
 };
 
+// The number of log lines that can wait to be written in asynchronous
+// mode. Must be a power of two.
+#define LOG_QUEUE_CAPACITY 8192
+// How long the writer thread sleeps when it finds no lines to write. It is
+// woken early when the queue is half full.
+#define LOG_QUEUE_IDLE_WAIT_IN_MILLISECONDS 20
+// Lines are written in batches of about this many bytes.
+#define LOG_QUEUE_BATCH_SIZE_IN_BYTES 65536
+// Queue slots keep their buffers for reuse, unless a line longer than this
+// was stored in them.
+#define LOG_QUEUE_MAX_RETAINED_LINE_SIZE 4096
+
+class LOG;
+
+// Queues log lines for a background thread to write, so that threads
+// that log never wait on file I/O. Any number of threads may push lines
+// at once without taking a lock. When the queue is full, lines are
+// dropped and counted rather than making the caller wait, so the memory
+// used is bounded by the queue capacity.
+// The queue is never destroyed, since the writer thread may outlive
+// static destruction; pending lines are written at exit instead.
+class AsyncLogQueue {
+ public:
+  typedef void (*WriteFunction)(const std::string& lines);
+
+  // Returns the queue, creating it and starting its writer thread the
+  // first time. write is called from one thread at a time.
+  static AsyncLogQueue* Instance(WriteFunction write) {
+    AsyncLogQueue* queue = InstancePointer();
+    if (queue == NULL) {
+      AsyncLogQueue* new_queue = new AsyncLogQueue(write);
+#ifdef _WIN32
+      queue = reinterpret_cast<AsyncLogQueue*>(
+          InterlockedCompareExchangePointer(
+              reinterpret_cast<void* volatile*>(&InstancePointer()),
+              new_queue,
+              NULL));
+#else
+      queue = __sync_val_compare_and_swap(&InstancePointer(),
+                                          static_cast<AsyncLogQueue*>(NULL),
+                                          new_queue);
+#endif
+      if (queue == NULL) {
+        queue = new_queue;
+        queue->Start();
+      } else {
+        delete new_queue;
+      }
+    }
+    return queue;
+  }
+
+  // Writes the lines already queued. Returns when they have been written.
+  static void FlushInstance() {
+    AsyncLogQueue* queue = InstancePointer();
+    if (queue != NULL) {
+      queue->Flush();
+    }
+  }
+
+  // Queues a line. Returns false if the queue was full and the line was
+  // dropped.
+  bool Push(const std::string& line) {
+    long position = LogAtomic::Load(&this->push_position_);
+    Slot* slot;
+    for (;;) {
+      slot = &this->slots_[position & (LOG_QUEUE_CAPACITY - 1)];
+      long difference = Difference(LogAtomic::Load(&slot->sequence), position);
+      if (difference == 0) {
+        if (LogAtomic::CompareAndSwap(&this->push_position_, position, Add(position, 1))) {
+          break;
+        }
+        position = LogAtomic::Load(&this->push_position_);
+      } else if (difference < 0) {
+        // The writer thread has not caught up with this slot yet.
+        LogAtomic::Increment(&this->dropped_count_);
+        return false;
+      } else {
+        // Another thread claimed this slot first.
+        position = LogAtomic::Load(&this->push_position_);
+      }
+    }
+    slot->line.assign(line);
+    LogAtomic::Store(&slot->sequence, Add(position, 1));
+
+    // Wake the writer thread early if lines are piling up, at most once
+    // for each time it drains the queue.
+    if (Difference(position, LogAtomic::Load(&this->pop_position_)) >= LOG_QUEUE_CAPACITY / 2 &&
+        LogAtomic::CompareAndSwap(&this->is_wake_requested_, 0, 1)) {
+      this->WakeWriter();
+    }
+    return true;
+  }
+
+  void Flush() {
+    this->LockWriter();
+    this->WriteQueuedLines();
+    this->UnlockWriter();
+  }
+
+  // The number of lines dropped because the queue was full.
+  long dropped_count() { return LogAtomic::Load(&this->dropped_count_); }
+
+ private:
+  struct Slot {
+    // The push position for which the slot is free, or one more than the
+    // position of the line it holds.
+    volatile long sequence;
+    std::string line;
+  };
+
+  explicit AsyncLogQueue(WriteFunction write)
+      : write_(write), push_position_(0), pop_position_(0),
+        dropped_count_(0), reported_dropped_count_(0),
+        is_wake_requested_(0) {
+    this->slots_ = new Slot[LOG_QUEUE_CAPACITY];
+    for (long i = 0; i < LOG_QUEUE_CAPACITY; ++i) {
+      this->slots_[i].sequence = i;
+    }
+#ifdef _WIN32
+    ::InitializeCriticalSection(&this->writer_lock_);
+    this->wake_event_ = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+    pthread_mutex_init(&this->writer_lock_, NULL);
+    pthread_mutex_init(&this->wake_lock_, NULL);
+    pthread_cond_init(&this->wake_condition_, NULL);
+    this->is_woken_ = false;
+#endif
+  }
+
+  ~AsyncLogQueue() {
+    // Only a queue that lost the race in Instance is ever destroyed.
+    delete[] this->slots_;
+#ifdef _WIN32
+    ::DeleteCriticalSection(&this->writer_lock_);
+    ::CloseHandle(this->wake_event_);
+#else
+    pthread_mutex_destroy(&this->writer_lock_);
+    pthread_mutex_destroy(&this->wake_lock_);
+    pthread_cond_destroy(&this->wake_condition_);
+#endif
+  }
+
+  static AsyncLogQueue*& InstancePointer() {
+    static AsyncLogQueue* queue = NULL;
+    return queue;
+  }
+
+  void Start() {
+    atexit(&AsyncLogQueue::FlushInstance);
+#ifdef _WIN32
+    HANDLE thread_handle = reinterpret_cast<HANDLE>(
+        _beginthreadex(NULL, 0, &AsyncLogQueue::WriterThreadProc, this, 0, NULL));
+    if (thread_handle != NULL) {
+      ::CloseHandle(thread_handle);
+    }
+#else
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &AsyncLogQueue::WriterThreadProc, this) == 0) {
+      pthread_detach(thread);
+    }
+#endif
+  }
+
+#ifdef _WIN32
+  static unsigned int __stdcall WriterThreadProc(void* queue) {
+#else
+  static void* WriterThreadProc(void* queue) {
+#endif
+    AsyncLogQueue* this_queue = reinterpret_cast<AsyncLogQueue*>(queue);
+    for (;;) {
+      this_queue->LockWriter();
+      bool wrote_lines = this_queue->WriteQueuedLines();
+      this_queue->UnlockWriter();
+      if (!wrote_lines) {
+        this_queue->WaitForLines();
+      }
+    }
+    return 0;
+  }
+
+  void WakeWriter() {
+#ifdef _WIN32
+    ::SetEvent(this->wake_event_);
+#else
+    pthread_mutex_lock(&this->wake_lock_);
+    this->is_woken_ = true;
+    pthread_cond_signal(&this->wake_condition_);
+    pthread_mutex_unlock(&this->wake_lock_);
+#endif
+  }
+
+  void WaitForLines() {
+#ifdef _WIN32
+    ::WaitForSingleObject(this->wake_event_, LOG_QUEUE_IDLE_WAIT_IN_MILLISECONDS);
+#else
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += LOG_QUEUE_IDLE_WAIT_IN_MILLISECONDS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&this->wake_lock_);
+    if (!this->is_woken_) {
+      pthread_cond_timedwait(&this->wake_condition_, &this->wake_lock_, &deadline);
+    }
+    this->is_woken_ = false;
+    pthread_mutex_unlock(&this->wake_lock_);
+#endif
+  }
+
+  // Takes the queued lines off the queue and writes them in batches. The
+  // writer lock must be held. Returns false if there was nothing to write.
+  bool WriteQueuedLines() {
+    std::string batch;
+    long dropped_count = LogAtomic::Load(&this->dropped_count_);
+    if (dropped_count != this->reported_dropped_count_) {
+      batch.append(Logger<LOG>::DroppedMessage(
+          dropped_count - this->reported_dropped_count_));
+      this->reported_dropped_count_ = dropped_count;
+    }
+
+    LogAtomic::Store(&this->is_wake_requested_, 0);
+    bool wrote_lines = false;
+    for (;;) {
+      Slot* slot = &this->slots_[this->pop_position_ & (LOG_QUEUE_CAPACITY - 1)];
+      if (Difference(LogAtomic::Load(&slot->sequence), Add(this->pop_position_, 1)) != 0) {
+        break;
+      }
+      batch.append(slot->line);
+      if (slot->line.capacity() > LOG_QUEUE_MAX_RETAINED_LINE_SIZE) {
+        std::string().swap(slot->line);
+      } else {
+        slot->line.clear();
+      }
+      LogAtomic::Store(&slot->sequence, Add(this->pop_position_, LOG_QUEUE_CAPACITY));
+      LogAtomic::Store(&this->pop_position_, Add(this->pop_position_, 1));
+      wrote_lines = true;
+      if (batch.size() >= LOG_QUEUE_BATCH_SIZE_IN_BYTES) {
+        this->write_(batch);
+        batch.clear();
+      }
+    }
+    if (batch.size() > 0) {
+      this->write_(batch);
+    }
+    return wrote_lines;
+  }
+
+  void LockWriter() {
+#ifdef _WIN32
+    ::EnterCriticalSection(&this->writer_lock_);
+#else
+    pthread_mutex_lock(&this->writer_lock_);
+#endif
+  }
+
+  void UnlockWriter() {
+#ifdef _WIN32
+    ::LeaveCriticalSection(&this->writer_lock_);
+#else
+    pthread_mutex_unlock(&this->writer_lock_);
+#endif
+  }
+
+  // Positions wrap around, so they are advanced and compared without
+  // signed overflow.
+  static long Add(long position, long count) {
+    return static_cast<long>(static_cast<unsigned long>(position) +
+                             static_cast<unsigned long>(count));
+  }
+
+  static long Difference(long first, long second) {
+    return static_cast<long>(static_cast<unsigned long>(first) -
+                             static_cast<unsigned long>(second));
+  }
+
+  WriteFunction write_;
+  Slot* slots_;
+  volatile long push_position_;
+  // Only changed with the writer lock held.
+  volatile long pop_position_;
+  volatile long dropped_count_;
+  long reported_dropped_count_;
+  // Set by the thread that wakes the writer thread early.
+  volatile long is_wake_requested_;
+#ifdef _WIN32
+  CRITICAL_SECTION writer_lock_;
+  HANDLE wake_event_;
+#else
+  pthread_mutex_t writer_lock_;
+  pthread_mutex_t wake_lock_;
+  pthread_cond_t wake_condition_;
+  bool is_woken_;
+#endif
+};
+
 class LOG : public Logger<LOG> {
  public:
   static void File(const std::string& name, const char* openMode = "w") {
@@ -124,12 +1223,34 @@ class LOG : public Logger<LOG> {
     } else {
       LOG::File() = fopen(file.c_str(), openMode);
     }
+    LogAtomic::Store(&LOG::IsHeaderPending(), 1);
   }
 
   static void Limit(off_t size) {
     LOG::Limit() = size;
   }
 
+  // In asynchronous mode, log lines are handed to a background thread to
+  // write, and fatal lines are written at once, after the lines queued
+  // ahead of them. Also enabled by setting SELENIUM_LOG_ASYNC to 1.
+  static void Async(bool async) {
+    if (async) {
+      AsyncLogQueue::Instance(&LOG::Write);
+    } else {
+      AsyncLogQueue::FlushInstance();
+    }
+    LOG::Async() = async;
+  }
+
+  // In binary mode, log messages are written as binary trace records,
+  // which cpp/tracedecoder turns back into text. Writing them takes a
+  // fraction of the time and space text lines take. Should be chosen
+  // before anything is logged. Also enabled by setting SELENIUM_LOG_BINARY
+  // to 1.
+  static void Binary(bool binary) {
+    LOG::Binary() = binary;
+  }
+
  private:
   static std::string& Name(const std::string& name) {
     static std::string file_name = "stdout";
@@ -148,11 +1269,63 @@ class LOG : public Logger<LOG> {
     return size_limit;
   }
 
-  static void Log(const std::string& str, bool fatal) {
+  static bool& Async() {
+    static bool async = GetAsyncEnv();
+    return async;
+  }
+
+  static bool GetAsyncEnv() {
+    char* tmp = getenv("SELENIUM_LOG_ASYNC");
+    return tmp != NULL && std::string(tmp) == "1";
+  }
+
+  static bool& Binary() {
+    static bool binary = GetBinaryEnv();
+    return binary;
+  }
+
+  static bool GetBinaryEnv() {
+    char* tmp = getenv("SELENIUM_LOG_BINARY");
+    return tmp != NULL && std::string(tmp) == "1";
+  }
+
+  // Set when a log file is opened, until the binary trace header has been
+  // written to it.
+  static volatile long& IsHeaderPending() {
+    static volatile long is_header_pending = 1;
+    return is_header_pending;
+  }
+
+  // str is written to the log; text is the same message as text, and is
+  // also written to stderr if the message is fatal.
+  static void Log(const std::string& str, bool fatal, const std::string& text) {
+    if (Async()) {
+      if (!fatal) {
+        AsyncLogQueue::Instance(&LOG::Write)->Push(str);
+        return;
+      }
+      AsyncLogQueue::FlushInstance();
+    }
+
     if (fatal) Limit() = 0;
+    Write(str);
+
+    FILE* output = File();
+    if (fatal && !isatty(fileno(output))) {
+      fputs(text.c_str(), stderr);
+    }
+  }
 
+  static void Write(const std::string& str) {
     FILE* output = File();
     if (output) {
+      if (Binary() && LogAtomic::CompareAndSwap(&IsHeaderPending(), 1, 0)) {
+        // Messages built before the file was opened define their numbers
+        // in an earlier file, if at all, so every number is defined again.
+        std::string header(LOG_TRACE_HEADER);
+        LogStream::AppendDefinitions(&header);
+        fwrite(header.data(), sizeof(char), header.size(), output);
+      }
       fwrite(str.data(), sizeof(char), str.size(), output);
       fflush(output);
 
@@ -162,10 +1335,6 @@ class LOG : public Logger<LOG> {
         }
       }
     }
-
-    if (fatal && !isatty(fileno(output))) {
-      fputs(str.c_str(), stderr);
-    }
   }
 
   friend class Logger<LOG>;
@@ -178,7 +1347,7 @@ class LOG : public Logger<LOG> {
 
 #define LOG(LEVEL)                        \
   if (LOG::log ## LEVEL > LOG::Level()) ; \
-  else LOG().Stream(LOG::log ## LEVEL) << __FILE__ << "(" << __LINE__ << ") " /* << stuff here */
+  else LOG().Stream(LOG::log ## LEVEL, __FILE__, __LINE__) /* << stuff here */
 
 #ifdef _WIN32
   #define LOGHR(LEVEL,HR) LOG( ## LEVEL) << HR << " [" << (_bstr_t(_com_error((DWORD) HR).ErrorMessage())) << "]: "
@@ -0,0 +1,607 @@
+// Copyright 2013 Software Freedom Conservancy
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the request handling of webdriver::Server, with no browser
+// behind it. The server runs in this process with sessions that echo the
+// script of each executeScript command back, optionally after sleeping,
+// and is driven over loopback HTTP by client threads, each with a session
+// of its own. Reports the throughput, the latency percentiles and the
+// number of allocations the server made per request.
+//
+// Usage: server_benchmark [--port=<port>] [--concurrency=<clients>]
+//            [--threads=<server threads>] [--queue=<queue size>]
+//            [--duration=<seconds>] [--warmup=<seconds>]
+//            [--keep-alive=<yes|no>] [--payload=<bytes>]
+//            [--sleep=<microseconds>] [--log-level=<level>]
+//
+// Runs on Linux. Built on its own, from this directory, with
+//   gcc -O2 -c -DNO_SSL ../../third_party/mongoose/mongoose.c
+//   g++ -O2 -include precompile.h -I../webdriver-server
+//       -I../webdriver-interactions -I../../third_party/mongoose
+//       -I../../third_party/json-cpp/include
+//       -iquote ../../third_party/json-cpp/include/json
+//       -o server_benchmark server_benchmark.cc ../webdriver-server/*.cc
+//       ../../third_party/json-cpp/src/lib_json/*.cpp mongoose.o
+//       -lpthread -ldl
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+#include "server.h"
+#include "server_metrics.h"
+#include "thread.h"
+#include "logging.h"
+
+#define DEFAULT_PORT 9515
+#define DEFAULT_CONCURRENCY 8
+#define DEFAULT_DURATION_IN_SECONDS 10
+#define DEFAULT_WARMUP_IN_SECONDS 1
+#define DEFAULT_PAYLOAD_SIZE 64
+#define RECEIVE_BUFFER_SIZE 65536
+#define INITIAL_SAMPLE_CAPACITY 65536
+
+namespace {
+
+// The number of times operator new has been called on threads other
+// than the client threads, which are the threads of the server.
+volatile long long server_allocation_count = 0;
+__thread bool is_client_thread = false;
+
+// The phases of a run, which the client threads follow.
+enum Phase {
+  kWarmupPhase = 0,
+  kMeasurePhase,
+  kStopPhase
+};
+volatile long current_phase = kWarmupPhase;
+
+long GetPhase(void) {
+  return __sync_fetch_and_add(&current_phase, 0);
+}
+
+void SetPhase(const long phase) {
+  __sync_lock_test_and_set(&current_phase, phase);
+}
+
+long long GetServerAllocationCount(void) {
+  return __sync_fetch_and_add(&server_allocation_count, 0);
+}
+
+void* Allocate(size_t size) {
+  if (!is_client_thread) {
+    __sync_fetch_and_add(&server_allocation_count, 1);
+  }
+  void* block = malloc(size == 0 ? 1 : size);
+  if (block == NULL) {
+    throw std::bad_alloc();
+  }
+  return block;
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  return Allocate(size);
+}
+
+void* operator new[](size_t size) {
+  return Allocate(size);
+}
+
+void operator delete(void* block) throw() {
+  free(block);
+}
+
+void operator delete[](void* block) throw() {
+  free(block);
+}
+
+void operator delete(void* block, size_t /*size*/) throw() {
+  free(block);
+}
+
+void operator delete[](void* block, size_t /*size*/) throw() {
+  free(block);
+}
+
+namespace webdriver {
+
+class BenchmarkSession : public Session {
+ public:
+  explicit BenchmarkSession(const int sleep_microseconds)
+      : sleep_microseconds_(sleep_microseconds) {}
+  virtual ~BenchmarkSession(void) {}
+
+  void Initialize(void* /*init_params*/) {
+    static volatile long next_session_number = 0;
+    char session_id[32];
+    sprintf(session_id, "%08lx",
+            __sync_add_and_fetch(&next_session_number, 1));
+    this->set_session_id(session_id);
+  }
+
+  void ShutDown(void) {
+  }
+
+  bool ExecuteCommand(const Command& command, Response* response) {
+    response->set_session_id(this->session_id());
+    if (command.command_type() == CommandType::NewSession) {
+      response->SetResponse(303, "/session/" + this->session_id());
+      return true;
+    }
+    if (command.command_type() == CommandType::GetSessionCapabilities) {
+      Json::Value capabilities;
+      capabilities["browserName"] = "benchmark";
+      response->SetSuccessResponse(capabilities);
+      return true;
+    }
+    if (command.command_type() == CommandType::Quit) {
+      response->SetSuccessResponse(Json::Value::null);
+      return false;
+    }
+
+    if (this->sleep_microseconds_ > 0) {
+      usleep(this->sleep_microseconds_);
+    }
+    ParametersMap::const_iterator script =
+        command.command_parameters().find("script");
+    if (script != command.command_parameters().end()) {
+      response->SetSuccessResponse(script->second);
+    } else {
+      response->SetSuccessResponse(Json::Value::null);
+    }
+    return true;
+  }
+
+ private:
+  int sleep_microseconds_;
+
+  DISALLOW_COPY_AND_ASSIGN(BenchmarkSession);
+};
+
+class BenchmarkServer : public Server {
+ public:
+  BenchmarkServer(const int port,
+                  const std::string& log_level,
+                  const int thread_count,
+                  const int queue_size,
+                  const int sleep_microseconds)
+      : Server(port, "127.0.0.1", log_level, "", thread_count, queue_size),
+        sleep_microseconds_(sleep_microseconds) {}
+  virtual ~BenchmarkServer(void) {}
+
+ protected:
+  SessionHandle InitializeSession(void) {
+    SessionHandle session_handle(
+        new BenchmarkSession(this->sleep_microseconds_));
+    session_handle->Initialize(NULL);
+    return session_handle;
+  }
+
+  void GetStatus(Response* response) {
+    response->SetSuccessResponse(Json::Value::null);
+  }
+
+  void ShutDown(void) {
+  }
+
+ private:
+  int sleep_microseconds_;
+
+  DISALLOW_COPY_AND_ASSIGN(BenchmarkServer);
+};
+
+}  // namespace webdriver
+
+namespace {
+
+struct BenchmarkOptions {
+  int port;
+  int concurrency;
+  int thread_count;
+  int queue_size;
+  int duration;
+  int warmup;
+  bool keep_alive;
+  int payload_size;
+  int sleep_microseconds;
+  std::string log_level;
+};
+
+// Talks HTTP/1.1 to the server over loopback, with one connection that is
+// kept open between requests if keep-alive is on.
+class HttpClient {
+ public:
+  HttpClient(const int port, const bool keep_alive)
+      : port_(port), keep_alive_(keep_alive), socket_(-1) {
+    this->buffer_.resize(RECEIVE_BUFFER_SIZE);
+  }
+
+  ~HttpClient(void) {
+    this->Close();
+  }
+
+  // Sends a request, which must ask for the connection to be closed if
+  // keep-alive is off, and reads the response. Returns the HTTP status
+  // code, or -1 if the exchange failed.
+  int Send(const std::string& request, std::string* header_block) {
+    if (this->socket_ < 0 && !this->Connect()) {
+      return -1;
+    }
+    if (!this->SendAll(request)) {
+      this->Close();
+      return -1;
+    }
+    int status_code = this->ReadResponse(header_block);
+    if (status_code < 0 || !this->keep_alive_) {
+      this->Close();
+    }
+    return status_code;
+  }
+
+ private:
+  bool Connect(void) {
+    this->socket_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (this->socket_ < 0) {
+      return false;
+    }
+    int no_delay = 1;
+    setsockopt(this->socket_, IPPROTO_TCP, TCP_NODELAY,
+               &no_delay, sizeof(no_delay));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<unsigned short>(this->port_));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(this->socket_,
+                reinterpret_cast<struct sockaddr*>(&address),
+                sizeof(address)) != 0) {
+      this->Close();
+      return false;
+    }
+    return true;
+  }
+
+  void Close(void) {
+    if (this->socket_ >= 0) {
+      close(this->socket_);
+      this->socket_ = -1;
+    }
+  }
+
+  bool SendAll(const std::string& request) {
+    size_t sent = 0;
+    while (sent < request.size()) {
+      ssize_t count = send(this->socket_, request.data() + sent,
+                           request.size() - sent, MSG_NOSIGNAL);
+      if (count <= 0) {
+        return false;
+      }
+      sent += count;
+    }
+    return true;
+  }
+
+  // Reads the headers, then as much of the body as Content-Length gives.
+  // The body itself is discarded.
+  int ReadResponse(std::string* header_block) {
+    size_t received = 0;
+    size_t header_size = 0;
+    while (header_size == 0) {
+      if (received == this->buffer_.size()) {
+        return -1;
+      }
+      ssize_t count = recv(this->socket_, &this->buffer_[received],
+                           this->buffer_.size() - received, 0);
+      if (count <= 0) {
+        return -1;
+      }
+      received += count;
+      for (size_t i = 3; i < received; ++i) {
+        if (memcmp(&this->buffer_[i - 3], "\r\n\r\n", 4) == 0) {
+          header_size = i + 1;
+          break;
+        }
+      }
+    }
+
+    int status_code = -1;
+    if (sscanf(&this->buffer_[0], "HTTP/1.%*d %d", &status_code) != 1) {
+      return -1;
+    }
+    long long content_length = 0;
+    const char* content_length_header = FindHeader(&this->buffer_[0],
+                                                   header_size,
+                                                   "\r\nContent-Length:");
+    if (content_length_header != NULL) {
+      content_length = atoll(content_length_header);
+    }
+    if (header_block != NULL) {
+      header_block->assign(&this->buffer_[0], header_size);
+    }
+
+    long long remaining = content_length - (received - header_size);
+    while (remaining > 0) {
+      ssize_t count = recv(this->socket_, &this->buffer_[0],
+                           this->buffer_.size(), 0);
+      if (count <= 0) {
+        return -1;
+      }
+      remaining -= count;
+    }
+    return status_code;
+  }
+
+  static const char* FindHeader(const char* headers,
+                                const size_t size,
+                                const char* name) {
+    size_t name_size = strlen(name);
+    for (size_t i = 0; i + name_size <= size; ++i) {
+      if (strncasecmp(headers + i, name, name_size) == 0) {
+        return headers + i + name_size;
+      }
+    }
+    return NULL;
+  }
+
+  int port_;
+  bool keep_alive_;
+  int socket_;
+  std::vector<char> buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(HttpClient);
+};
+
+// The work and the results of one client thread.
+struct ClientContext {
+  const BenchmarkOptions* options;
+  long long request_count;
+  long long error_count;
+  bool is_session_created;
+  std::vector<long long> latencies;
+};
+
+std::string BuildRequest(const BenchmarkOptions& options,
+                         const std::string& verb,
+                         const std::string& uri,
+                         const std::string& body) {
+  std::string request = verb + " " + uri + " HTTP/1.1\r\n"
+      "Host: 127.0.0.1\r\n"
+      "Content-Type: application/json;charset=UTF-8\r\n";
+  if (!options.keep_alive) {
+    request.append("Connection: close\r\n");
+  }
+  char content_length[64];
+  sprintf(content_length, "Content-Length: %lu\r\n\r\n",
+          static_cast<unsigned long>(body.size()));
+  request.append(content_length);
+  request.append(body);
+  return request;
+}
+
+bool CreateSession(const BenchmarkOptions& options,
+                   HttpClient* client,
+                   std::string* session_id) {
+  std::string headers;
+  int status_code = client->Send(
+      BuildRequest(options, "POST", "/session",
+                   "{\"desiredCapabilities\":{}}"),
+      &headers);
+  size_t location = headers.find("/session/");
+  if (status_code != 303 || location == std::string::npos) {
+    return false;
+  }
+  location += strlen("/session/");
+  *session_id = headers.substr(location,
+                               headers.find("\r\n", location) - location);
+  return true;
+}
+
+void ClientThreadProc(void* argument) {
+  is_client_thread = true;
+  ClientContext* context = static_cast<ClientContext*>(argument);
+  const BenchmarkOptions& options = *context->options;
+  HttpClient client(options.port, options.keep_alive);
+
+  std::string session_id;
+  context->is_session_created = CreateSession(options, &client, &session_id);
+  if (!context->is_session_created) {
+    return;
+  }
+  std::string session_uri = "/session/" + session_id;
+  std::string body = "{\"script\":\"" +
+      std::string(options.payload_size, 'x') + "\",\"args\":[]}";
+  std::string request = BuildRequest(options, "POST",
+                                     session_uri + "/execute", body);
+
+  long phase;
+  while ((phase = GetPhase()) != kStopPhase) {
+    long long start = webdriver::ServerMetrics::Now();
+    int status_code = client.Send(request, NULL);
+    long long latency = webdriver::ServerMetrics::Now() - start;
+    if (phase == kMeasurePhase && GetPhase() == kMeasurePhase) {
+      ++context->request_count;
+      if (status_code == 200) {
+        context->latencies.push_back(latency);
+      } else {
+        ++context->error_count;
+      }
+    }
+  }
+
+  client.Send(BuildRequest(options, "DELETE", session_uri, ""), NULL);
+}
+
+int GetIntegerOption(const std::map<std::string, std::string>& args,
+                     const std::string& name,
+                     const int default_value) {
+  std::map<std::string, std::string>::const_iterator it = args.find(name);
+  if (it == args.end()) {
+    return default_value;
+  }
+  return atoi(it->second.c_str());
+}
+
+bool ParseOptions(int argc, char* argv[], BenchmarkOptions* options) {
+  std::map<std::string, std::string> args;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    size_t equal_pos = arg.find("=");
+    if (arg.find("--") != 0 || equal_pos == std::string::npos) {
+      return false;
+    }
+    args[arg.substr(2, equal_pos - 2)] = arg.substr(equal_pos + 1);
+  }
+
+  options->port = GetIntegerOption(args, "port", DEFAULT_PORT);
+  options->concurrency = GetIntegerOption(args,
+                                          "concurrency",
+                                          DEFAULT_CONCURRENCY);
+  options->thread_count = GetIntegerOption(args, "threads", 0);
+  options->queue_size = GetIntegerOption(args, "queue", 0);
+  options->duration = GetIntegerOption(args,
+                                       "duration",
+                                       DEFAULT_DURATION_IN_SECONDS);
+  options->warmup = GetIntegerOption(args,
+                                     "warmup",
+                                     DEFAULT_WARMUP_IN_SECONDS);
+  options->keep_alive = args.find("keep-alive") == args.end() ||
+                        args["keep-alive"] == "yes";
+  options->payload_size = GetIntegerOption(args,
+                                           "payload",
+                                           DEFAULT_PAYLOAD_SIZE);
+  options->sleep_microseconds = GetIntegerOption(args, "sleep", 0);
+  options->log_level = args.find("log-level") == args.end() ?
+                       "" : args["log-level"];
+  return options->concurrency > 0 && options->duration > 0 &&
+         options->warmup >= 0 && options->payload_size >= 0 &&
+         options->sleep_microseconds >= 0;
+}
+
+double GetPercentile(const std::vector<long long>& sorted_latencies,
+                     const double percentile) {
+  if (sorted_latencies.size() == 0) {
+    return 0;
+  }
+  size_t index = static_cast<size_t>(percentile / 100.0 *
+                                     sorted_latencies.size());
+  if (index >= sorted_latencies.size()) {
+    index = sorted_latencies.size() - 1;
+  }
+  return sorted_latencies[index] / 1000.0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  is_client_thread = true;
+  BenchmarkOptions options;
+  if (!ParseOptions(argc, argv, &options)) {
+    fprintf(stderr,
+            "Usage: server_benchmark [--port=<port>] "
+            "[--concurrency=<clients>]\n"
+            "           [--threads=<server threads>] "
+            "[--queue=<queue size>]\n"
+            "           [--duration=<seconds>] [--warmup=<seconds>]\n"
+            "           [--keep-alive=<yes|no>] [--payload=<bytes>]\n"
+            "           [--sleep=<microseconds>] [--log-level=<level>]\n");
+    return 2;
+  }
+
+  webdriver::BenchmarkServer server(options.port,
+                                    options.log_level,
+                                    options.thread_count,
+                                    options.queue_size,
+                                    options.sleep_microseconds);
+  if (!server.Start()) {
+    fprintf(stderr, "Cannot start the server on port %d\n", options.port);
+    return 1;
+  }
+
+  std::vector<ClientContext> contexts(options.concurrency);
+  std::vector<webdriver::Thread*> threads;
+  for (int i = 0; i < options.concurrency; ++i) {
+    contexts[i].options = &options;
+    contexts[i].request_count = 0;
+    contexts[i].error_count = 0;
+    contexts[i].is_session_created = false;
+    contexts[i].latencies.reserve(INITIAL_SAMPLE_CAPACITY);
+    webdriver::Thread* thread = new webdriver::Thread();
+    thread->Start(&ClientThreadProc, &contexts[i]);
+    threads.push_back(thread);
+  }
+
+  sleep(options.warmup);
+  long long allocation_count = GetServerAllocationCount();
+  long long start = webdriver::ServerMetrics::Now();
+  SetPhase(kMeasurePhase);
+  sleep(options.duration);
+  SetPhase(kStopPhase);
+  long long elapsed = webdriver::ServerMetrics::Now() - start;
+  allocation_count = GetServerAllocationCount() - allocation_count;
+
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->Join();
+    delete threads[i];
+  }
+  server.Stop();
+
+  long long request_count = 0;
+  long long error_count = 0;
+  int failed_client_count = 0;
+  std::vector<long long> latencies;
+  for (size_t i = 0; i < contexts.size(); ++i) {
+    request_count += contexts[i].request_count;
+    error_count += contexts[i].error_count;
+    if (!contexts[i].is_session_created) {
+      ++failed_client_count;
+    }
+    latencies.insert(latencies.end(),
+                     contexts[i].latencies.begin(),
+                     contexts[i].latencies.end());
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  printf("Clients:       %d (keep-alive %s, payload %d bytes, "
+         "sleep %d us)\n",
+         options.concurrency, options.keep_alive ? "on" : "off",
+         options.payload_size, options.sleep_microseconds);
+  if (failed_client_count > 0) {
+    printf("Failed:        %d clients could not create a session\n",
+           failed_client_count);
+  }
+  printf("Requests:      %lld in %.2f s, %lld errors\n",
+         request_count, elapsed / 1000000.0, error_count);
+  printf("Throughput:    %.1f requests/s\n",
+         request_count * 1000000.0 / elapsed);
+  printf("Latency (ms):  p50 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+         GetPercentile(latencies, 50),
+         GetPercentile(latencies, 99),
+         GetPercentile(latencies, 99.9),
+         latencies.size() > 0 ? latencies.back() / 1000.0 : 0.0);
+  printf("Allocations:   %.1f per request\n",
+         request_count > 0 ?
+             static_cast<double>(allocation_count) / request_count : 0.0);
+  return error_count == 0 && failed_client_count == 0 ? 0 : 1;
+}
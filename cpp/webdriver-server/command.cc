@@ -12,7 +12,9 @@
 // limitations under the License.
 
 #include "command.h"
+#include <algorithm>
 #include "command_types.h"
+#include "json_fast_reader.h"
 #include "logging.h"
 
 namespace webdriver {
@@ -23,47 +25,58 @@ Command::Command() : command_type_(webdriver::CommandType::NoCommand) {
 Command::~Command() {
 }
 
-void Command::Populate(const std::string& json_command) {
+void Command::Populate(const CommandType::Id command_type,
+                       const LocatorMap& locator_parameters,
+                       const std::string& json_parameters) {
   LOG(TRACE) << "Entering Command::Populate";
 
-  // Clear the existing maps.
+  this->command_type_ = command_type;
+  this->locator_parameters_ = locator_parameters;
   this->command_parameters_.clear();
-  this->locator_parameters_.clear();
 
-  LOG(DEBUG) << "Raw JSON command: " << json_command;
+  LOG(DEBUG) << "Raw JSON command parameters: " << json_parameters;
 
-  Json::Value root;
-  Json::Reader reader;
-  bool successful_parse = reader.parse(json_command, root);
-  if (!successful_parse) {
-    // report to the user the failure and their locations in the document.
-    LOG(WARN) << "Failed to parse configuration due "
-              << reader.getFormatedErrorMessages() << std::endl
-              << "JSON command: '" << json_command << "'";
+  Json::Value command_parameter_object;
+  JsonFastReader fast_reader;
+  if (!fast_reader.Parse(json_parameters, &command_parameter_object)) {
+    // Json::Reader accepts more than strict JSON, and explains what it
+    // cannot accept.
+    Json::Reader reader;
+    bool successful_parse = reader.parse(json_parameters,
+                                         command_parameter_object);
+    if (!successful_parse) {
+      // report to the user the failure and their locations in the document.
+      // A command that cannot be parsed is treated as no command at all.
+      LOG(WARN) << "Failed to parse configuration due "
+                << reader.getFormatedErrorMessages() << std::endl
+                << "JSON command parameters: '" << json_parameters << "'";
+      this->command_type_ = webdriver::CommandType::NoCommand;
+      this->locator_parameters_.clear();
+      return;
+    }
   }
 
-  this->command_type_ = root.get("command", webdriver::CommandType::NoCommand).asString();
-  if (this->command_type_ != webdriver::CommandType::NoCommand) {
-    Json::Value locator_parameter_object = root["locator"];
-    Json::Value::iterator it = locator_parameter_object.begin();
-    Json::Value::iterator end = locator_parameter_object.end();
-    for (; it != end; ++it) {
-      std::string key = it.key().asString();
-      std::string value = locator_parameter_object[key].asString();
-      this->locator_parameters_[key] = value;
-    }
+  if (!command_parameter_object.isObject()) {
+    LOG(DEBUG) << "Command parameters are not a JSON object, ignoring them";
+    return;
+  }
 
-    Json::Value command_parameter_object = root["parameters"];
-    it = command_parameter_object.begin();
-    end = command_parameter_object.end();
-    for (; it != end; ++it) {
-      std::string key = it.key().asString();
-      Json::Value value = command_parameter_object[key];
-      this->command_parameters_[key] = value;
-    }
-  } else {
-    LOG(DEBUG) << "Command type is zero, no 'command' attribute in JSON object";
+  // Move the parsed values into the parameters map rather than copying
+  // them, since they can be large (file uploads, script arguments).
+  Json::Value::iterator it = command_parameter_object.begin();
+  Json::Value::iterator end = command_parameter_object.end();
+  for (; it != end; ++it) {
+    std::string key = it.key().asString();
+    this->command_parameters_[key].swap(*it);
   }
 }
 
+void Command::Swap(Command* other) {
+  // Exchanges the contents of two commands without copying the command
+  // parameters, which may be large (file uploads, script arguments).
+  std::swap(this->command_type_, other->command_type_);
+  this->locator_parameters_.swap(other->locator_parameters_);
+  this->command_parameters_.swap(other->command_parameters_);
+}
+
 }  // namespace webdriver
@@ -19,6 +19,7 @@
 
 #include <map>
 #include <string>
+#include "command_types.h"
 #include "json.h"
 
 namespace webdriver {
@@ -30,25 +31,26 @@ class Command {
  public:
   Command(void);
   virtual ~Command(void);
-  void Populate(const std::string& json_command);
+  void Populate(const CommandType::Id command_type,
+                const LocatorMap& locator_parameters,
+                const std::string& json_parameters);
+  void Swap(Command* other);
 
-  std::string command_type(void) const { return this->command_type_; }
-  LocatorMap locator_parameters(void) const {
+  CommandType::Id command_type(void) const { return this->command_type_; }
+  const LocatorMap& locator_parameters(void) const {
     return this->locator_parameters_;
   }
-  ParametersMap command_parameters(void) const {
+  const ParametersMap& command_parameters(void) const {
     return this->command_parameters_;
   }
 
  private:
   // The type of command this represents.
-  std::string command_type_;
+  CommandType::Id command_type_;
   // Locator parameters derived from the URL of the command request.
   LocatorMap locator_parameters_;
   // Command parameters passed as JSON in the body of the request.
   ParametersMap command_parameters_;
-
-  DISALLOW_COPY_AND_ASSIGN(Command);
 };
 
 }  // namespace webdriver
@@ -0,0 +1,127 @@
+// Copyright 2013 Software Freedom Conservancy
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "command_types.h"
+
+namespace {
+
+// The names of the command types, in the order of CommandType::Id.
+const char* const kCommandTypeNames[] = {
+  "noCommand",
+  "status",
+  "getSessionList",
+  "newSession",
+  "getSessionCapabilities",
+  "close",
+  "quit",
+  "get",
+  "goBack",
+  "goForward",
+  "refresh",
+  "addCookie",
+  "getAllCookies",
+  "deleteCookie",
+  "deleteAllCookies",
+  "findElement",
+  "findElements",
+  "findChildElement",
+  "findChildElements",
+  "describeElement",
+  "clearElement",
+  "clickElement",
+  "sendKeysToElement",
+  "submit",
+  "getCurrentWindowHandle",
+  "getWindowHandles",
+  "switchToWindow",
+  "switchToFrame",
+  "getActiveElement",
+  "getCurrentUrl",
+  "getPageSource",
+  "getTitle",
+  "executeScript",
+  "executeAsyncScript",
+  "getElementText",
+  "getElementValue",
+  "getElementTagName",
+  "isElementSelected",
+  "isElementEnabled",
+  "isElementDisplayed",
+  "getElementLocation",
+  "getElementLocationInView",
+  "getElementSize",
+  "getAttribute",
+  "getValueOfCssProperty",
+  "elementEquals",
+  "screenshot",
+  "implicitlyWait",
+  "setAsyncScriptTimeout",
+  "setTimeout",
+  "getOrientation",
+  "setOrientation",
+
+  "getWindowSize",
+  "setWindowSize",
+  "getWindowPosition",
+  "setWindowPosition",
+  "maximizeWindow",
+
+  "acceptAlert",
+  "dismissAlert",
+  "getAlertText",
+  "sendKeysToAlert",
+
+  "sendKeysToActiveElement",
+  "mouseMoveTo",
+  "mouseClick",
+  "mouseDoubleClick",
+  "mouseButtonDown",
+  "mouseButtonUp",
+
+  "listAvailableImeEngines",
+  "getActiveImeEngine",
+  "isImeActivated",
+  "activateImeEngine",
+  "deactivateImeEngine",
+
+  "touchClick",
+  "touchDown",
+  "touchUp",
+  "touchMove",
+  "touchScroll",
+  "touchDoubleClick",
+  "touchLongClick",
+  "touchFlick"
+};
+
+// Fails to compile if a command type has no name, or a name no command type.
+typedef char CommandTypeNamesMatchIds[
+    sizeof(kCommandTypeNames) / sizeof(kCommandTypeNames[0]) ==
+    webdriver::CommandType::Count ? 1 : -1];
+
+}  // namespace
+
+namespace webdriver {
+
+namespace CommandType {
+
+const char* GetName(const int command_type) {
+  if (command_type < 0 || command_type >= Count) {
+    return "unknown";
+  }
+  return kCommandTypeNames[command_type];
+}
+
+}  // namespace CommandType
+
+}  // namespace webdriver
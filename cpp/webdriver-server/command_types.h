@@ -12,6 +12,9 @@
 // limitations under the License.
 
 // Defines the types of command available in the WebDriver JSON wire protocol.
+// Each command type is a small integer, so that command types are cheap to
+// copy and compare, and can index arrays of handlers; the names the
+// protocol documentation uses are kept for logging.
 
 #ifndef WEBDRIVER_SERVER_COMMAND_TYPES_H_
 #define WEBDRIVER_SERVER_COMMAND_TYPES_H_
@@ -19,91 +22,100 @@
 namespace webdriver {
 
 namespace CommandType {
-  const std::string NoCommand = "noCommand";
-  const std::string Status = "status";
-  const std::string GetSessionList = "getSessionList";
-  const std::string NewSession = "newSession";
-  const std::string GetSessionCapabilities = "getSessionCapabilities";
-  const std::string Close = "close";
-  const std::string Quit = "quit";
-  const std::string Get = "get";
-  const std::string GoBack = "goBack";
-  const std::string GoForward = "goForward";
-  const std::string Refresh = "refresh";
-  const std::string AddCookie = "addCookie";
-  const std::string GetAllCookies = "getAllCookies";
-  const std::string DeleteCookie = "deleteCookie";
-  const std::string DeleteAllCookies = "deleteAllCookies";
-  const std::string FindElement = "findElement";
-  const std::string FindElements = "findElements";
-  const std::string FindChildElement = "findChildElement";
-  const std::string FindChildElements = "findChildElements";
-  const std::string DescribeElement = "describeElement";
-  const std::string ClearElement = "clearElement";
-  const std::string ClickElement = "clickElement";
-  const std::string SendKeysToElement = "sendKeysToElement";
-  const std::string SubmitElement = "submit";
-  const std::string GetCurrentWindowHandle = "getCurrentWindowHandle";
-  const std::string GetWindowHandles = "getWindowHandles";
-  const std::string SwitchToWindow = "switchToWindow";
-  const std::string SwitchToFrame = "switchToFrame";
-  const std::string GetActiveElement = "getActiveElement";
-  const std::string GetCurrentUrl = "getCurrentUrl";
-  const std::string GetPageSource = "getPageSource";
-  const std::string GetTitle = "getTitle";
-  const std::string ExecuteScript = "executeScript";
-  const std::string ExecuteAsyncScript = "executeAsyncScript";
-  const std::string GetElementText = "getElementText";
-  const std::string GetElementValue = "getElementValue";
-  const std::string GetElementTagName = "getElementTagName";
-  const std::string IsElementSelected = "isElementSelected";
-  const std::string IsElementEnabled = "isElementEnabled";
-  const std::string IsElementDisplayed = "isElementDisplayed";
-  const std::string GetElementLocation = "getElementLocation";
-  const std::string GetElementLocationOnceScrolledIntoView = "getElementLocationInView";
-  const std::string GetElementSize = "getElementSize";
-  const std::string GetElementAttribute = "getAttribute";
-  const std::string GetElementValueOfCssProperty = "getValueOfCssProperty";
-  const std::string ElementEquals = "elementEquals";
-  const std::string Screenshot = "screenshot";
-  const std::string ImplicitlyWait = "implicitlyWait";
-  const std::string SetAsyncScriptTimeout = "setAsyncScriptTimeout";
-  const std::string SetTimeout = "setTimeout";
-  const std::string GetOrientation = "getOrientation";
-  const std::string SetOrientation = "setOrientation";
+  enum Id {
+    NoCommand = 0,
+    Status,
+    GetSessionList,
+    NewSession,
+    GetSessionCapabilities,
+    Close,
+    Quit,
+    Get,
+    GoBack,
+    GoForward,
+    Refresh,
+    AddCookie,
+    GetAllCookies,
+    DeleteCookie,
+    DeleteAllCookies,
+    FindElement,
+    FindElements,
+    FindChildElement,
+    FindChildElements,
+    DescribeElement,
+    ClearElement,
+    ClickElement,
+    SendKeysToElement,
+    SubmitElement,
+    GetCurrentWindowHandle,
+    GetWindowHandles,
+    SwitchToWindow,
+    SwitchToFrame,
+    GetActiveElement,
+    GetCurrentUrl,
+    GetPageSource,
+    GetTitle,
+    ExecuteScript,
+    ExecuteAsyncScript,
+    GetElementText,
+    GetElementValue,
+    GetElementTagName,
+    IsElementSelected,
+    IsElementEnabled,
+    IsElementDisplayed,
+    GetElementLocation,
+    GetElementLocationOnceScrolledIntoView,
+    GetElementSize,
+    GetElementAttribute,
+    GetElementValueOfCssProperty,
+    ElementEquals,
+    Screenshot,
+    ImplicitlyWait,
+    SetAsyncScriptTimeout,
+    SetTimeout,
+    GetOrientation,
+    SetOrientation,
 
-  const std::string GetWindowSize = "getWindowSize";
-  const std::string SetWindowSize = "setWindowSize";
-  const std::string GetWindowPosition = "getWindowPosition";
-  const std::string SetWindowPosition = "setWindowPosition";
-  const std::string MaximizeWindow = "maximizeWindow";
+    GetWindowSize,
+    SetWindowSize,
+    GetWindowPosition,
+    SetWindowPosition,
+    MaximizeWindow,
 
-  const std::string AcceptAlert = "acceptAlert";
-  const std::string DismissAlert = "dismissAlert";
-  const std::string GetAlertText = "getAlertText";
-  const std::string SendKeysToAlert = "sendKeysToAlert";
+    AcceptAlert,
+    DismissAlert,
+    GetAlertText,
+    SendKeysToAlert,
 
-  const std::string SendKeysToActiveElement = "sendKeysToActiveElement";
-  const std::string MouseMoveTo = "mouseMoveTo";
-  const std::string MouseClick = "mouseClick";
-  const std::string MouseDoubleClick = "mouseDoubleClick";
-  const std::string MouseButtonDown = "mouseButtonDown";
-  const std::string MouseButtonUp = "mouseButtonUp";
+    SendKeysToActiveElement,
+    MouseMoveTo,
+    MouseClick,
+    MouseDoubleClick,
+    MouseButtonDown,
+    MouseButtonUp,
 
-  const std::string ListAvailableImeEngines = "listAvailableImeEngines";
-  const std::string GetActiveImeEngine = "getActiveImeEngine";
-  const std::string IsImeActivated = "isImeActivated";
-  const std::string ActivateImeEngine = "activateImeEngine";
-  const std::string DeactivateImeEngine = "deactivateImeEngine";
+    ListAvailableImeEngines,
+    GetActiveImeEngine,
+    IsImeActivated,
+    ActivateImeEngine,
+    DeactivateImeEngine,
 
-  const std::string TouchClick = "touchClick";
-  const std::string TouchDown = "touchDown";
-  const std::string TouchUp = "touchUp";
-  const std::string TouchMove = "touchMove";
-  const std::string TouchScroll = "touchScroll";
-  const std::string TouchDoubleClick = "touchDoubleClick";
-  const std::string TouchLongClick = "touchLongClick";
-  const std::string TouchFlick = "touchFlick";
+    TouchClick,
+    TouchDown,
+    TouchUp,
+    TouchMove,
+    TouchScroll,
+    TouchDoubleClick,
+    TouchLongClick,
+    TouchFlick,
+
+    // The number of command types; not itself a command type.
+    Count
+  };
+
+  // Returns the name of the command type, such as "findElement", or
+  // "unknown" if command_type is not a command type.
+  const char* GetName(const int command_type);
 }
 
 }  // namespace webdriver
@@ -0,0 +1,420 @@
+// Copyright 2013 Software Freedom Conservancy
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "json_fast_reader.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_M_X64) || defined(__SSE2__) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QUOTE_SCAN_USES_SSE2
+#include <emmintrin.h>
+#endif
+
+// Deeper documents are left to Json::Reader.
+#define MAX_NESTING_DEPTH 256
+#define NUMBER_BUFFER_SIZE 64
+
+namespace webdriver {
+
+bool JsonFastReader::Parse(const std::string& document, Json::Value* root) {
+  this->current_ = document.data();
+  this->end_ = document.data() + document.size();
+  this->depth_ = 0;
+  bool is_parsed = this->ReadValue(root);
+  if (is_parsed) {
+    this->SkipSpaces();
+    is_parsed = this->current_ == this->end_;
+  }
+  if (!is_parsed) {
+    Json::Value null_value;
+    root->swap(null_value);
+  }
+  return is_parsed;
+}
+
+bool JsonFastReader::ReadValue(Json::Value* value) {
+  this->SkipSpaces();
+  if (this->current_ == this->end_) {
+    return false;
+  }
+  switch (*this->current_) {
+    case '{':
+      return this->ReadObject(value);
+    case '[':
+      return this->ReadArray(value);
+    case '"': {
+      const char* string_value;
+      size_t length;
+      if (!this->ReadString(&string_value, &length)) {
+        return false;
+      }
+      Json::Value new_value(string_value, string_value + length);
+      value->swap(new_value);
+      return true;
+    }
+    case 't':
+      if (!this->ReadLiteral("true", 4)) {
+        return false;
+      }
+      *value = true;
+      return true;
+    case 'f':
+      if (!this->ReadLiteral("false", 5)) {
+        return false;
+      }
+      *value = false;
+      return true;
+    case 'n':
+      if (!this->ReadLiteral("null", 4)) {
+        return false;
+      }
+      *value = Json::Value::null;
+      return true;
+    default:
+      return this->ReadNumber(value);
+  }
+}
+
+bool JsonFastReader::ReadObject(Json::Value* value) {
+  if (++this->depth_ > MAX_NESTING_DEPTH) {
+    return false;
+  }
+  ++this->current_;
+  Json::Value new_value(Json::objectValue);
+  value->swap(new_value);
+  this->SkipSpaces();
+  if (this->current_ != this->end_ && *this->current_ == '}') {
+    ++this->current_;
+    --this->depth_;
+    return true;
+  }
+  while (true) {
+    this->SkipSpaces();
+    if (this->current_ == this->end_ || *this->current_ != '"') {
+      return false;
+    }
+    const char* name;
+    size_t name_length;
+    if (!this->ReadString(&name, &name_length)) {
+      return false;
+    }
+    if (name != this->buffer_.data()) {
+      this->buffer_.assign(name, name_length);
+    }
+    this->SkipSpaces();
+    if (this->current_ == this->end_ || *this->current_ != ':') {
+      return false;
+    }
+    ++this->current_;
+    // The name is taken as Json::Reader takes it: up to its first null
+    // character, if it has one.
+    if (!this->ReadValue(&(*value)[this->buffer_.c_str()])) {
+      return false;
+    }
+    this->SkipSpaces();
+    if (this->current_ == this->end_) {
+      return false;
+    }
+    char separator = *this->current_++;
+    if (separator == '}') {
+      --this->depth_;
+      return true;
+    }
+    if (separator != ',') {
+      return false;
+    }
+  }
+}
+
+bool JsonFastReader::ReadArray(Json::Value* value) {
+  if (++this->depth_ > MAX_NESTING_DEPTH) {
+    return false;
+  }
+  ++this->current_;
+  Json::Value new_value(Json::arrayValue);
+  value->swap(new_value);
+  this->SkipSpaces();
+  if (this->current_ != this->end_ && *this->current_ == ']') {
+    ++this->current_;
+    --this->depth_;
+    return true;
+  }
+  Json::UInt index = 0;
+  while (true) {
+    if (!this->ReadValue(&(*value)[index++])) {
+      return false;
+    }
+    this->SkipSpaces();
+    if (this->current_ == this->end_) {
+      return false;
+    }
+    char separator = *this->current_++;
+    if (separator == ']') {
+      --this->depth_;
+      return true;
+    }
+    if (separator != ',') {
+      return false;
+    }
+  }
+}
+
+// Reads the string at the current position. A string with no escapes is
+// returned where it lies in the document; any other is decoded into the
+// buffer.
+bool JsonFastReader::ReadString(const char** value, size_t* length) {
+  const char* start = ++this->current_;
+  size_t run_length = FindQuoteOrBackslash(start, this->end_ - start);
+  if (start + run_length == this->end_) {
+    return false;
+  }
+  if (start[run_length] == '"') {
+    this->current_ = start + run_length + 1;
+    *value = start;
+    *length = run_length;
+    return true;
+  }
+
+  this->buffer_.assign(start, run_length);
+  this->current_ = start + run_length;
+  while (true) {
+    if (this->current_ == this->end_) {
+      return false;
+    }
+    char character = *this->current_++;
+    if (character == '"') {
+      break;
+    }
+    if (character != '\\') {
+      this->buffer_.push_back(character);
+      continue;
+    }
+    if (this->current_ == this->end_) {
+      return false;
+    }
+    char escape = *this->current_++;
+    switch (escape) {
+      case '"':
+      case '/':
+      case '\\':
+        this->buffer_.push_back(escape);
+        break;
+      case 'b':
+        this->buffer_.push_back('\b');
+        break;
+      case 'f':
+        this->buffer_.push_back('\f');
+        break;
+      case 'n':
+        this->buffer_.push_back('\n');
+        break;
+      case 'r':
+        this->buffer_.push_back('\r');
+        break;
+      case 't':
+        this->buffer_.push_back('\t');
+        break;
+      case 'u': {
+        unsigned int code_point;
+        if (!this->DecodeUnicodeEscape(&code_point)) {
+          return false;
+        }
+        if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+          // The first half of a surrogate pair, which must be followed by
+          // the second half.
+          unsigned int low_surrogate;
+          if (this->end_ - this->current_ < 6 ||
+              this->current_[0] != '\\' || this->current_[1] != 'u') {
+            return false;
+          }
+          this->current_ += 2;
+          if (!this->DecodeUnicodeEscape(&low_surrogate)) {
+            return false;
+          }
+          code_point = 0x10000 + ((code_point & 0x3FF) << 10) +
+                       (low_surrogate & 0x3FF);
+        }
+        AppendCodePoint(code_point, &this->buffer_);
+        break;
+      }
+      default:
+        return false;
+    }
+    size_t next_run_length = FindQuoteOrBackslash(this->current_,
+                                                  this->end_ - this->current_);
+    this->buffer_.append(this->current_, next_run_length);
+    this->current_ += next_run_length;
+  }
+  *value = this->buffer_.data();
+  *length = this->buffer_.size();
+  return true;
+}
+
+// Decodes a number as Json::Reader does, into the smallest of Int, UInt
+// and double that Json::Reader would choose.
+bool JsonFastReader::ReadNumber(Json::Value* value) {
+  const char* start = this->current_;
+  if (*start != '-' && (*start < '0' || *start > '9')) {
+    return false;
+  }
+  bool is_double = false;
+  while (this->current_ != this->end_) {
+    char character = *this->current_;
+    if (character == '.' || character == 'e' || character == 'E' ||
+        character == '+' || (character == '-' && this->current_ != start)) {
+      is_double = true;
+    } else if ((character < '0' || character > '9') && character != '-') {
+      break;
+    }
+    ++this->current_;
+  }
+
+  if (!is_double) {
+    const char* digit = start;
+    bool is_negative = *digit == '-';
+    if (is_negative) {
+      ++digit;
+    }
+    Json::UInt threshold = (is_negative ?
+        Json::UInt(-Json::Value::minInt) : Json::Value::maxUInt) / 10;
+    Json::UInt integer = 0;
+    for (; digit < this->current_; ++digit) {
+      if (integer >= threshold) {
+        is_double = true;
+        break;
+      }
+      integer = integer * 10 + Json::UInt(*digit - '0');
+    }
+    if (!is_double) {
+      if (is_negative) {
+        *value = -Json::Int(integer);
+      } else if (integer <= Json::UInt(Json::Value::maxInt)) {
+        *value = Json::Int(integer);
+      } else {
+        *value = integer;
+      }
+      return true;
+    }
+  }
+
+  size_t length = this->current_ - start;
+  double real;
+  int count;
+  if (length < NUMBER_BUFFER_SIZE) {
+    char buffer[NUMBER_BUFFER_SIZE];
+    memcpy(buffer, start, length);
+    buffer[length] = '\0';
+    count = sscanf(buffer, "%lf", &real);
+  } else {
+    std::string buffer(start, length);
+    count = sscanf(buffer.c_str(), "%lf", &real);
+  }
+  if (count != 1) {
+    return false;
+  }
+  *value = real;
+  return true;
+}
+
+bool JsonFastReader::ReadLiteral(const char* literal, const size_t length) {
+  if (static_cast<size_t>(this->end_ - this->current_) < length ||
+      memcmp(this->current_, literal, length) != 0) {
+    return false;
+  }
+  this->current_ += length;
+  return true;
+}
+
+bool JsonFastReader::DecodeUnicodeEscape(unsigned int* code_point) {
+  if (this->end_ - this->current_ < 4) {
+    return false;
+  }
+  *code_point = 0;
+  for (int i = 0; i < 4; ++i) {
+    char digit = *this->current_++;
+    *code_point *= 16;
+    if (digit >= '0' && digit <= '9') {
+      *code_point += digit - '0';
+    } else if (digit >= 'a' && digit <= 'f') {
+      *code_point += digit - 'a' + 10;
+    } else if (digit >= 'A' && digit <= 'F') {
+      *code_point += digit - 'A' + 10;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+void JsonFastReader::SkipSpaces(void) {
+  while (this->current_ != this->end_) {
+    char character = *this->current_;
+    if (character != ' ' && character != '\t' &&
+        character != '\r' && character != '\n') {
+      return;
+    }
+    ++this->current_;
+  }
+}
+
+size_t JsonFastReader::FindQuoteOrBackslash(const char* value,
+                                            const size_t length) {
+  size_t position = 0;
+#ifdef QUOTE_SCAN_USES_SSE2
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  for (; position + 16 <= length; position += 16) {
+    __m128i chunk = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(value + position));
+    int mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, backslash)));
+    if (mask != 0) {
+      while ((mask & 1) == 0) {
+        mask >>= 1;
+        ++position;
+      }
+      return position;
+    }
+  }
+#endif
+  for (; position < length; ++position) {
+    if (value[position] == '"' || value[position] == '\\') {
+      break;
+    }
+  }
+  return position;
+}
+
+void JsonFastReader::AppendCodePoint(const unsigned int code_point,
+                                     std::string* decoded) {
+  // Encoded as UTF-8, like Json::Reader does.
+  if (code_point <= 0x7F) {
+    decoded->push_back(static_cast<char>(code_point));
+  } else if (code_point <= 0x7FF) {
+    decoded->push_back(static_cast<char>(0xC0 | (0x1F & (code_point >> 6))));
+    decoded->push_back(static_cast<char>(0x80 | (0x3F & code_point)));
+  } else if (code_point <= 0xFFFF) {
+    decoded->push_back(static_cast<char>(0xE0 | (0xF & (code_point >> 12))));
+    decoded->push_back(static_cast<char>(0x80 | (0x3F & (code_point >> 6))));
+    decoded->push_back(static_cast<char>(0x80 | (0x3F & code_point)));
+  } else if (code_point <= 0x10FFFF) {
+    decoded->push_back(static_cast<char>(0xF0 | (0x7 & (code_point >> 18))));
+    decoded->push_back(static_cast<char>(0x80 | (0x3F & (code_point >> 12))));
+    decoded->push_back(static_cast<char>(0x80 | (0x3F & (code_point >> 6))));
+    decoded->push_back(static_cast<char>(0x80 | (0x3F & code_point)));
+  }
+}
+
+}  // namespace webdriver
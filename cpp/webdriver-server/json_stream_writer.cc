@@ -0,0 +1,199 @@
+// Copyright 2013 Software Freedom Conservancy
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "json_stream_writer.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_M_X64) || defined(__SSE2__) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ESCAPE_SCAN_USES_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Characters that Json::FastWriter escapes: quotes, backslashes and
+// control characters. Characters from 0x80 up are UTF-8, and are written
+// as they are.
+inline bool NeedsEscape(const unsigned char character) {
+  return character < 0x20 || character == '"' || character == '\\';
+}
+
+}  // namespace
+
+namespace webdriver {
+
+void JsonStreamWriter::WriteValue(const Json::Value& value) {
+  switch (value.type()) {
+    case Json::nullValue:
+      this->WriteRaw("null", 4);
+      break;
+    case Json::intValue:
+      this->WriteInteger(value.asInt());
+      break;
+    case Json::uintValue:
+      this->WriteUnsigned(value.asUInt());
+      break;
+    case Json::realValue:
+      // Rare enough to leave to the library, so that doubles are written
+      // exactly as Json::FastWriter writes them.
+      this->output_->append(Json::valueToString(value.asDouble()));
+      break;
+    case Json::stringValue: {
+      const char* string_value = value.asCString();
+      if (string_value == NULL) {
+        string_value = "";
+      }
+      this->WriteString(string_value, strlen(string_value));
+      break;
+    }
+    case Json::booleanValue:
+      if (value.asBool()) {
+        this->WriteRaw("true", 4);
+      } else {
+        this->WriteRaw("false", 5);
+      }
+      break;
+    case Json::arrayValue: {
+      // Arrays may have gaps, which are written as null, like
+      // Json::FastWriter does when it indexes the array.
+      this->output_->push_back('[');
+      Json::UInt next_index = 0;
+      Json::Value::const_iterator it = value.begin();
+      for (; it != value.end(); ++it) {
+        Json::UInt index = it.index();
+        for (; next_index < index; ++next_index) {
+          this->WriteRaw(next_index == 0 ? "null" : ",null",
+                         next_index == 0 ? 4 : 5);
+        }
+        if (next_index > 0) {
+          this->output_->push_back(',');
+        }
+        this->WriteValue(*it);
+        next_index = index + 1;
+      }
+      this->output_->push_back(']');
+      break;
+    }
+    case Json::objectValue: {
+      this->output_->push_back('{');
+      Json::Value::const_iterator it = value.begin();
+      for (; it != value.end(); ++it) {
+        if (it != value.begin()) {
+          this->output_->push_back(',');
+        }
+        const char* name = it.memberName();
+        this->WriteString(name, strlen(name));
+        this->output_->push_back(':');
+        this->WriteValue(*it);
+      }
+      this->output_->push_back('}');
+      break;
+    }
+  }
+}
+
+void JsonStreamWriter::WriteString(const char* value, const size_t length) {
+  this->output_->push_back('"');
+  size_t position = 0;
+  while (position < length) {
+    size_t run_length = FindEscape(value + position, length - position);
+    this->output_->append(value + position, run_length);
+    position += run_length;
+    if (position < length) {
+      this->WriteEscaped(value[position]);
+      ++position;
+    }
+  }
+  this->output_->push_back('"');
+}
+
+void JsonStreamWriter::WriteInteger(const long long value) {
+  char buffer[32];
+  int length = sprintf(buffer, "%lld", value);
+  this->output_->append(buffer, length);
+}
+
+void JsonStreamWriter::WriteUnsigned(const unsigned long long value) {
+  char buffer[32];
+  int length = sprintf(buffer, "%llu", value);
+  this->output_->append(buffer, length);
+}
+
+size_t JsonStreamWriter::FindEscape(const char* value, const size_t length) {
+  size_t position = 0;
+#ifdef ESCAPE_SCAN_USES_SSE2
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i last_control = _mm_set1_epi8(0x1F);
+  for (; position + 16 <= length; position += 16) {
+    __m128i chunk = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(value + position));
+    // A byte is a control character if the unsigned maximum of it and
+    // 0x1F is 0x1F.
+    __m128i matches = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, backslash)),
+        _mm_cmpeq_epi8(_mm_max_epu8(chunk, last_control), last_control));
+    int mask = _mm_movemask_epi8(matches);
+    if (mask != 0) {
+      while ((mask & 1) == 0) {
+        mask >>= 1;
+        ++position;
+      }
+      return position;
+    }
+  }
+#endif
+  for (; position < length; ++position) {
+    if (NeedsEscape(static_cast<unsigned char>(value[position]))) {
+      break;
+    }
+  }
+  return position;
+}
+
+void JsonStreamWriter::WriteEscaped(const char character) {
+  switch (character) {
+    case '"':
+      this->WriteRaw("\\\"", 2);
+      break;
+    case '\\':
+      this->WriteRaw("\\\\", 2);
+      break;
+    case '\b':
+      this->WriteRaw("\\b", 2);
+      break;
+    case '\f':
+      this->WriteRaw("\\f", 2);
+      break;
+    case '\n':
+      this->WriteRaw("\\n", 2);
+      break;
+    case '\r':
+      this->WriteRaw("\\r", 2);
+      break;
+    case '\t':
+      this->WriteRaw("\\t", 2);
+      break;
+    default: {
+      char buffer[8];
+      sprintf(buffer, "\\u%04X", static_cast<unsigned char>(character));
+      this->WriteRaw(buffer, 6);
+      break;
+    }
+  }
+}
+
+}  // namespace webdriver
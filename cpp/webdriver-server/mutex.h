@@ -0,0 +1,88 @@
+// Copyright 2011 Software Freedom Conservancy
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Defines a mutual exclusion lock for use by the WebDriver server, and a
+// helper class that holds a lock for the duration of a scope.
+
+#ifndef WEBDRIVER_SERVER_MUTEX_H_
+#define WEBDRIVER_SERVER_MUTEX_H_
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+namespace webdriver {
+
+class Mutex {
+ public:
+  Mutex(void) {
+#ifdef _WIN32
+    ::InitializeCriticalSection(&this->lock_);
+#else
+    pthread_mutex_init(&this->lock_, NULL);
+#endif
+  }
+
+  ~Mutex(void) {
+#ifdef _WIN32
+    ::DeleteCriticalSection(&this->lock_);
+#else
+    pthread_mutex_destroy(&this->lock_);
+#endif
+  }
+
+  void Lock(void) {
+#ifdef _WIN32
+    ::EnterCriticalSection(&this->lock_);
+#else
+    pthread_mutex_lock(&this->lock_);
+#endif
+  }
+
+  void Unlock(void) {
+#ifdef _WIN32
+    ::LeaveCriticalSection(&this->lock_);
+#else
+    pthread_mutex_unlock(&this->lock_);
+#endif
+  }
+
+ private:
+#ifdef _WIN32
+  CRITICAL_SECTION lock_;
+#else
+  pthread_mutex_t lock_;
+#endif
+
+  DISALLOW_COPY_AND_ASSIGN(Mutex);
+};
+
+class ScopedLock {
+ public:
+  explicit ScopedLock(Mutex* mutex) : mutex_(mutex) {
+    this->mutex_->Lock();
+  }
+
+  ~ScopedLock(void) {
+    this->mutex_->Unlock();
+  }
+
+ private:
+  Mutex* mutex_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedLock);
+};
+
+}  // namespace webdriver
+
+#endif  // WEBDRIVER_SERVER_MUTEX_H_
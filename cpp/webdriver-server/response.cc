@@ -12,8 +12,16 @@
 // limitations under the License.
 
 #include "response.h"
+#include <string.h>
+#include <algorithm>
+#include "json_fast_reader.h"
+#include "json_stream_writer.h"
 #include "logging.h"
 
+// Room for the member names and punctuation of a serialized response,
+// and for some escaping.
+#define SERIALIZED_RESPONSE_OVERHEAD 64
+
 namespace webdriver {
 
 Response::Response(void) : status_code_(0), session_id_(""), value_(Json::Value::null) {
@@ -32,23 +40,42 @@ void Response::Deserialize(const std::string& json) {
   LOG(TRACE) << "Entering Response::Deserialize";
 
   Json::Value response_object;
-  Json::Reader reader;
-  reader.parse(json, response_object);
+  JsonFastReader fast_reader;
+  if (!fast_reader.Parse(json, &response_object)) {
+    Json::Reader reader;
+    reader.parse(json, response_object);
+  }
   this->status_code_ = response_object["status"].asInt();
   this->session_id_ = response_object["sessionId"].asString();
   this->value_ = response_object["value"];
 }
 
 std::string Response::Serialize(void) {
+  std::string output;
+  this->Serialize(&output);
+  return output;
+}
+
+void Response::Serialize(std::string* output) {
   LOG(TRACE) << "Entering Response::Serialize";
 
-  Json::Value json_object;
-  json_object["status"] = this->status_code_;
-  json_object["sessionId"] = this->session_id_;
-  json_object["value"] = this->value_;
-  Json::FastWriter writer;
-  std::string output(writer.write(json_object));
-  return output;
+  // Written straight from the fields, with the members in the order
+  // Json::FastWriter would write them. The output is sized for a string
+  // value, which is what makes responses large (screenshots, page source).
+  size_t value_size_estimate = 0;
+  if (this->value_.isString() && this->value_.asCString() != NULL) {
+    value_size_estimate = strlen(this->value_.asCString());
+  }
+  output->reserve(output->size() + this->session_id_.size() +
+                  value_size_estimate + SERIALIZED_RESPONSE_OVERHEAD);
+  JsonStreamWriter writer(output);
+  writer.WriteRaw("{\"sessionId\":", 13);
+  writer.WriteString(this->session_id_);
+  writer.WriteRaw(",\"status\":", 10);
+  writer.WriteInteger(this->status_code_);
+  writer.WriteRaw(",\"value\":", 9);
+  writer.WriteValue(this->value_);
+  writer.WriteRaw("}\n", 2);
 }
 
 void Response::SetSuccessResponse(const Json::Value& response_value) {
@@ -71,4 +98,12 @@ void Response::SetErrorResponse(const int status_code,
   this->value_["message"] = message;
 }
 
+void Response::Swap(Response* other) {
+  // Exchanges the contents of two responses without copying the
+  // response values, which may be large (screenshots, page source).
+  std::swap(this->status_code_, other->status_code_);
+  this->session_id_.swap(other->session_id_);
+  this->value_.swap(other->value_);
+}
+
 }  // namespace webdriver
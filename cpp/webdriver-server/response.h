@@ -28,15 +28,23 @@ class Response {
   explicit Response(const std::string& session_id);
   virtual ~Response(void);
   std::string Serialize(void);
+  // Appends the serialized response to output.
+  void Serialize(std::string* output);
   void Deserialize(const std::string& json);
 
   int status_code(void) const { return this->status_code_; }
 
-  Json::Value value(void) const { return this->value_; }
+  std::string session_id(void) const { return this->session_id_; }
+  void set_session_id(const std::string& session_id) {
+    this->session_id_ = session_id;
+  }
+
+  const Json::Value& value(void) const { return this->value_; }
 
   void SetResponse(const int status_code, const Json::Value& response_value);
   void SetSuccessResponse(const Json::Value& response_value);
   void SetErrorResponse(const int error_code, const std::string& message);
+  void Swap(Response* other);
 
  private:
   // The status code of the response, indicating success or failure.
@@ -11,48 +11,110 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include <regex>
 #include "server.h"
 #include "logging.h"
 
 #define SERVER_DEFAULT_PAGE "<html><head><title>WebDriver</title></head><body><p id='main'>This is the initial start page for the WebDriver server.</p></body></html>"
-#define HTML_CONTENT_TYPE "text/html"
-#define JSON_CONTENT_TYPE "application/json"
+#define HTML_HEADERS "Content-Type: text/html; charset=UTF-8\r\n" \
+    "Vary: Accept-Charset, Accept-Encoding, Accept-Language, Accept\r\n" \
+    "Accept-Ranges: bytes\r\n"
+#define JSON_HEADERS "Content-Type: application/json; charset=UTF-8\r\n" \
+    "Vary: Accept-Charset, Accept-Encoding, Accept-Language, Accept\r\n" \
+    "Accept-Ranges: bytes\r\n"
+#define METRICS_HEADERS "Content-Type: text/plain; version=0.0.4; charset=UTF-8\r\n"
+// Pre-rendered pieces of the error responses the server produces itself,
+// with keys in the order in which Response::Serialize writes them.
+#define NO_SESSION_RESPONSE_PREFIX "{\"sessionId\":\"<no session>\",\"status\":404,\"value\":"
+#define SESSION_RESPONSE_PREFIX "{\"sessionId\":\""
+#define NULL_SUCCESS_RESPONSE_SUFFIX "\",\"status\":0,\"value\":null}\n"
+#define NO_SUCH_SESSION_RESPONSE_INFIX "\",\"status\":6,\"value\":\"session "
+#define NO_SUCH_SESSION_RESPONSE_SUFFIX " does not exist\"}\n"
+#define KEEP_ALIVE_TIMEOUT_IN_MILLISECONDS "10000"
+#define DEFAULT_MAX_REQUEST_BODY_SIZE_IN_BYTES 268435456
+#define BODY_READ_SIZE_IN_BYTES 65536
+#define DEFAULT_THREAD_COUNT 10
+#define DEFAULT_QUEUE_SIZE 20
+#define MAINTENANCE_INTERVAL_IN_MILLISECONDS 100
 
 namespace webdriver {
 
+// The standard HTTP Status codes are implemented below.  Chrome uses
+// OK, See Other, Not Found, Method Not Allowed, and Internal Error.
+// Internal Error, HTTP 500, is used as a catch all for any issue
+// not covered in the JSON protocol. Every response carries an exact
+// Content-Length, so that the connection can be kept alive for the
+// next request when the client asks for it.
+const Server::HttpStatus Server::http_statuses_[] = {
+  { 0, 200, "HTTP/1.1 200 OK\r\n" JSON_HEADERS, NULL, true },
+  { 200, 200, "HTTP/1.1 200 OK\r\n" HTML_HEADERS, NULL, true },
+  { 303, 303, "HTTP/1.1 303 See Other\r\n"
+              "Content-Type: text/html\r\n", "Location", false },
+  { 400, 400, "HTTP/1.1 400 Bad Request\r\n" JSON_HEADERS, NULL, true },
+  { 404, 404, "HTTP/1.1 404 Not Found\r\n" JSON_HEADERS, NULL, true },
+  { 405, 405, "HTTP/1.1 405 Method Not Allowed\r\n"
+              "Content-Type: text/html\r\n", "Allow", false },
+  { 413, 413, "HTTP/1.1 413 Request Entity Too Large\r\n"
+              "Content-Type: application/json; charset=UTF-8\r\n", NULL, true },
+  { 501, 501, "HTTP/1.1 501 Not Implemented\r\n", NULL, false },
+  { -1, 500, "HTTP/1.1 500 Internal Server Error\r\n" JSON_HEADERS, NULL, true }
+};
+
+const Server::HttpStatus Server::metrics_http_status_ = {
+  0, 200, "HTTP/1.1 200 OK\r\n" METRICS_HEADERS, NULL, true
+};
+
 Server::Server(const int port) {
-  this->Initialize(port, "", "", "");
+  this->Initialize(port, "", "", "", 0, 0);
 }
 
 Server::Server(const int port, const std::string& host) {
-  this->Initialize(port, host, "", "");
+  this->Initialize(port, host, "", "", 0, 0);
 }
 
 Server::Server(const int port,
                const std::string& host,
                const std::string& log_level,
                const std::string& log_file) {
-  this->Initialize(port, host, log_level, log_file);
+  this->Initialize(port, host, log_level, log_file, 0, 0);
+}
+
+Server::Server(const int port,
+               const std::string& host,
+               const std::string& log_level,
+               const std::string& log_file,
+               const int thread_count,
+               const int queue_size) {
+  this->Initialize(port, host, log_level, log_file, thread_count, queue_size);
 }
 
 Server::~Server(void) {
-  SessionMap::iterator it = this->sessions_.begin();
-  for (; it != this->sessions_.end(); ++it) {
-    std::string session_id = it->first;
-    this->ShutDownSession(session_id);
+  this->Stop();
+  this->ShutDownScheduledSessions();
+  std::vector<SessionHandle> sessions;
+  this->sessions_.GetAll(&sessions);
+  std::vector<SessionHandle>::const_iterator it = sessions.begin();
+  for (; it != sessions.end(); ++it) {
+    this->ShutDownSession((*it)->session_id());
   }
 }
 
 void Server::Initialize(const int port,
                         const std::string& host,
                         const std::string& log_level,
-                        const std::string& log_file) {
+                        const std::string& log_file,
+                        const int thread_count,
+                        const int queue_size) {
   LOG::Level(log_level);
   LOG::File(log_file);
   LOG(INFO) << "Starting WebDriver server on port: '" << port << "' on host: '" << host << "'";
   this->port_ = port;
   this->host_ = host;
+  // Zero or less means the default was requested.
+  this->thread_count_ = thread_count > 0 ? thread_count : DEFAULT_THREAD_COUNT;
+  this->queue_size_ = queue_size > 0 ? queue_size : DEFAULT_QUEUE_SIZE;
+  this->max_request_body_size_ = DEFAULT_MAX_REQUEST_BODY_SIZE_IN_BYTES;
+  this->context_ = NULL;
+  this->is_stopping_ = false;
   this->PopulateCommandRepository();
 }
 
@@ -81,57 +143,141 @@ void* Server::OnHttpEvent(enum mg_event event_raised,
 
 bool Server::Start() {
   LOG(TRACE) << "Entering Server::Start";
-  std::string port_format_string = "%s:%d";
-  if (this->host_.size() == 0) {
-    // If the host name is an empty string, then we don't want the colon
-    // in the listening ports string. Remove it from the format string,
-    // and when we use printf to format, the %s will be replaced by an
-    // empty string.
-    port_format_string = "%s%d";
-  }
-  int formatted_string_size = _scprintf(port_format_string.c_str(),
-                                        this->host_.c_str(),
-                                        this->port_);
-  char* listening_ports_buffer = new char[formatted_string_size + 1];
-  _snprintf_s(listening_ports_buffer,
-              formatted_string_size + 1,
-              formatted_string_size,
-              port_format_string.c_str(),
-              this->host_.c_str(),
-              this->port_);
+  // If the host name is an empty string, then we don't want the colon
+  // in the listening ports string.
+  std::ostringstream listening_ports_stream;
+  if (this->host_.size() != 0) {
+    listening_ports_stream << this->host_ << ":";
+  }
+  listening_ports_stream << this->port_;
+  std::string listening_ports = listening_ports_stream.str();
 
   std::string acl = "-0.0.0.0/0,+127.0.0.1";
   LOG(DEBUG) << "Mongoose ACL is " << acl;
 
-  const char* options[] = { "listening_ports", listening_ports_buffer,
+  std::ostringstream thread_count_stream;
+  thread_count_stream << this->thread_count_;
+  std::string thread_count = thread_count_stream.str();
+  std::ostringstream queue_size_stream;
+  queue_size_stream << this->queue_size_;
+  std::string queue_size = queue_size_stream.str();
+  LOG(DEBUG) << "Mongoose uses " << thread_count << " worker threads and "
+             << "a connection queue of size " << queue_size;
+
+  // Kept-alive connections waiting for their next request are watched by
+  // the Mongoose master thread, with epoll on Linux and select elsewhere,
+  // and so do not hold worker threads. Where select is used, it watches
+  // at most FD_SETSIZE of them (64 on Windows); any more stay with their
+  // worker threads until the keep-alive timeout.
+  const char* options[] = { "listening_ports", listening_ports.c_str(),
                             "access_control_list", acl.c_str(),
-                            // "enable_keep_alive", "yes",
+                            "enable_keep_alive", "yes",
+                            "keep_alive_timeout_ms", KEEP_ALIVE_TIMEOUT_IN_MILLISECONDS,
+                            "num_threads", thread_count.c_str(),
+                            "queue_size", queue_size.c_str(),
                             NULL };
+  this->metrics_.Initialize();
   context_ = mg_start(&OnHttpEvent, this, options);
   if (context_ == NULL) {
     LOG(WARN) << "Failed to start Mongoose";
     return false;
   }
+
+  {
+    ScopedLock lock(&this->pending_commands_lock_);
+    this->is_stopping_ = false;
+  }
+  if (!this->maintenance_thread_.Start(&Server::MaintenanceThreadProc, this)) {
+    LOG(WARN) << "Failed to start maintenance thread";
+  }
   return true;
 }
 
 void Server::Stop() {
   LOG(TRACE) << "Entering Server::Stop";
   if (context_) {
+    struct mg_queue_stats stats;
+    this->GetQueueStats(&stats);
+    LOG(INFO) << "Connection queue: " << stats.num_dequeued << " dequeued, "
+              << stats.num_rejected << " rejected, "
+              << stats.total_wait_ms << " ms total wait, "
+              << stats.max_wait_ms << " ms max wait";
+
+    // Mongoose cannot stop while connections are suspended, so abandon
+    // the commands still executing.
+    std::vector<PendingCommandHandle> pending_commands;
+    {
+      ScopedLock lock(&this->pending_commands_lock_);
+      this->is_stopping_ = true;
+      pending_commands = this->pending_commands_;
+    }
+    std::vector<PendingCommandHandle>::const_iterator it =
+        pending_commands.begin();
+    for (; it != pending_commands.end(); ++it) {
+      (*it)->Cancel();
+    }
+    // A command that completed before it could be cancelled may still be
+    // sending its response. Wait until it has resumed its connection and
+    // let go of the server, which mg_stop and the destructor free.
+    while (true) {
+      {
+        ScopedLock lock(&this->pending_commands_lock_);
+        if (this->pending_commands_.empty()) {
+          break;
+        }
+      }
+      this->pending_commands_event_.Wait(MAINTENANCE_INTERVAL_IN_MILLISECONDS);
+    }
+    this->maintenance_event_.Set();
+    this->maintenance_thread_.Join();
+
     mg_stop(context_);
     context_ = NULL;
   }
 }
 
+bool Server::GetQueueStats(struct mg_queue_stats* stats) {
+  if (this->context_ == NULL) {
+    return false;
+  }
+  mg_get_queue_stats(this->context_, stats);
+  return true;
+}
+
 int Server::ProcessRequest(struct mg_connection* conn,
     const struct mg_request_info* request_info) {
   LOG(TRACE) << "Entering Server::ProcessRequest";
 
+  // The JSON trees of the command and its response are built and torn
+  // down within the request; take their memory from an arena.
+  Json::ValueArena value_arena;
+  long long request_start_time = ServerMetrics::Now();
+  this->metrics_.BeginRequest();
   int http_response_code = NULL;
   std::string http_verb = request_info->request_method;
   std::string request_body = "{}";
   if (http_verb == "POST") {
-    request_body = this->ReadRequestBody(conn, request_info);
+    int read_status = this->ReadRequestBody(conn, &request_body);
+    this->metrics_.RecordStage(ServerMetrics::kReadBodyStage,
+                               ServerMetrics::Now() - request_start_time);
+    this->metrics_.AddRequestBytes(request_body.size());
+    if (read_status != 0) {
+      // The rest of the body cannot be trusted to be drained in a
+      // reasonable time, so the connection is not reused.
+      mg_set_must_close(conn);
+      Response response;
+      response.set_session_id("<no session>");
+      if (read_status == 413) {
+        response.SetResponse(413, "Request body is too large");
+      } else {
+        response.SetResponse(400, "Unable to read request body");
+      }
+      http_response_code = this->SendResponseToClient(conn,
+                                                      request_info,
+                                                      &response);
+      this->metrics_.EndRequest();
+      return http_response_code;
+    }
   }
 
   LOG(TRACE) << "Process request with:"
@@ -140,34 +286,74 @@ int Server::ProcessRequest(struct mg_connection* conn,
              << "body: " << request_body;
 
   if (strcmp(request_info->uri, "/") == 0) {
-    this->SendHttpOk(conn,
-                     request_info,
-                     SERVER_DEFAULT_PAGE,
-                     HTML_CONTENT_TYPE);
-    http_response_code = 200;
+    http_response_code = this->SendHttpResponse(conn,
+                                                request_info,
+                                                200,
+                                                "",
+                                                SERVER_DEFAULT_PAGE);
   } else if (strcmp(request_info->uri, "/shutdown") == 0) {
-    this->SendHttpOk(conn,
-                     request_info,
-                     SERVER_DEFAULT_PAGE,
-                     HTML_CONTENT_TYPE);
-    http_response_code = 200;
+    http_response_code = this->SendHttpResponse(conn,
+                                                request_info,
+                                                200,
+                                                "",
+                                                SERVER_DEFAULT_PAGE);
     this->ShutDown();
+  } else if (strcmp(request_info->uri, "/metrics") == 0) {
+    http_response_code = this->SendMetrics(conn, request_info);
   } else {
-    std::string serialized_response = this->DispatchCommand(request_info->uri,
-                                                             http_verb,
-                                                             request_body);
-    http_response_code = this->SendResponseToClient(conn,
-                                                    request_info,
-                                                    serialized_response);
+    Response response;
+    int command_index = -1;
+    if (this->DispatchCommand(conn,
+                              request_info,
+                              http_verb,
+                              request_body,
+                              request_start_time,
+                              &command_index,
+                              &response)) {
+      http_response_code = this->SendResponseToClient(conn,
+                                                      request_info,
+                                                      &response);
+    } else {
+      // Accepted; the response has been sent already, or is sent when
+      // the command completes.
+      http_response_code = 202;
+    }
+    this->metrics_.RecordCommand(command_index,
+                                 ServerMetrics::Now() - request_start_time);
   }
 
+  this->metrics_.EndRequest();
   return http_response_code;
 }
 
 void Server::AddCommand(const std::string& url,
                         const std::string& http_verb,
-                        const std::string& command_name) {
-  this->commands_[url][http_verb] = command_name;
+                        const CommandType::Id command_type) {
+  std::vector<std::string> segments;
+  if (!SplitUrl(url, &segments)) {
+    LOG(WARN) << "Unable to add command with malformed URL " << url;
+    return;
+  }
+
+  UrlNode* node = &this->commands_;
+  std::vector<std::string>::const_iterator it = segments.begin();
+  for (; it != segments.end(); ++it) {
+    UrlNodeMap* children = &node->literal_children;
+    std::string key = *it;
+    if (key.size() > 0 && key[0] == ':') {
+      // Skip the colon
+      children = &node->parameter_children;
+      key = key.substr(1);
+    }
+    UrlNodeHandle& child = (*children)[key];
+    if (!child) {
+      child.reset(new UrlNode);
+      child->is_hex_parameter = children == &node->parameter_children &&
+                                (key == "sessionid" || key == "id");
+    }
+    node = child.get();
+  }
+  node->verbs[http_verb] = command_type;
 }
 
 std::string Server::CreateSession() {
@@ -175,449 +361,876 @@ std::string Server::CreateSession() {
 
   SessionHandle session_handle= this->InitializeSession();
   std::string session_id = session_handle->session_id();
-  this->sessions_[session_id] = session_handle;
+  this->sessions_.Add(session_handle);
   return session_id;
 }
 
 void Server::ShutDownSession(const std::string& session_id) {
   LOG(TRACE) << "Entering Server::ShutDownSession";
 
-  SessionMap::iterator it = this->sessions_.find(session_id);
-  if (it != this->sessions_.end()) {
-    it->second->ShutDown();
-    this->sessions_.erase(session_id);
+  SessionHandle session_handle;
+  if (this->sessions_.Remove(session_id, &session_handle)) {
+    session_handle->set_is_registered(false);
+    // Wait for any command still executing on the session. Commands
+    // waiting behind this one find the session gone once they run.
+    ScopedLock command_lock(session_handle->command_mutex());
+    session_handle->ShutDown();
   } else {
     LOG(DEBUG) << "Shutdown session is not found";
   }
 }
 
-std::string Server::ReadRequestBody(struct mg_connection* conn,
-    const struct mg_request_info* request_info) {
+// Removes a session that ended as the result of a command, and leaves it
+// for the maintenance thread to shut down. Called from PendingCommand's
+// Complete, which may run on a thread that the session's ShutDown needs
+// to be free.
+void Server::ScheduleSessionShutDown(const std::string& session_id) {
+  LOG(TRACE) << "Entering Server::ScheduleSessionShutDown";
+
+  SessionHandle session_handle;
+  if (!this->sessions_.Remove(session_id, &session_handle)) {
+    LOG(DEBUG) << "Shutdown session is not found";
+    return;
+  }
+  session_handle->set_is_registered(false);
+  {
+    ScopedLock lock(&this->pending_commands_lock_);
+    this->sessions_to_shut_down_.push_back(session_handle);
+  }
+  this->maintenance_event_.Set();
+}
+
+void Server::ShutDownScheduledSessions() {
+  std::vector<SessionHandle> sessions;
+  {
+    ScopedLock lock(&this->pending_commands_lock_);
+    sessions.swap(this->sessions_to_shut_down_);
+  }
+  std::vector<SessionHandle>::const_iterator it = sessions.begin();
+  for (; it != sessions.end(); ++it) {
+    LOG(DEBUG) << "Shutting down session " << (*it)->session_id();
+    ScopedLock command_lock((*it)->command_mutex());
+    (*it)->ShutDown();
+  }
+}
+
+// Reads the body of a POST request directly into request_body. Returns 0
+// on success, 413 if the body is larger than the maximum allowed size, or
+// 400 if the body is malformed or the client went away before sending all
+// of it.
+int Server::ReadRequestBody(struct mg_connection* conn,
+                            std::string* request_body) {
   LOG(TRACE) << "Entering Server::ReadRequestBody";
 
-  std::string request_body = "";
-  int content_length = 0;
-  for (int header_index = 0; header_index < 64; ++header_index) {
-    if (request_info->http_headers[header_index].name == NULL) {
-      break;
+  int read_status = 0;
+  const char* transfer_encoding = mg_get_header(conn, "Transfer-Encoding");
+  const char* content_length = mg_get_header(conn, "Content-Length");
+  if (transfer_encoding != NULL) {
+    if (!IsHeaderValue(transfer_encoding, "chunked")) {
+      LOG(WARN) << "Unsupported transfer encoding: " << transfer_encoding;
+      return 400;
     }
-    if (strcmp(request_info->http_headers[header_index].name,
-               "Content-Length") == 0) {
-      content_length = atoi(request_info->http_headers[header_index].value);
-      break;
+    read_status = this->ReadChunkedRequestBody(conn, request_body);
+  } else if (content_length != NULL) {
+    size_t body_length = 0;
+    if (!ParseContentLength(content_length, &body_length)) {
+      LOG(WARN) << "Invalid Content-Length: " << content_length;
+      return 400;
+    }
+    if (body_length > this->max_request_body_size_) {
+      LOG(WARN) << "Request body of " << body_length << " bytes is too large";
+      return 413;
+    }
+
+    // The string is grown as the body arrives, rather than to the length
+    // the client declares, so that a client that stalls after its headers
+    // does not hold memory it has not sent.
+    request_body->clear();
+    size_t bytes_read = 0;
+    while (bytes_read < body_length) {
+      if (bytes_read == request_body->size()) {
+        size_t new_size = request_body->size() * 2;
+        if (new_size < BODY_READ_SIZE_IN_BYTES) {
+          new_size = BODY_READ_SIZE_IN_BYTES;
+        }
+        if (new_size > body_length) {
+          new_size = body_length;
+        }
+        request_body->resize(new_size);
+      }
+      int read_result = mg_read(conn,
+                                &(*request_body)[bytes_read],
+                                request_body->size() - bytes_read);
+      if (read_result <= 0) {
+        // The client closed the connection, or went idle for longer
+        // than the keep-alive timeout.
+        LOG(WARN) << "Unable to read complete request body";
+        return 400;
+      }
+      bytes_read += read_result;
     }
-  }
-  if (content_length == 0) {
-    request_body = "{}";
   } else {
-    std::vector<char> buffer(content_length + 1);
-    int bytes_read = 0;
-    while (bytes_read < content_length) {
-      bytes_read += mg_read(conn,
-                            &buffer[bytes_read],
-                            content_length - bytes_read);
+    request_body->clear();
+  }
+
+  if (read_status == 0 && request_body->size() == 0) {
+    request_body->assign("{}");
+  }
+  return read_status;
+}
+
+int Server::ReadChunkedRequestBody(struct mg_connection* conn,
+                                   std::string* request_body) {
+  LOG(TRACE) << "Entering Server::ReadChunkedRequestBody";
+
+  // The size of a chunked body is not known in advance, so the string is
+  // grown geometrically and read into in place. Reads are limited to one
+  // byte past the maximum size, which is enough to detect an oversized body.
+  size_t body_length = 0;
+  request_body->clear();
+  while (body_length <= this->max_request_body_size_) {
+    if (body_length == request_body->size()) {
+      size_t new_size = request_body->size() * 2;
+      if (new_size < BODY_READ_SIZE_IN_BYTES) {
+        new_size = BODY_READ_SIZE_IN_BYTES;
+      }
+      if (new_size > this->max_request_body_size_ + 1) {
+        new_size = this->max_request_body_size_ + 1;
+      }
+      request_body->resize(new_size);
     }
-    buffer[content_length] = '\0';
-    request_body.append(&buffer[0]);
+    int read_result = mg_read(conn,
+                              &(*request_body)[body_length],
+                              request_body->size() - body_length);
+    if (read_result < 0) {
+      LOG(WARN) << "Unable to read complete chunked request body";
+      return 400;
+    }
+    if (read_result == 0) {
+      request_body->resize(body_length);
+      return 0;
+    }
+    body_length += read_result;
   }
 
-  return request_body;
+  LOG(WARN) << "Chunked request body is too large";
+  return 413;
 }
 
-std::string Server::DispatchCommand(const std::string& uri,
-                                     const std::string& http_verb,
-                                     const std::string& command_body) {
+bool Server::ParseContentLength(const char* value, size_t* length) {
+  size_t parsed_length = 0;
+  const char* current = value;
+  while (*current == ' ') {
+    ++current;
+  }
+  if (*current == '\0') {
+    return false;
+  }
+  for (; *current >= '0' && *current <= '9'; ++current) {
+    size_t digit = *current - '0';
+    if (parsed_length > (static_cast<size_t>(-1) - digit) / 10) {
+      return false;
+    }
+    parsed_length = parsed_length * 10 + digit;
+  }
+  while (*current == ' ') {
+    ++current;
+  }
+  if (*current != '\0') {
+    return false;
+  }
+  *length = parsed_length;
+  return true;
+}
+
+bool Server::IsHeaderValue(const char* value, const char* expected_value) {
+  for (; *value != '\0' && *expected_value != '\0';
+       ++value, ++expected_value) {
+    if (tolower(static_cast<unsigned char>(*value)) !=
+        tolower(static_cast<unsigned char>(*expected_value))) {
+      return false;
+    }
+  }
+  return *value == '\0' && *expected_value == '\0';
+}
+
+// Looks up and executes the command for a request. Returns true if the
+// response is ready to send, or false if it has been sent already, or if
+// a session is executing the command without holding up this thread, and
+// sends the response itself when done. Sets command_index to the
+// command's histogram, or to -1 if the command's duration is recorded
+// when it completes instead. The error responses for unknown commands and
+// sessions are pre-rendered rather than built as a Response and then
+// serialized, as clients that probe the server send many of them.
+bool Server::DispatchCommand(struct mg_connection* conn,
+                             const struct mg_request_info* request_info,
+                             const std::string& http_verb,
+                             const std::string& command_body,
+                             const long long request_start_time,
+                             int* command_index,
+                             Response* response) {
   LOG(TRACE) << "Entering Server::DispatchCommand";
 
+  long long lookup_start_time = ServerMetrics::Now();
+  std::string uri = request_info->uri;
   std::string session_id = "";
-  std::string locator_parameters = "";
-  std::string serialized_response = "";
-  std::string command = this->LookupCommand(uri,
-                                            http_verb,
-                                            &session_id,
-                                            &locator_parameters);
+  LocatorMap locator_parameters;
+  std::string allowed_verbs = "";
+  CommandType::Id command_type = this->LookupCommand(uri,
+                                                     http_verb,
+                                                     &session_id,
+                                                     &locator_parameters,
+                                                     &allowed_verbs);
+  long long execute_start_time = ServerMetrics::Now();
+  this->metrics_.RecordStage(ServerMetrics::kLookupStage,
+                             execute_start_time - lookup_start_time);
   LOG(DEBUG) << "Command: " << http_verb << " " << uri << " " << command_body;
 
-  if (command == webdriver::CommandType::NoCommand) {
-    if (locator_parameters.size() != 0) {
-      // Hand-code the response for an invalid HTTP verb for URL
-      serialized_response.append("{ \"status\" : 405, ");
-      serialized_response.append("\"sessionId\" : \"<no session>\", ");
-      serialized_response.append("\"value\" : \"");
-      serialized_response.append(locator_parameters);
-      serialized_response.append("\" }");
+  if (command_type == webdriver::CommandType::NoCommand) {
+    if (allowed_verbs.size() != 0) {
+      // Response for an invalid HTTP verb for URL
+      this->SendHttpResponse(conn, request_info, 405, allowed_verbs, "");
     } else {
-      // Hand-code the response for an unknown URL
-      serialized_response.append("{ \"status\" : 404, ");
-      serialized_response.append("\"sessionId\" : \"<no session>\", ");
-      serialized_response.append("\"value\" : \"Command not found: ");
-      serialized_response.append(http_verb);
-      serialized_response.append(" ");
-      serialized_response.append(uri);
-      serialized_response.append("\" }");
-    }
-  } else if (command == webdriver::CommandType::Status) {
+      // Response for an unknown URL
+      std::string message = "Command not found: " + http_verb + " " + uri;
+      std::string body(NO_SESSION_RESPONSE_PREFIX);
+      body.append(Json::valueToQuotedString(message.c_str()));
+      body.append("}\n");
+      this->SendHttpResponse(conn, request_info, 404, "", body);
+    }
+    return false;
+  }
+
+  *command_index = command_type;
+  if (command_type == webdriver::CommandType::Status) {
     // Status command must be handled by the server, not by the session.
-    serialized_response = this->GetStatus();
-  } else if (command == webdriver::CommandType::GetSessionList) {
+    this->GetStatus(response);
+  } else if (command_type == webdriver::CommandType::GetSessionList) {
     // GetSessionList command must be handled by the server,
     // not by the session.
-    serialized_response = this->ListSessions();
+    this->ListSessions(response);
   } else {
-    if (command == webdriver::CommandType::NewSession) {
+    bool is_new_session = command_type == webdriver::CommandType::NewSession;
+    if (is_new_session) {
       session_id = this->CreateSession();
     }
 
-    SessionHandle session_handle;
-    if (!this->LookupSession(session_id, &session_handle)) {
-      if (command == webdriver::CommandType::Quit) {
+    Command command;
+    command.Populate(command_type, locator_parameters, command_body);
+    if (this->ExecuteSessionCommandAsync(conn,
+                                         request_info,
+                                         session_id,
+                                         command,
+                                         *command_index,
+                                         request_start_time,
+                                         is_new_session)) {
+      *command_index = -1;
+      return false;
+    }
+    bool session_exists = this->ExecuteSessionCommand(session_id,
+                                                      command,
+                                                      response);
+    this->metrics_.RecordStage(ServerMetrics::kExecuteStage,
+                               ServerMetrics::Now() - execute_start_time);
+    if (session_exists && is_new_session && IsSessionCreated(*response)) {
+      this->CaptureSessionCapabilities(session_id);
+    }
+    if (!session_exists) {
+      // Session IDs in URLs only ever match hex digits and dashes, so they
+      // need no escaping.
+      std::string body(SESSION_RESPONSE_PREFIX);
+      body.append(session_id);
+      if (command_type == webdriver::CommandType::Quit) {
         // Calling quit on an invalid session should be a no-op.
-        // Hand-code the response for quit on an invalid (already
-        // quit) session.
-        serialized_response.append("{ \"status\" : 0, ");
-        serialized_response.append("\"sessionId\" : \"");
-        serialized_response.append(session_id);
-        serialized_response.append("\", ");
-        serialized_response.append("\"value\" : null }");
+        body.append(NULL_SUCCESS_RESPONSE_SUFFIX);
+        this->SendHttpResponse(conn, request_info, 0, "", body);
       } else {
-        // Hand-code the response for an invalid session id
-        serialized_response.append("{ \"status\" : 6, ");
-        serialized_response.append("\"sessionId\" : \"");
-        serialized_response.append(session_id);
-        serialized_response.append("\", ");
-        serialized_response.append("\"value\" : \"session ");
-        serialized_response.append(session_id);
-        serialized_response.append(" does not exist\" }");
-      }
-    } else {
-      // Compile the serialized JSON representation of the command by hand.
-      std::string serialized_command = "{ \"command\" : \"" + command + "\"";
-      serialized_command.append(", \"locator\" : ");
-      serialized_command.append(locator_parameters);
-      serialized_command.append(", \"parameters\" : ");
-      serialized_command.append(command_body);
-      serialized_command.append(" }");
-      bool session_is_valid = session_handle->ExecuteCommand(
-          serialized_command,
-          &serialized_response);
-      if (!session_is_valid) {
-        this->ShutDownSession(session_id);
+        // Response for an invalid session id
+        body.append(NO_SUCH_SESSION_RESPONSE_INFIX);
+        body.append(session_id);
+        body.append(NO_SUCH_SESSION_RESPONSE_SUFFIX);
+        this->SendHttpResponse(conn, request_info, 6, "", body);
       }
+      return false;
     }
+    return true;
   }
-  LOG(DEBUG) << "Response: " << serialized_response;
-  return serialized_response;
+  this->metrics_.RecordStage(ServerMetrics::kExecuteStage,
+                             ServerMetrics::Now() - execute_start_time);
+  return true;
 }
 
-std::string Server::ListSessions() {
+void Server::ListSessions(Response* response) {
   LOG(TRACE) << "Entering Server::ListSessions";
 
-  // Manually construct the serialized command for getting 
-  // session capabilities.
-  std::string get_caps_command = "{ \"command\" : \"" + webdriver::CommandType::GetSessionCapabilities + "\"" +
-                                 ", \"locator\" : {}, \"parameters\" : {} }";
+  std::vector<SessionHandle> session_handles;
+  this->sessions_.GetAll(&session_handles);
 
   Json::Value sessions(Json::arrayValue);
-  SessionMap::iterator it = this->sessions_.begin();
-  for (; it != this->sessions_.end(); ++it) {
+  std::vector<SessionHandle>::const_iterator it = session_handles.begin();
+  for (; it != session_handles.end(); ++it) {
     // Each element of the GetSessionList command is an object with two
-    // named properties, "id" and "capabilities". We already know the
-    // ID, so we execute the GetSessionCapabilities command on each session
-    // to be able to return the capabilities.
-    Json::Value session_descriptor;
-    session_descriptor["id"] = it->first;
+    // named properties, "id" and "capabilities". The capabilities are the
+    // ones captured when the session was created, so that listing the
+    // sessions does not wait for the commands they are executing. A
+    // session listed before they have been captured has none yet.
+    Json::Value& session_descriptor = sessions.append(
+        Json::Value(Json::objectValue));
+    session_descriptor["id"] = (*it)->session_id();
+    Json::Value& capabilities = session_descriptor["capabilities"];
+    if (!(*it)->GetCapabilities(&capabilities)) {
+      capabilities = Json::Value(Json::objectValue);
+    }
+  }
+  response->SetSuccessResponse(sessions);
+}
+
+// Executes the GetSessionCapabilities command on a newly created session,
+// without waiting for it, and keeps the result on the session. Called
+// before the response creating the session is sent, so that the command
+// executes ahead of any the client sends to the new session.
+void Server::CaptureSessionCapabilities(const std::string& session_id) {
+  LOG(TRACE) << "Entering Server::CaptureSessionCapabilities";
 
-    SessionHandle session = it->second;
-    std::string serialized_session_response;
-    session->ExecuteCommand(get_caps_command, &serialized_session_response);
+  SessionHandle session_handle;
+  if (!this->LookupSession(session_id, &session_handle)) {
+    return;
+  }
+  Command command;
+  command.Populate(webdriver::CommandType::GetSessionCapabilities,
+                   LocatorMap(),
+                   "{}");
+  CommandCompletionHandle completion(
+      new CapabilitiesCompletion(session_handle));
+  session_handle->ExecuteCommandAsync(command, completion);
+}
+
+// A session is created with a redirect to its URL, or, by some sessions,
+// with a successful response.
+bool Server::IsSessionCreated(const Response& response) {
+  return response.status_code() == 303 || response.status_code() == 0;
+}
+
+void Server::CapabilitiesCompletion::Complete(Response* response,
+                                              bool session_is_valid) {
+  LOG(TRACE) << "Entering Server::CapabilitiesCompletion::Complete";
 
-    Response session_response;
-    session_response.Deserialize(serialized_session_response);
-    session_descriptor["capabilities"] = session_response.value();
-    sessions.append(session_descriptor);
+  if (session_is_valid && response->status_code() == 0) {
+    this->session_handle_->set_capabilities(response->value());
+  } else {
+    LOG(WARN) << "Unable to capture the capabilities of session "
+              << this->session_handle_->session_id();
   }
-  Response response;
-  response.SetSuccessResponse(sessions);
-  return response.Serialize();
 }
 
 bool Server::LookupSession(const std::string& session_id,
                            SessionHandle* session_handle) {
   LOG(TRACE) << "Entering Server::LookupSession";
 
-  SessionMap::iterator it = this->sessions_.find(session_id);
-  if (it == this->sessions_.end()) {
+  return this->sessions_.Find(session_id, session_handle);
+}
+
+bool Server::ExecuteSessionCommand(const std::string& session_id,
+                                   const Command& command,
+                                   Response* response) {
+  LOG(TRACE) << "Entering Server::ExecuteSessionCommand";
+
+  SessionHandle session_handle;
+  if (!this->LookupSession(session_id, &session_handle)) {
     return false;
   }
-  *session_handle = it->second;
+
+  bool session_is_valid = true;
+  {
+    // Commands on different sessions run in parallel, but commands on
+    // the same session run one at a time.
+    ScopedLock command_lock(session_handle->command_mutex());
+
+    // The session may have been shut down while this command was waiting
+    // for the one ahead of it to complete.
+    SessionHandle current_session_handle;
+    if (!this->LookupSession(session_id, &current_session_handle) ||
+        current_session_handle != session_handle) {
+      return false;
+    }
+    session_is_valid = session_handle->ExecuteCommand(command, response);
+  }
+
+  if (!session_is_valid) {
+    this->ShutDownSession(session_id);
+  }
   return true;
 }
 
-int Server::SendResponseToClient(struct mg_connection* conn,
-                                 const struct mg_request_info* request_info,
-                                 const std::string& serialized_response) {
-  LOG(TRACE) << "Entering Server::SendResponseToClient";
+// Suspends the connection and hands the command to its session, so that
+// this worker thread can serve other connections while a slow command,
+// such as a page load, executes. Returns false if the command must be
+// executed synchronously instead.
+bool Server::ExecuteSessionCommandAsync(
+    struct mg_connection* conn,
+    const struct mg_request_info* request_info,
+    const std::string& session_id,
+    const Command& command,
+    const int command_index,
+    const long long request_start_time,
+    const bool is_new_session) {
+  LOG(TRACE) << "Entering Server::ExecuteSessionCommandAsync";
+
+  SessionHandle session_handle;
+  if (!this->LookupSession(session_id, &session_handle) ||
+      !mg_suspend(conn)) {
+    return false;
+  }
 
-  int return_code = 0;
-  if (serialized_response.size() > 0) {
-    Response response;
-    response.Deserialize(serialized_response);
-    return_code = response.status_code();
-    if (return_code == 0) {
-      this->SendHttpOk(conn,
-                       request_info,
-                       serialized_response,
-                       JSON_CONTENT_TYPE);
-      return_code = 200;
-    } else if (return_code == 200) {
-      this->SendHttpOk(conn,
-                       request_info,
-                       serialized_response,
-                       HTML_CONTENT_TYPE);
-    } else if (return_code == 303) {
-      std::string location = response.value().asString();
-      response.SetSuccessResponse(response.value());
-      this->SendHttpSeeOther(conn, request_info, location);
-      return_code = 303;
-    } else if (return_code == 400) {
-      this->SendHttpBadRequest(conn, request_info, serialized_response);
-      return_code = 400;
-    } else if (return_code == 404) {
-      this->SendHttpNotFound(conn, request_info, serialized_response);
-      return_code = 404;
-    } else if (return_code == 405) {
-      std::string parameters = response.value().asString();
-      this->SendHttpMethodNotAllowed(conn, request_info, parameters);
-      return_code = 405;
-    } else if (return_code == 501) {
-      this->SendHttpNotImplemented(conn,
-                                   request_info,
-                                   "");
-      return_code = 501;
-    } else {
-      this->SendHttpInternalError(conn, request_info, serialized_response);
-      return_code = 500;
-    }
+  PendingCommandHandle pending_command(new PendingCommand(this,
+                                                          conn,
+                                                          request_info,
+                                                          session_id,
+                                                          command_index,
+                                                          request_start_time,
+                                                          is_new_session));
+  if (!this->AddPendingCommand(pending_command)) {
+    // The server is stopping; nobody will get a response.
+    pending_command->Cancel();
+    return true;
   }
-  return return_code;
+  session_handle->ExecuteCommandAsync(command, pending_command);
+  return true;
 }
 
-// The standard HTTP Status codes are implemented below.  Chrome uses
-// OK, See Other, Not Found, Method Not Allowed, and Internal Error.
-// Internal Error, HTTP 500, is used as a catch all for any issue
-// not covered in the JSON protocol.
-void Server::SendHttpOk(struct mg_connection* connection,
-                        const struct mg_request_info* request_info,
-                        const std::string& body,
-                        const std::string& content_type) {
-  LOG(TRACE) << "Entering Server::SendHttpOk";
+bool Server::AddPendingCommand(const PendingCommandHandle& pending_command) {
+  ScopedLock lock(&this->pending_commands_lock_);
+  if (this->is_stopping_) {
+    return false;
+  }
+  this->pending_commands_.push_back(pending_command);
+  return true;
+}
 
-  std::ostringstream out;
-  out << "HTTP/1.1 200 OK\r\n"
-    << "Content-Length: " << strlen(body.c_str()) << "\r\n"
-    << "Content-Type: " << content_type << "; charset=UTF-8\r\n"
-    << "Vary: Accept-Charset, Accept-Encoding, Accept-Language, Accept\r\n"
-    << "Accept-Ranges: bytes\r\n"
-    << "Connection: close\r\n\r\n";
-  if (strcmp(request_info->request_method, "HEAD") != 0) {
-    out << body << "\r\n";
+void Server::RemovePendingCommand(const PendingCommand* pending_command) {
+  ScopedLock lock(&this->pending_commands_lock_);
+  std::vector<PendingCommandHandle>::iterator it =
+      this->pending_commands_.begin();
+  for (; it != this->pending_commands_.end(); ++it) {
+    if (it->get() == pending_command) {
+      this->pending_commands_.erase(it);
+      if (this->is_stopping_ && this->pending_commands_.empty()) {
+        this->pending_commands_event_.Set();
+      }
+      return;
+    }
   }
+}
 
-  mg_write(connection, out.str().c_str(), out.str().size());
+void Server::GetPendingCommands(
+    std::vector<PendingCommandHandle>* pending_commands) {
+  ScopedLock lock(&this->pending_commands_lock_);
+  *pending_commands = this->pending_commands_;
 }
 
-void Server::SendHttpBadRequest(struct mg_connection* const connection,
-                                const struct mg_request_info* request_info,
-                                const std::string& body) {
-  LOG(TRACE) << "Entering Server::SendHttpBadRequest";
+void Server::MaintenanceThreadProc(void* server) {
+  reinterpret_cast<Server*>(server)->PerformMaintenance();
+}
 
-  std::ostringstream out;
-  out << "HTTP/1.1 400 Bad Request\r\n"
-    << "Content-Length: " << strlen(body.c_str()) << "\r\n"
-    << "Content-Type: application/json; charset=UTF-8\r\n"
-    << "Vary: Accept-Charset, Accept-Encoding, Accept-Language, Accept\r\n"
-    << "Accept-Ranges: bytes\r\n"
-    << "Connection: close\r\n\r\n";
-  if (strcmp(request_info->request_method, "HEAD") != 0) {
-    out << body << "\r\n";
-  }
+void Server::PerformMaintenance() {
+  LOG(TRACE) << "Entering Server::PerformMaintenance";
+
+  while (true) {
+    {
+      ScopedLock lock(&this->pending_commands_lock_);
+      if (this->is_stopping_) {
+        break;
+      }
+    }
 
-  mg_printf(connection, "%s", out.str().c_str());
+    std::vector<PendingCommandHandle> pending_commands;
+    this->GetPendingCommands(&pending_commands);
+    std::vector<PendingCommandHandle>::const_iterator it =
+        pending_commands.begin();
+    for (; it != pending_commands.end(); ++it) {
+      (*it)->CancelIfClientDisconnected();
+    }
+
+    this->ShutDownScheduledSessions();
+    this->maintenance_event_.Wait(MAINTENANCE_INTERVAL_IN_MILLISECONDS);
+  }
 }
 
-void Server::SendHttpInternalError(struct mg_connection* connection,
-                                   const struct mg_request_info* request_info,
-                                   const std::string& body) {
-  LOG(TRACE) << "Entering Server::SendHttpInternalError";
+Server::PendingCommand::PendingCommand(
+    Server* server,
+    struct mg_connection* conn,
+    const struct mg_request_info* request_info,
+    const std::string& session_id,
+    const int command_index,
+    const long long request_start_time,
+    const bool is_new_session)
+    : server_(server),
+      conn_(conn),
+      request_info_(request_info),
+      session_id_(session_id),
+      command_index_(command_index),
+      request_start_time_(request_start_time),
+      execute_start_time_(ServerMetrics::Now()),
+      is_new_session_(is_new_session),
+      is_complete_(false),
+      is_cancelled_(false) {
+}
 
-  std::ostringstream out;
-  out << "HTTP/1.1 500 Internal Server Error\r\n"
-    << "Content-Length: " << strlen(body.c_str()) << "\r\n"
-    << "Content-Type: application/json; charset=UTF-8\r\n"
-    << "Vary: Accept-Charset, Accept-Encoding, Accept-Language, Accept\r\n"
-    << "Accept-Ranges: bytes\r\n"
-    << "Connection: close\r\n\r\n";
-  if (strcmp(request_info->request_method, "HEAD") != 0) {
-    out << body << "\r\n";
+void Server::PendingCommand::Complete(Response* response,
+                                      bool session_is_valid) {
+  LOG(TRACE) << "Entering Server::PendingCommand::Complete";
+
+  Json::ValueArena value_arena;
+  {
+    // Once complete, the command can no longer be cancelled, and the
+    // connection is this thread's alone. The response is sent without
+    // holding the lock, so that a slow client does not hold up the
+    // maintenance thread checking the other commands.
+    ScopedLock lock(&this->lock_);
+    if (this->is_complete_ || this->is_cancelled_) {
+      return;
+    }
+    this->is_complete_ = true;
+  }
+  this->server_->metrics_.RecordStage(
+      ServerMetrics::kExecuteStage,
+      ServerMetrics::Now() - this->execute_start_time_);
+
+  // Remove an ended session before the client can send another command
+  // to it.
+  if (!session_is_valid) {
+    this->server_->ScheduleSessionShutDown(this->session_id_);
+  } else if (this->is_new_session_ && IsSessionCreated(*response)) {
+    this->server_->CaptureSessionCapabilities(this->session_id_);
   }
+  this->server_->SendResponseToClient(this->conn_,
+                                      this->request_info_,
+                                      response);
+  this->server_->metrics_.RecordCommand(
+      this->command_index_,
+      ServerMetrics::Now() - this->request_start_time_);
+  mg_resume(this->conn_);
+  this->server_->RemovePendingCommand(this);
+}
 
-  mg_write(connection, out.str().c_str(), out.str().size());
+bool Server::PendingCommand::is_cancelled() {
+  ScopedLock lock(&this->lock_);
+  return this->is_cancelled_;
 }
 
-void Server::SendHttpNotFound(struct mg_connection* const connection,
-                              const struct mg_request_info* request_info,
-                              const std::string& body) {
-  LOG(TRACE) << "Entering Server::SendHttpNotFound";
+void Server::PendingCommand::Cancel() {
+  ScopedLock lock(&this->lock_);
+  this->CancelLocked();
+}
 
-  std::ostringstream out;
-  out << "HTTP/1.1 404 Not Found\r\n"
-    << "Content-Length: " << strlen(body.c_str()) << "\r\n"
-    << "Content-Type: application/json; charset=UTF-8\r\n"
-    << "Vary: Accept-Charset, Accept-Encoding, Accept-Language, Accept\r\n"
-    << "Accept-Ranges: bytes\r\n"
-    << "Connection: close\r\n\r\n";
-  if (strcmp(request_info->request_method, "HEAD") != 0) {
-    out << body << "\r\n";
+void Server::PendingCommand::CancelIfClientDisconnected() {
+  ScopedLock lock(&this->lock_);
+  if (!this->is_complete_ && !this->is_cancelled_ &&
+      mg_client_disconnected(this->conn_)) {
+    LOG(DEBUG) << "Client disconnected, cancelling command for session "
+               << this->session_id_;
+    this->CancelLocked();
   }
-
-  mg_printf(connection, "%s", out.str().c_str());
 }
 
-void Server::SendHttpMethodNotAllowed(
-    struct mg_connection* connection,
-    const struct mg_request_info* request_info,
-    const std::string& allowed_methods) {
-  LOG(TRACE) << "Entering Server::SendHttpMethodNotAllowed";
+void Server::PendingCommand::CancelLocked() {
+  if (this->is_complete_ || this->is_cancelled_) {
+    return;
+  }
+  this->is_cancelled_ = true;
+  mg_set_must_close(this->conn_);
+  mg_resume(this->conn_);
+  this->server_->RemovePendingCommand(this);
+}
 
-  std::ostringstream out;
-  out << "HTTP/1.1 405 Method Not Allowed\r\n"
-    << "Content-Type: text/html\r\n"
-    << "Content-Length: 0\r\n"
-    << "Allow: " << allowed_methods << "\r\n\r\n";
+int Server::SendResponseToClient(struct mg_connection* conn,
+                                 const struct mg_request_info* request_info,
+                                 Response* response) {
+  LOG(TRACE) << "Entering Server::SendResponseToClient";
 
-  mg_write(connection, out.str().c_str(), out.str().size());
+  // Only serialize the response if it is going to be sent, and only take
+  // the value as a string for the statuses that send it in a header.
+  long long serialize_start_time = ServerMetrics::Now();
+  const HttpStatus& http_status = GetHttpStatus(response->status_code());
+  std::string serialized_response = "";
+  if (http_status.has_body) {
+    response->Serialize(&serialized_response);
+    LOG(DEBUG) << "Response: " << serialized_response;
+  }
+  std::string header_value = "";
+  if (http_status.value_header != NULL) {
+    header_value = response->value().asString();
+  }
+  this->metrics_.RecordStage(ServerMetrics::kSerializeStage,
+                             ServerMetrics::Now() - serialize_start_time);
+  return this->SendHttpResponse(conn,
+                                request_info,
+                                http_status,
+                                header_value,
+                                serialized_response);
 }
 
-void Server::SendHttpNotImplemented(struct mg_connection* connection,
-                                    const struct mg_request_info* request_info,
-                                    const std::string& body) {
-  LOG(TRACE) << "Entering Server::SendHttpNotImplemented";
+// Sends the latency histograms and counters, with the state of the
+// sessions and the connection queue, in the Prometheus text format.
+int Server::SendMetrics(struct mg_connection* conn,
+                        const struct mg_request_info* request_info) {
+  LOG(TRACE) << "Entering Server::SendMetrics";
+
+  std::string body;
+  this->metrics_.Serialize(&body);
+  size_t pending_command_count = 0;
+  {
+    ScopedLock lock(&this->pending_commands_lock_);
+    pending_command_count = this->pending_commands_.size();
+  }
+  ServerMetrics::AppendGauge("webdriver_pending_commands",
+                             "Commands executing with their connections suspended.",
+                             pending_command_count,
+                             &body);
+  ServerMetrics::AppendGauge("webdriver_sessions",
+                             "Active sessions.",
+                             this->session_count(),
+                             &body);
+  struct mg_queue_stats stats;
+  if (this->GetQueueStats(&stats)) {
+    ServerMetrics::AppendGauge("webdriver_connection_queue_length",
+                               "Connections waiting for a worker thread.",
+                               stats.queue_length,
+                               &body);
+    ServerMetrics::AppendCounter("webdriver_connections_dequeued_total",
+                                 "Connections taken from the queue by worker threads.",
+                                 stats.num_dequeued,
+                                 &body);
+    ServerMetrics::AppendCounter("webdriver_connections_rejected_total",
+                                 "Connections refused because the queue was full.",
+                                 stats.num_rejected,
+                                 &body);
+    ServerMetrics::AppendCounter("webdriver_connection_queue_wait_milliseconds_total",
+                                 "Time connections spent waiting in the queue.",
+                                 stats.total_wait_ms,
+                                 &body);
+  }
+  return this->SendHttpResponse(conn,
+                                request_info,
+                                metrics_http_status_,
+                                "",
+                                body);
+}
 
-  std::ostringstream out;
-  out << "HTTP/1.1 501 Not Implemented\r\n\r\n";
+const Server::HttpStatus& Server::GetHttpStatus(
+    const int response_status_code) {
+  const HttpStatus* http_status = http_statuses_;
+  while (http_status->response_status_code != response_status_code &&
+         http_status->response_status_code != -1) {
+    ++http_status;
+  }
+  return *http_status;
+}
 
-  mg_write(connection, out.str().c_str(), out.str().size());
+// Sends a response with the status that corresponds to the Response
+// status code. header_value is the value of the status's value header,
+// if it has one. Returns the HTTP status code sent.
+int Server::SendHttpResponse(struct mg_connection* connection,
+                             const struct mg_request_info* request_info,
+                             const int response_status_code,
+                             const std::string& header_value,
+                             const std::string& body) {
+  return this->SendHttpResponse(connection,
+                                request_info,
+                                GetHttpStatus(response_status_code),
+                                header_value,
+                                body);
 }
 
-void Server::SendHttpSeeOther(struct mg_connection* connection,
-                              const struct mg_request_info* request_info,
-                              const std::string& location) {
-  LOG(TRACE) << "Entering Server::SendHttpSeeOther";
+int Server::SendHttpResponse(struct mg_connection* connection,
+                             const struct mg_request_info* request_info,
+                             const HttpStatus& http_status,
+                             const std::string& header_value,
+                             const std::string& body) {
+  LOG(TRACE) << "Entering Server::SendHttpResponse";
+
+  long long write_start_time = ServerMetrics::Now();
+  size_t content_length = http_status.has_body ? body.size() : 0;
+
+  // Content-Length digits, most significant first.
+  char length_buffer[24];
+  char* length_digits = length_buffer + sizeof(length_buffer);
+  do {
+    *--length_digits = static_cast<char>('0' + content_length % 10);
+    content_length /= 10;
+  } while (content_length > 0);
+
+  std::string headers(http_status.headers);
+  headers.append("Content-Length: ");
+  headers.append(length_digits, length_buffer + sizeof(length_buffer));
+  headers.append("\r\n");
+  if (http_status.value_header != NULL) {
+    headers.append(http_status.value_header);
+    headers.append(": ");
+    headers.append(header_value);
+    headers.append("\r\n");
+  }
+  headers.append("Connection: ");
+  headers.append(GetConnectionHeader(connection));
+  headers.append("\r\n\r\n");
+
+  this->WriteHttpResponse(connection,
+                          request_info,
+                          headers,
+                          http_status.has_body ? body : "");
+  this->metrics_.RecordStage(ServerMetrics::kWriteStage,
+                             ServerMetrics::Now() - write_start_time);
+  this->metrics_.AddResponseBytes(headers.size() +
+                                  (http_status.has_body ? body.size() : 0));
+  return http_status.http_status_code;
+}
 
-  std::ostringstream out;
-  out << "HTTP/1.1 303 See Other\r\n"
-    << "Location: " << location << "\r\n"
-    << "Content-Type: text/html\r\n"
-    << "Content-Length: 0\r\n\r\n";
+// Writes the header block and the body of a response to the client. The
+// two are sent with a single gather write, so the body, which may be a
+// multi-megabyte screenshot, is never copied into another buffer.
+void Server::WriteHttpResponse(mg_connection* connection,
+                               const mg_request_info* request_info,
+                               const std::string& headers,
+                               const std::string& body) {
+  struct mg_buffer buffers[2];
+  int buffer_count = 1;
+  buffers[0].data = headers.data();
+  buffers[0].len = headers.size();
+  if (body.size() > 0 && strcmp(request_info->request_method, "HEAD") != 0) {
+    buffers[1].data = body.data();
+    buffers[1].len = body.size();
+    ++buffer_count;
+  }
+  mg_write_buffers(connection, buffers, buffer_count);
+}
 
-  mg_write(connection, out.str().c_str(), out.str().size());
+const char* Server::GetConnectionHeader(mg_connection* connection) {
+  if (mg_should_keep_alive(connection)) {
+    return "keep-alive";
+  }
+  return "close";
 }
 
-std::string Server::LookupCommand(const std::string& uri,
-                                  const std::string& http_verb,
-                                  std::string* session_id,
-                                  std::string* locator) {
+CommandType::Id Server::LookupCommand(const std::string& uri,
+                                      const std::string& http_verb,
+                                      std::string* session_id,
+                                      LocatorMap* locator_parameters,
+                                      std::string* allowed_verbs) {
   LOG(TRACE) << "Entering Server::LookupCommand";
 
-  std::string value = webdriver::CommandType::NoCommand;
-  UrlMap::const_iterator it = this->commands_.begin();
-  for (; it != this->commands_.end(); ++it) {
-    std::string url_candidate = it->first;
-    std::vector<std::string> locator_param_names;
-    std::vector<std::string> locator_param_values;
-    if (this->IsCommandMatch(uri, url_candidate, &locator_param_names, &locator_param_values)) {
-      VerbMap::const_iterator verb_iterator = it->second.find(http_verb);
-      if (verb_iterator != it->second.end()) {
-        value = verb_iterator->second;
-        std::string param = this->ConstructLocatorParameterJson(locator_param_names,
-                                                                locator_param_values,
-                                                                session_id);
-        locator->append(param);
-        break;
-      } else {
-        verb_iterator = it->second.begin();
-        for (; verb_iterator != it->second.end(); ++verb_iterator) {
-          if (locator->size() != 0) {
-            locator->append(",");
-          }
-          locator->append(verb_iterator->first);
-        }
+  CommandType::Id value = webdriver::CommandType::NoCommand;
+  std::vector<std::string> uri_segments;
+  if (!SplitUrl(uri, &uri_segments)) {
+    return value;
+  }
+
+  std::vector<std::string> locator_param_names;
+  std::vector<std::string> locator_param_values;
+  if (this->MatchUrlNode(this->commands_,
+                         uri_segments,
+                         0,
+                         http_verb,
+                         &locator_param_names,
+                         &locator_param_values,
+                         &value,
+                         allowed_verbs)) {
+    // A command matched, so no allowed verbs are reported. Any collected
+    // while trying other branches of the tree are discarded.
+    allowed_verbs->clear();
+    size_t param_count = locator_param_names.size();
+    for (size_t i = 0; i < param_count; ++i) {
+      (*locator_parameters)[locator_param_names[i]] = locator_param_values[i];
+      if (locator_param_names[i] == "sessionid") {
+        session_id->append(locator_param_values[i]);
       }
     }
   }
+  // If the URL matched a command, but not for this HTTP verb, the
+  // allowed verbs carry the list of verbs that are allowed for the URL.
   return value;
 }
 
-std::string Server::ConstructLocatorParameterJson(std::vector<std::string> locator_param_names,
-                                                  std::vector<std::string> locator_param_values,
-                                                  std::string* session_id) {
-  std::string param = "{";
-  size_t param_count = locator_param_names.size();
-  for (unsigned int i = 0; i < param_count; i++) {
-    if (i != 0) {
-      param.append(",");
+bool Server::MatchUrlNode(const UrlNode& node,
+                          const std::vector<std::string>& uri_segments,
+                          const size_t segment_index,
+                          const std::string& http_verb,
+                          std::vector<std::string>* locator_param_names,
+                          std::vector<std::string>* locator_param_values,
+                          CommandType::Id* command,
+                          std::string* allowed_verbs) {
+  if (segment_index == uri_segments.size()) {
+    VerbMap::const_iterator verb_iterator = node.verbs.find(http_verb);
+    if (verb_iterator != node.verbs.end()) {
+      *command = verb_iterator->second;
+      return true;
     }
-
-    param.append(" \"");
-    param.append(locator_param_names[i]);
-    param.append("\" : \"");
-    param.append(locator_param_values[i]);
-    param.append("\"");
-    if (locator_param_names[i] == "sessionid") {
-      session_id->append(locator_param_values[i]);
+    verb_iterator = node.verbs.begin();
+    for (; verb_iterator != node.verbs.end(); ++verb_iterator) {
+      if (allowed_verbs->size() != 0) {
+        allowed_verbs->append(",");
+      }
+      allowed_verbs->append(verb_iterator->first);
     }
+    return false;
   }
 
-  param.append(" }");
-  return param;
-}
+  const std::string& segment = uri_segments[segment_index];
+  UrlNodeMap::const_iterator it = node.literal_children.find(segment);
+  if (it != node.literal_children.end() &&
+      this->MatchUrlNode(*it->second,
+                         uri_segments,
+                         segment_index + 1,
+                         http_verb,
+                         locator_param_names,
+                         locator_param_values,
+                         command,
+                         allowed_verbs)) {
+    return true;
+  }
 
-bool Server::IsCommandMatch(const std::string& uri,
-                            const std::string& url_template,
-                            std::vector<std::string>* locator_param_names,
-                            std::vector<std::string>* locator_param_values) {
-  std::string url_match_regex = url_template;
-  size_t param_start_pos = url_match_regex.find_first_of(":");
-  while (param_start_pos != std::string::npos) {
-    size_t param_len = std::string::npos;
-    size_t param_end_pos = url_match_regex.find_first_of("/", param_start_pos);
-    if (param_end_pos != std::string::npos) {
-      param_len = param_end_pos - param_start_pos;
+  if (segment.size() == 0) {
+    // Parameter values may never be empty.
+    return false;
+  }
+  it = node.parameter_children.begin();
+  for (; it != node.parameter_children.end(); ++it) {
+    if (it->second->is_hex_parameter &&
+        segment.find_first_not_of("0123456789abcdefABCDEF-") != std::string::npos) {
+      continue;
     }
-
-    // Skip the colon
-    std::string param_name = url_match_regex.substr(param_start_pos + 1,
-                                                    param_len - 1);
-    locator_param_names->push_back(param_name);
-    if (param_name == "sessionid" || param_name == "id") {
-      url_match_regex.replace(param_start_pos, param_len, "([0-9a-fA-F-]+)");
-    } else {
-      url_match_regex.replace(param_start_pos, param_len, "([^/]+)");
+    locator_param_names->push_back(it->first);
+    locator_param_values->push_back(segment);
+    if (this->MatchUrlNode(*it->second,
+                           uri_segments,
+                           segment_index + 1,
+                           http_verb,
+                           locator_param_names,
+                           locator_param_values,
+                           command,
+                           allowed_verbs)) {
+      return true;
     }
-    param_start_pos = url_match_regex.find_first_of(":");
+    locator_param_names->pop_back();
+    locator_param_values->pop_back();
   }
+  return false;
+}
 
-  std::tr1::regex matcher("^" + url_match_regex + "$");
-  std::tr1::match_results<std::string::const_iterator> matches;
-  if (std::tr1::regex_search(uri, matches, matcher)) {
-    size_t param_count = locator_param_names->size();
-    for (unsigned int i = 0; i < param_count; i++) {
-      std::string locator_param_value = matches[i + 1].str();
-      locator_param_values->push_back(locator_param_value);
-    }
-    return true;
+bool Server::SplitUrl(const std::string& url,
+                      std::vector<std::string>* segments) {
+  if (url.size() == 0 || url[0] != '/') {
+    return false;
   }
-  return false;
+  size_t segment_start_pos = 1;
+  size_t segment_end_pos = url.find('/', segment_start_pos);
+  while (segment_end_pos != std::string::npos) {
+    segments->push_back(url.substr(segment_start_pos,
+                                   segment_end_pos - segment_start_pos));
+    segment_start_pos = segment_end_pos + 1;
+    segment_end_pos = url.find('/', segment_start_pos);
+  }
+  segments->push_back(url.substr(segment_start_pos));
+  return true;
 }
 
 void Server::PopulateCommandRepository() {
@@ -21,10 +21,14 @@
 #include <map>
 #include <sstream>
 #include <string>
+#include "command.h"
 #include "command_types.h"
 #include "mongoose.h"
 #include "response.h"
 #include "session.h"
+#include "server_metrics.h"
+#include "session_map.h"
+#include "thread.h"
 
 namespace webdriver {
 
@@ -33,6 +37,12 @@ class Server {
   explicit Server(const int port);
   Server(const int port, const std::string& host);
   Server(const int port, const std::string& host, const std::string& log_level, const std::string& log_file);
+  Server(const int port,
+         const std::string& host,
+         const std::string& log_level,
+         const std::string& log_file,
+         const int thread_count,
+         const int queue_size);
   virtual ~Server(void);
 
   static void* OnHttpEvent(enum mg_event event_raised,
@@ -43,89 +53,260 @@ class Server {
   int ProcessRequest(struct mg_connection* conn,
                      const struct mg_request_info* request_info);
 
+  bool GetQueueStats(struct mg_queue_stats* stats);
+
   int port(void) const { return this->port_; }
+  int thread_count(void) const { return this->thread_count_; }
+  int queue_size(void) const { return this->queue_size_; }
 
-  int session_count(void) const {
-    return static_cast<int>(this->sessions_.size());
+  int session_count(void) {
+    return this->sessions_.size();
+  }
+
+  size_t max_request_body_size(void) const {
+    return this->max_request_body_size_;
+  }
+  void set_max_request_body_size(const size_t max_request_body_size) {
+    this->max_request_body_size_ = max_request_body_size;
   }
 
  protected:
   virtual SessionHandle InitializeSession(void) = 0;
-  virtual std::string GetStatus(void) = 0;
+  virtual void GetStatus(Response* response) = 0;
   virtual void ShutDown(void) = 0;
   void AddCommand(const std::string& url,
                   const std::string& http_verb,
-                  const std::string& command_name);
+                  const CommandType::Id command_type);
 
  private:
-  typedef std::map<std::string, SessionHandle> SessionMap;
-  typedef std::map<std::string, std::string> VerbMap;
-  typedef std::map<std::string, VerbMap> UrlMap;
+  typedef std::map<std::string, CommandType::Id> VerbMap;
+
+  // A node in the tree of registered URL templates. Each level of the
+  // tree corresponds to one path segment of the URL. Literal segments
+  // are looked up by their text; parameter segments (":name") are kept
+  // separately, and are tried only after the literal segments.
+  struct UrlNode;
+  typedef std::tr1::shared_ptr<UrlNode> UrlNodeHandle;
+  typedef std::map<std::string, UrlNodeHandle> UrlNodeMap;
+  struct UrlNode {
+    UrlNode(void) : is_hex_parameter(false) {}
+    // Child nodes for literal path segments, keyed by segment text.
+    UrlNodeMap literal_children;
+    // Child nodes for parameter path segments, keyed by parameter name.
+    UrlNodeMap parameter_children;
+    // True if this node is a parameter whose value must be a hex ID.
+    bool is_hex_parameter;
+    // The commands for URLs ending at this node, keyed by HTTP verb.
+    VerbMap verbs;
+  };
+
+  // How responses with a given Response status code are sent over HTTP.
+  struct HttpStatus {
+    // The Response status code, or -1 for the entry used for any status
+    // code not otherwise listed.
+    int response_status_code;
+    // The HTTP status code sent.
+    int http_status_code;
+    // The status line and the headers that are the same for every
+    // response with this status.
+    const char* headers;
+    // The name of a header whose value is the response value, or NULL.
+    const char* value_header;
+    // True if the serialized response is sent as the body.
+    bool has_body;
+  };
+
+  // A session command whose connection has been suspended while the
+  // session executes it. Sends the response and resumes the connection
+  // when the command completes. If the client disconnects first, or the
+  // server stops, the command is cancelled and the connection closed.
+  // Stop waits for a command that is already completing to finish
+  // sending its response.
+  class PendingCommand : public CommandCompletion {
+   public:
+    PendingCommand(Server* server,
+                   struct mg_connection* conn,
+                   const struct mg_request_info* request_info,
+                   const std::string& session_id,
+                   const int command_index,
+                   const long long request_start_time,
+                   const bool is_new_session);
+    virtual ~PendingCommand(void) {}
+
+    void Complete(Response* response, bool session_is_valid);
+    bool is_cancelled(void);
+
+    void Cancel(void);
+    void CancelIfClientDisconnected(void);
+
+   private:
+    void CancelLocked(void);
+
+    // Guards the completion and cancellation flags. The connection is
+    // given up by whichever of Complete and Cancel sets its flag first.
+    Mutex lock_;
+    Server* server_;
+    struct mg_connection* conn_;
+    const struct mg_request_info* request_info_;
+    std::string session_id_;
+    // The command's histogram, and the times at which its request was
+    // read and its execution started.
+    int command_index_;
+    long long request_start_time_;
+    long long execute_start_time_;
+    // True if the command creates the session, whose capabilities are
+    // captured when it completes.
+    bool is_new_session_;
+    bool is_complete_;
+    bool is_cancelled_;
+
+    DISALLOW_COPY_AND_ASSIGN(PendingCommand);
+  };
+  typedef std::tr1::shared_ptr<PendingCommand> PendingCommandHandle;
+
+  // Receives the result of the GetSessionCapabilities command executed
+  // when a session is created, and keeps it on the session.
+  class CapabilitiesCompletion : public CommandCompletion {
+   public:
+    explicit CapabilitiesCompletion(const SessionHandle& session_handle)
+        : session_handle_(session_handle) {}
+    virtual ~CapabilitiesCompletion(void) {}
+
+    void Complete(Response* response, bool session_is_valid);
+    bool is_cancelled(void) { return false; }
+
+   private:
+    SessionHandle session_handle_;
+
+    DISALLOW_COPY_AND_ASSIGN(CapabilitiesCompletion);
+  };
 
   void Initialize(const int port,
                   const std::string& host,
                   const std::string& log_level,
-                  const std::string& log_file);
-
-  std::string ListSessions(void);
-  std::string LookupCommand(const std::string& uri,
-                            const std::string& http_verb,
-                            std::string* session_id,
-                            std::string* locator);
-  std::string DispatchCommand(const std::string& url,
-                              const std::string& http_verb,
-                              const std::string& command_body);
+                  const std::string& log_file,
+                  const int thread_count,
+                  const int queue_size);
+
+  void ListSessions(Response* response);
+  CommandType::Id LookupCommand(const std::string& uri,
+                                const std::string& http_verb,
+                                std::string* session_id,
+                                LocatorMap* locator_parameters,
+                                std::string* allowed_verbs);
+  bool DispatchCommand(struct mg_connection* conn,
+                       const struct mg_request_info* request_info,
+                       const std::string& http_verb,
+                       const std::string& command_body,
+                       const long long request_start_time,
+                       int* command_index,
+                       Response* response);
   std::string CreateSession(void);
+  void CaptureSessionCapabilities(const std::string& session_id);
+  static bool IsSessionCreated(const Response& response);
   void ShutDownSession(const std::string& session_id);
-  std::string ReadRequestBody(struct mg_connection* conn,
-                              const struct mg_request_info* request_info);
+  void ScheduleSessionShutDown(const std::string& session_id);
+  void ShutDownScheduledSessions(void);
+  int ReadRequestBody(struct mg_connection* conn,
+                      std::string* request_body);
+  int ReadChunkedRequestBody(struct mg_connection* conn,
+                             std::string* request_body);
+  static bool ParseContentLength(const char* value, size_t* length);
+  static bool IsHeaderValue(const char* value, const char* expected_value);
   bool LookupSession(const std::string& session_id,
                      SessionHandle* session_handle);
+  bool ExecuteSessionCommand(const std::string& session_id,
+                             const Command& command,
+                             Response* response);
+  bool ExecuteSessionCommandAsync(struct mg_connection* conn,
+                                  const struct mg_request_info* request_info,
+                                  const std::string& session_id,
+                                  const Command& command,
+                                  const int command_index,
+                                  const long long request_start_time,
+                                  const bool is_new_session);
+  bool AddPendingCommand(const PendingCommandHandle& pending_command);
+  void RemovePendingCommand(const PendingCommand* pending_command);
+  void GetPendingCommands(std::vector<PendingCommandHandle>* pending_commands);
+  static void MaintenanceThreadProc(void* server);
+  void PerformMaintenance(void);
   int SendResponseToClient(struct mg_connection* conn,
                            const struct mg_request_info* request_info,
-                           const std::string& serialized_response);
+                           Response* response);
+  int SendMetrics(struct mg_connection* conn,
+                  const struct mg_request_info* request_info);
   void PopulateCommandRepository(void);
-  bool IsCommandMatch(const std::string& uri,
-                      const std::string& url_template,
-                      std::vector<std::string>* locator_param_names,
-                      std::vector<std::string>* locator_param_values);
-  std::string ConstructLocatorParameterJson(std::vector<std::string> locator_param_names,
-                                            std::vector<std::string> locator_param_values,
-                                            std::string* session_id);
-  void SendHttpOk(mg_connection* connection,
-                  const mg_request_info* request_info,
-                  const std::string& body,
-                  const std::string& content_type);
-  void SendHttpBadRequest(mg_connection* connection,
-                          const mg_request_info* request_info,
-                          const std::string& body);
-  void SendHttpInternalError(mg_connection* connection,
-                             const mg_request_info* request_info,
-                             const std::string& body);
-  void SendHttpMethodNotAllowed(mg_connection* connection,
-                                const mg_request_info* request_info,
-                                const std::string& allowed_methods);
-  void SendHttpNotFound(mg_connection* connection,
-                        const mg_request_info* request_info,
-                        const std::string& body);
-  void SendHttpNotImplemented(mg_connection* connection,
-                              const mg_request_info* request_info,
-                              const std::string& body);
-  void SendHttpSeeOther(mg_connection* connection,
-                        const mg_request_info* request_info,
-                        const std::string& location);
+  bool MatchUrlNode(const UrlNode& node,
+                    const std::vector<std::string>& uri_segments,
+                    const size_t segment_index,
+                    const std::string& http_verb,
+                    std::vector<std::string>* locator_param_names,
+                    std::vector<std::string>* locator_param_values,
+                    CommandType::Id* command,
+                    std::string* allowed_verbs);
+  static bool SplitUrl(const std::string& url,
+                       std::vector<std::string>* segments);
+  static const HttpStatus& GetHttpStatus(const int response_status_code);
+  int SendHttpResponse(mg_connection* connection,
+                       const mg_request_info* request_info,
+                       const int response_status_code,
+                       const std::string& header_value,
+                       const std::string& body);
+  int SendHttpResponse(mg_connection* connection,
+                       const mg_request_info* request_info,
+                       const HttpStatus& http_status,
+                       const std::string& header_value,
+                       const std::string& body);
+  void WriteHttpResponse(mg_connection* connection,
+                         const mg_request_info* request_info,
+                         const std::string& headers,
+                         const std::string& body);
+  static const char* GetConnectionHeader(mg_connection* connection);
+
+  // The table of HTTP statuses, ending with the catch-all entry.
+  static const HttpStatus http_statuses_[];
+  // The status of responses to /metrics.
+  static const HttpStatus metrics_http_status_;
 
   // The port used for communicating with this server.
   int port_;
   // The host IP address to which the server should bind.
   std::string host_;
-  // The map of all command URIs (URL and HTTP verb), and 
-  // the corresponding numerical value of the command.
-  UrlMap commands_;
-  // The map of all sessions currently active in this server.
+  // The number of worker threads handling connections.
+  int thread_count_;
+  // The number of accepted connections that may wait for a worker thread
+  // before new connections are refused with HTTP 503.
+  int queue_size_;
+  // The largest request body, in bytes, that the server will accept.
+  size_t max_request_body_size_;
+  // The root of the tree of all command URIs (URL and HTTP verb),
+  // and the corresponding name of the command.
+  UrlNode commands_;
+  // The map of all sessions currently active in this server. Accessed
+  // concurrently by the worker threads handling requests.
   SessionMap sessions_;
+  // Latency histograms and counters of the requests handled.
+  ServerMetrics metrics_;
   // The Mongoose context for this server.
   struct mg_context* context_;
+  // Guards the pending commands, the sessions scheduled for shutdown, and
+  // the stopping flag.
+  Mutex pending_commands_lock_;
+  // The session commands executing with their connections suspended.
+  std::vector<PendingCommandHandle> pending_commands_;
+  // Sessions that ended as a result of a command, waiting to be shut down
+  // by the maintenance thread. A session cannot always be shut down on the
+  // thread that completes its last command.
+  std::vector<SessionHandle> sessions_to_shut_down_;
+  // True once Stop has been called; no more commands are suspended.
+  bool is_stopping_;
+  // Cancels commands whose clients have disconnected, and shuts down
+  // sessions that have ended.
+  Thread maintenance_thread_;
+  // Wakes the maintenance thread ahead of its next scheduled run.
+  Event maintenance_event_;
+  // Set when the last pending command is removed while the server stops.
+  Event pending_commands_event_;
 
   DISALLOW_COPY_AND_ASSIGN(Server);
 };
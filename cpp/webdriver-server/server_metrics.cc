@@ -0,0 +1,316 @@
+// Copyright 2011 Software Freedom Conservancy
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server_metrics.h"
+#include <stdio.h>
+#include "command_types.h"
+#include "logging.h"
+
+#ifdef _WIN32
+#include <intrin.h>
+#else
+#include <time.h>
+#endif
+
+// The upper bounds of the histogram buckets, in microseconds and as
+// written in the "le" label, with a last bucket for anything longer.
+#define BUCKET_COUNT 17
+#define HISTOGRAM_SIZE (BUCKET_COUNT + 1)
+#define SUM_INDEX BUCKET_COUNT
+// After the command histograms come the stage histograms, then the byte
+// counters.
+#define REQUEST_BYTES_INDEX 0
+#define RESPONSE_BYTES_INDEX 1
+#define BYTE_COUNTER_COUNT 2
+
+namespace {
+
+const long long bucket_bounds[BUCKET_COUNT - 1] = {
+  500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+  1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+const char* bucket_labels[BUCKET_COUNT] = {
+  "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1",
+  "0.25", "0.5", "1", "2.5", "5", "10", "30", "60", "+Inf"
+};
+
+const char* stage_names[webdriver::ServerMetrics::kStageCount] = {
+  "read_body", "lookup", "execute", "serialize", "write"
+};
+
+void AppendNumber(const long long value, std::string* output) {
+  char buffer[32];
+  sprintf(buffer, "%lld", value);
+  output->append(buffer);
+}
+
+}  // namespace
+
+namespace webdriver {
+
+ServerMetrics::ServerMetrics(void) : shard_size_(0), requests_in_flight_(0) {
+  for (int i = 0; i < SERVER_METRICS_SHARD_COUNT; ++i) {
+    this->shards_[i] = NULL;
+  }
+}
+
+ServerMetrics::~ServerMetrics(void) {
+  for (int i = 0; i < SERVER_METRICS_SHARD_COUNT; ++i) {
+    delete[] this->shards_[i];
+  }
+}
+
+void ServerMetrics::Initialize(void) {
+  if (this->shard_size_ != 0) {
+    return;
+  }
+  this->shard_size_ = (CommandType::Count + kStageCount) *
+      HISTOGRAM_SIZE + BYTE_COUNTER_COUNT;
+  for (int i = 0; i < SERVER_METRICS_SHARD_COUNT; ++i) {
+    this->shards_[i] = new long long[this->shard_size_]();
+  }
+}
+
+long long ServerMetrics::Now(void) {
+#ifdef _WIN32
+  static LARGE_INTEGER frequency = { 0 };
+  if (frequency.QuadPart == 0) {
+    ::QueryPerformanceFrequency(&frequency);
+  }
+  LARGE_INTEGER counter;
+  ::QueryPerformanceCounter(&counter);
+  return counter.QuadPart / frequency.QuadPart * 1000000 +
+      counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<long long>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+void ServerMetrics::RecordCommand(const int command_type,
+                                  const long long duration) {
+  if (command_type < 0 || command_type >= CommandType::Count) {
+    return;
+  }
+  this->Record(command_type * HISTOGRAM_SIZE, duration);
+}
+
+void ServerMetrics::RecordStage(const Stage stage, const long long duration) {
+  this->Record((CommandType::Count + stage) * HISTOGRAM_SIZE,
+               duration);
+}
+
+void ServerMetrics::AddRequestBytes(const size_t byte_count) {
+  long long* shard = this->GetShard();
+  if (shard != NULL) {
+    AtomicAdd(&shard[this->shard_size_ - BYTE_COUNTER_COUNT +
+                     REQUEST_BYTES_INDEX], byte_count);
+  }
+}
+
+void ServerMetrics::AddResponseBytes(const size_t byte_count) {
+  long long* shard = this->GetShard();
+  if (shard != NULL) {
+    AtomicAdd(&shard[this->shard_size_ - BYTE_COUNTER_COUNT +
+                     RESPONSE_BYTES_INDEX], byte_count);
+  }
+}
+
+void ServerMetrics::BeginRequest(void) {
+#ifdef _WIN32
+  ::InterlockedIncrement(&this->requests_in_flight_);
+#else
+  __sync_add_and_fetch(&this->requests_in_flight_, 1);
+#endif
+}
+
+void ServerMetrics::EndRequest(void) {
+#ifdef _WIN32
+  ::InterlockedDecrement(&this->requests_in_flight_);
+#else
+  __sync_sub_and_fetch(&this->requests_in_flight_, 1);
+#endif
+}
+
+void ServerMetrics::Serialize(std::string* output) {
+  if (this->shard_size_ == 0) {
+    return;
+  }
+
+  std::string name = "webdriver_command_duration_seconds";
+  output->append("# HELP " + name +
+                 " Time from reading a request to writing its response,"
+                 " by command.\n");
+  output->append("# TYPE " + name + " histogram\n");
+  for (int i = 0; i < CommandType::Count; ++i) {
+    // Only commands that have been used, to keep the output short.
+    if (this->Count(i * HISTOGRAM_SIZE) != 0) {
+      this->AppendHistogram(name,
+                            "command",
+                            CommandType::GetName(i),
+                            i * HISTOGRAM_SIZE,
+                            output);
+    }
+  }
+
+  name = "webdriver_request_stage_duration_seconds";
+  output->append("# HELP " + name +
+                 " Time spent in each stage of handling requests.\n");
+  output->append("# TYPE " + name + " histogram\n");
+  for (int stage = 0; stage < kStageCount; ++stage) {
+    this->AppendHistogram(name,
+                          "stage",
+                          stage_names[stage],
+                          (CommandType::Count + stage) * HISTOGRAM_SIZE,
+                          output);
+  }
+
+  size_t byte_counters = this->shard_size_ - BYTE_COUNTER_COUNT;
+  AppendCounter("webdriver_request_body_bytes_total",
+                "Bytes of request bodies read.",
+                this->Sum(byte_counters + REQUEST_BYTES_INDEX),
+                output);
+  AppendCounter("webdriver_response_bytes_total",
+                "Bytes of responses written, including headers.",
+                this->Sum(byte_counters + RESPONSE_BYTES_INDEX),
+                output);
+
+#ifdef _WIN32
+  long requests_in_flight =
+      ::InterlockedCompareExchange(&this->requests_in_flight_, 0, 0);
+#else
+  long requests_in_flight = __sync_fetch_and_add(&this->requests_in_flight_, 0);
+#endif
+  AppendGauge("webdriver_requests_in_flight",
+              "Requests being handled by worker threads.",
+              requests_in_flight,
+              output);
+}
+
+void ServerMetrics::AppendCounter(const std::string& name,
+                                  const std::string& help,
+                                  const long long value,
+                                  std::string* output) {
+  AppendMetric(name, help, "counter", value, output);
+}
+
+void ServerMetrics::AppendGauge(const std::string& name,
+                                const std::string& help,
+                                const long long value,
+                                std::string* output) {
+  AppendMetric(name, help, "gauge", value, output);
+}
+
+void ServerMetrics::AppendMetric(const std::string& name,
+                                 const std::string& help,
+                                 const std::string& type,
+                                 const long long value,
+                                 std::string* output) {
+  output->append("# HELP " + name + " " + help + "\n");
+  output->append("# TYPE " + name + " " + type + "\n" + name + " ");
+  AppendNumber(value, output);
+  output->append("\n");
+}
+
+long long* ServerMetrics::GetShard(void) {
+  if (this->shard_size_ == 0) {
+    return NULL;
+  }
+  // The shard is picked from a hash of the thread ID, which needs no
+  // thread-local state; Windows thread IDs are multiples of four, so the
+  // low bits alone would leave most shards unused.
+  unsigned long long hash = LogThread::Id() * 0x9E3779B97F4A7C15ULL;
+  return this->shards_[(hash >> 32) % SERVER_METRICS_SHARD_COUNT];
+}
+
+long long ServerMetrics::Sum(const size_t offset) {
+  long long sum = 0;
+  for (int i = 0; i < SERVER_METRICS_SHARD_COUNT; ++i) {
+    sum += AtomicLoad(&this->shards_[i][offset]);
+  }
+  return sum;
+}
+
+long long ServerMetrics::Count(const size_t offset) {
+  long long count = 0;
+  for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+    count += this->Sum(offset + bucket);
+  }
+  return count;
+}
+
+void ServerMetrics::AppendHistogram(const std::string& name,
+                                    const std::string& label_name,
+                                    const std::string& label_value,
+                                    const size_t offset,
+                                    std::string* output) {
+  std::string labels = "{" + label_name + "=\"" + label_value + "\"";
+  long long count = 0;
+  for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+    count += this->Sum(offset + bucket);
+    output->append(name + "_bucket" + labels + ",le=\"" +
+                   bucket_labels[bucket] + "\"} ");
+    AppendNumber(count, output);
+    output->append("\n");
+  }
+
+  // The sum is kept in microseconds, and written in seconds.
+  long long sum = this->Sum(offset + SUM_INDEX);
+  char sum_buffer[48];
+  sprintf(sum_buffer, "%lld.%06lld", sum / 1000000, sum % 1000000);
+  output->append(name + "_sum" + labels + "} " + sum_buffer + "\n");
+  output->append(name + "_count" + labels + "} ");
+  AppendNumber(count, output);
+  output->append("\n");
+}
+
+void ServerMetrics::Record(const size_t offset, const long long duration) {
+  long long* shard = this->GetShard();
+  if (shard == NULL) {
+    return;
+  }
+  int bucket = 0;
+  while (bucket < BUCKET_COUNT - 1 && duration > bucket_bounds[bucket]) {
+    ++bucket;
+  }
+  AtomicAdd(&shard[offset + bucket], 1);
+  AtomicAdd(&shard[offset + SUM_INDEX], duration);
+}
+
+void ServerMetrics::AtomicAdd(long long* value, const long long amount) {
+#ifdef _WIN32
+  long long current = *value;
+  long long previous;
+  while ((previous = _InterlockedCompareExchange64(value,
+                                                   current + amount,
+                                                   current)) != current) {
+    current = previous;
+  }
+#else
+  __sync_fetch_and_add(value, amount);
+#endif
+}
+
+long long ServerMetrics::AtomicLoad(long long* value) {
+#if defined(_WIN32)
+  return _InterlockedCompareExchange64(value, 0, 0);
+#elif defined(__ATOMIC_RELAXED)
+  return __atomic_load_n(value, __ATOMIC_RELAXED);
+#else
+  return __sync_fetch_and_add(value, 0);
+#endif
+}
+
+}  // namespace webdriver
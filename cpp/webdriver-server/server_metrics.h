@@ -0,0 +1,100 @@
+// Copyright 2011 Software Freedom Conservancy
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Defines the latency histograms and counters the WebDriver server keeps
+// about the requests it handles, and their rendering in the Prometheus
+// text format. Each thread records into a shard chosen by its thread ID
+// with atomic adds, taking no lock; the shards are summed when the metrics
+// are read.
+
+#ifndef WEBDRIVER_SERVER_SERVER_METRICS_H_
+#define WEBDRIVER_SERVER_SERVER_METRICS_H_
+
+#include <string>
+
+#define SERVER_METRICS_SHARD_COUNT 8
+
+namespace webdriver {
+
+class ServerMetrics {
+ public:
+  // The stages of handling a request, each with a latency histogram.
+  enum Stage {
+    kReadBodyStage = 0,
+    kLookupStage,
+    kExecuteStage,
+    kSerializeStage,
+    kWriteStage,
+    kStageCount
+  };
+
+  ServerMetrics(void);
+  virtual ~ServerMetrics(void);
+
+  void Initialize(void);
+
+  // Returns a monotonic time in microseconds, for measuring durations.
+  static long long Now(void);
+
+  // Records the duration of a command of the given CommandType::Id.
+  void RecordCommand(const int command_type, const long long duration);
+  void RecordStage(const Stage stage, const long long duration);
+  void AddRequestBytes(const size_t byte_count);
+  void AddResponseBytes(const size_t byte_count);
+  void BeginRequest(void);
+  void EndRequest(void);
+
+  // Appends the histograms and counters, in the Prometheus text format.
+  void Serialize(std::string* output);
+  static void AppendCounter(const std::string& name,
+                            const std::string& help,
+                            const long long value,
+                            std::string* output);
+  static void AppendGauge(const std::string& name,
+                          const std::string& help,
+                          const long long value,
+                          std::string* output);
+
+ private:
+  long long* GetShard(void);
+  long long Sum(const size_t offset);
+  long long Count(const size_t offset);
+  void AppendHistogram(const std::string& name,
+                       const std::string& label_name,
+                       const std::string& label_value,
+                       const size_t offset,
+                       std::string* output);
+  void Record(const size_t offset, const long long duration);
+  static void AppendMetric(const std::string& name,
+                           const std::string& help,
+                           const std::string& type,
+                           const long long value,
+                           std::string* output);
+  static void AtomicAdd(long long* value, const long long amount);
+  static long long AtomicLoad(long long* value);
+
+  // The counters of each shard. A histogram is a run of counters: one for
+  // each bucket, then the sum of the durations in microseconds. There is
+  // a histogram for each command type, indexed by its id, then one for
+  // each stage.
+  long long* shards_[SERVER_METRICS_SHARD_COUNT];
+  size_t shard_size_;
+  // The number of requests being handled by worker threads.
+  volatile long requests_in_flight_;
+
+  DISALLOW_COPY_AND_ASSIGN(ServerMetrics);
+};
+
+}  // namespace webdriver
+
+#endif  // WEBDRIVER_SERVER_SERVER_METRICS_H_
@@ -17,29 +17,133 @@
 #ifndef WEBDRIVER_SERVER_SESSION_H_
 #define WEBDRIVER_SERVER_SESSION_H_
 
+#ifdef _WIN32
 #include <memory>
+#else
+#include <tr1/memory>
+#endif
 #include <string>
+#include "command.h"
+#include "errorcodes.h"
+#include "mutex.h"
+#include "response.h"
 
 namespace webdriver {
 
+// Receives the outcome of a command executed with
+// Session::ExecuteCommandAsync. Also serves to cancel the command: once
+// is_cancelled returns true, nobody is waiting for the response any
+// longer, and the session may stop work on the command and skip calling
+// Complete.
+class CommandCompletion {
+ public:
+  virtual ~CommandCompletion(void) {}
+
+  // Called exactly once, on any thread, unless the command is cancelled.
+  // session_is_valid is false if the session has ended, for example
+  // because the command was a request to quit.
+  virtual void Complete(Response* response, bool session_is_valid) = 0;
+  virtual bool is_cancelled(void) = 0;
+};
+
+typedef std::tr1::shared_ptr<CommandCompletion> CommandCompletionHandle;
+
 class Session {
  public:
-  Session(void) {}
+  Session(void) : is_registered_(true), has_capabilities_(false) {}
   virtual ~Session(void) {}
 
   virtual void Initialize(void* init_params) = 0;
   virtual void ShutDown(void) = 0;
-  virtual bool ExecuteCommand(const std::string& serialized_command,
-                              std::string* serialized_response) = 0;
+  virtual bool ExecuteCommand(const Command& command,
+                              Response* response) = 0;
+
+  // Executes a command without making the caller wait for it to finish.
+  // The default implementation executes the command on the calling thread;
+  // sessions that drive a browser on a thread of their own should override
+  // this to hand the command to that thread and return at once.
+  virtual void ExecuteCommandAsync(const Command& command,
+                                   CommandCompletionHandle completion) {
+    if (completion->is_cancelled()) {
+      return;
+    }
+    Response response;
+    bool session_is_valid = false;
+    {
+      ScopedLock lock(&this->command_mutex_);
+
+      // The session may have been shut down while this command was waiting
+      // for the one ahead of it to complete.
+      if (!this->is_registered()) {
+        response.set_session_id(this->session_id_);
+        if (command.command_type() == CommandType::Quit) {
+          // Calling quit on an invalid session should be a no-op.
+          response.SetSuccessResponse(Json::Value::null);
+        } else {
+          response.SetErrorResponse(ENOSUCHDRIVER,
+              "session " + this->session_id_ + " does not exist");
+        }
+      } else {
+        session_is_valid = this->ExecuteCommand(command, &response);
+      }
+    }
+    completion->Complete(&response, session_is_valid);
+  }
 
   std::string session_id(void) const { return this->session_id_; }
 
+  // The capabilities of the session, captured by the server once the
+  // session has been created, so that sessions can be listed without
+  // waiting for the commands they are executing. Returns false if the
+  // capabilities have not been captured yet.
+  bool GetCapabilities(Json::Value* capabilities) {
+    ScopedLock lock(&this->state_lock_);
+    if (!this->has_capabilities_) {
+      return false;
+    }
+    *capabilities = this->capabilities_;
+    return true;
+  }
+
+  void set_capabilities(const Json::Value& capabilities) {
+    // The copy lasts as long as the session, so it must not come from the
+    // arena of the request that created the session.
+    Json::NoValueArena no_value_arena;
+    ScopedLock lock(&this->state_lock_);
+    this->capabilities_ = capabilities;
+    this->has_capabilities_ = true;
+  }
+
+  // Whether the session is still in the server's registry. Cleared by the
+  // server when it removes the session to shut it down.
+  bool is_registered(void) {
+    ScopedLock lock(&this->state_lock_);
+    return this->is_registered_;
+  }
+
+  void set_is_registered(const bool is_registered) {
+    ScopedLock lock(&this->state_lock_);
+    this->is_registered_ = is_registered;
+  }
+
+  // Held by the server while a command executes, so that only one
+  // command at a time runs on a session.
+  Mutex* command_mutex(void) { return &this->command_mutex_; }
+
  protected:
   void set_session_id(const std::string& id) { this->session_id_ = id; }
 
  private:
   // The unique ID of the session.
   std::string session_id_;
+  // Serializes command execution on the session.
+  Mutex command_mutex_;
+  // Guards the registration and the capabilities, which are read and
+  // written on any thread.
+  Mutex state_lock_;
+  bool is_registered_;
+  Json::Value capabilities_;
+  bool has_capabilities_;
 
   DISALLOW_COPY_AND_ASSIGN(Session);
 };
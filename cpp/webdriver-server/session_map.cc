@@ -0,0 +1,88 @@
+// Copyright 2011 Software Freedom Conservancy
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "session_map.h"
+
+namespace webdriver {
+
+SessionMap::SessionMap(void) {
+}
+
+SessionMap::~SessionMap(void) {
+}
+
+void SessionMap::Add(const SessionHandle& session_handle) {
+  std::string session_id = session_handle->session_id();
+  Shard* shard = this->GetShard(session_id);
+  ScopedLock lock(&shard->lock);
+  shard->sessions[session_id] = session_handle;
+}
+
+bool SessionMap::Find(const std::string& session_id,
+                      SessionHandle* session_handle) {
+  Shard* shard = this->GetShard(session_id);
+  ScopedLock lock(&shard->lock);
+  SessionHandleMap::const_iterator it = shard->sessions.find(session_id);
+  if (it == shard->sessions.end()) {
+    return false;
+  }
+  *session_handle = it->second;
+  return true;
+}
+
+bool SessionMap::Remove(const std::string& session_id,
+                        SessionHandle* session_handle) {
+  Shard* shard = this->GetShard(session_id);
+  ScopedLock lock(&shard->lock);
+  SessionHandleMap::iterator it = shard->sessions.find(session_id);
+  if (it == shard->sessions.end()) {
+    return false;
+  }
+  *session_handle = it->second;
+  shard->sessions.erase(it);
+  return true;
+}
+
+void SessionMap::GetAll(std::vector<SessionHandle>* session_handles) {
+  for (int i = 0; i < SESSION_MAP_SHARD_COUNT; ++i) {
+    Shard* shard = &this->shards_[i];
+    ScopedLock lock(&shard->lock);
+    SessionHandleMap::const_iterator it = shard->sessions.begin();
+    for (; it != shard->sessions.end(); ++it) {
+      session_handles->push_back(it->second);
+    }
+  }
+}
+
+int SessionMap::size(void) {
+  size_t session_count = 0;
+  for (int i = 0; i < SESSION_MAP_SHARD_COUNT; ++i) {
+    Shard* shard = &this->shards_[i];
+    ScopedLock lock(&shard->lock);
+    session_count += shard->sessions.size();
+  }
+  return static_cast<int>(session_count);
+}
+
+SessionMap::Shard* SessionMap::GetShard(const std::string& session_id) {
+  // FNV-1a hash of the session ID.
+  unsigned int hash = 2166136261U;
+  std::string::const_iterator it = session_id.begin();
+  for (; it != session_id.end(); ++it) {
+    hash ^= static_cast<unsigned char>(*it);
+    hash *= 16777619U;
+  }
+  return &this->shards_[hash % SESSION_MAP_SHARD_COUNT];
+}
+
+}  // namespace webdriver
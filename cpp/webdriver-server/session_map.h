@@ -0,0 +1,66 @@
+// Copyright 2011 Software Freedom Conservancy
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Defines the registry of active sessions for the WebDriver server. The
+// registry is safe to use from multiple threads. Sessions are spread
+// across a fixed number of shards by session ID, each with its own lock,
+// so that threads working with different sessions rarely wait on each
+// other.
+
+#ifndef WEBDRIVER_SERVER_SESSION_MAP_H_
+#define WEBDRIVER_SERVER_SESSION_MAP_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include "mutex.h"
+#include "session.h"
+
+#define SESSION_MAP_SHARD_COUNT 16
+
+namespace webdriver {
+
+class SessionMap {
+ public:
+  SessionMap(void);
+  virtual ~SessionMap(void);
+
+  void Add(const SessionHandle& session_handle);
+  bool Find(const std::string& session_id,
+            SessionHandle* session_handle);
+  bool Remove(const std::string& session_id,
+              SessionHandle* session_handle);
+  void GetAll(std::vector<SessionHandle>* session_handles);
+
+  int size(void);
+
+ private:
+  typedef std::map<std::string, SessionHandle> SessionHandleMap;
+
+  struct Shard {
+    // Guards the sessions in this shard.
+    Mutex lock;
+    // The sessions whose IDs hash to this shard.
+    SessionHandleMap sessions;
+  };
+
+  Shard* GetShard(const std::string& session_id);
+
+  Shard shards_[SESSION_MAP_SHARD_COUNT];
+
+  DISALLOW_COPY_AND_ASSIGN(SessionMap);
+};
+
+}  // namespace webdriver
+
+#endif  // WEBDRIVER_SERVER_SESSION_MAP_H_
@@ -0,0 +1,185 @@
+// Copyright 2011 Software Freedom Conservancy
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Defines a thread of execution for use by the WebDriver server, and an
+// event that one thread can use to wake another.
+
+#ifndef WEBDRIVER_SERVER_THREAD_H_
+#define WEBDRIVER_SERVER_THREAD_H_
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+namespace webdriver {
+
+class Thread {
+ public:
+  typedef void (*ThreadProc)(void* argument);
+
+  Thread(void) : proc_(NULL), argument_(NULL), is_running_(false) {
+  }
+
+  ~Thread(void) {
+    this->Join();
+  }
+
+  // Runs proc(argument) on a new thread. Returns false if the thread
+  // could not be created, or if this thread is already running.
+  bool Start(ThreadProc proc, void* argument) {
+    if (this->is_running_) {
+      return false;
+    }
+    this->proc_ = proc;
+    this->argument_ = argument;
+#ifdef _WIN32
+    this->handle_ = reinterpret_cast<HANDLE>(_beginthreadex(NULL,
+                                                            0,
+                                                            &Thread::Run,
+                                                            this,
+                                                            0,
+                                                            NULL));
+    this->is_running_ = this->handle_ != NULL;
+#else
+    this->is_running_ = pthread_create(&this->handle_,
+                                       NULL,
+                                       &Thread::Run,
+                                       this) == 0;
+#endif
+    return this->is_running_;
+  }
+
+  // Waits for the thread to finish. Does nothing if it was never started.
+  void Join(void) {
+    if (!this->is_running_) {
+      return;
+    }
+#ifdef _WIN32
+    ::WaitForSingleObject(this->handle_, INFINITE);
+    ::CloseHandle(this->handle_);
+#else
+    pthread_join(this->handle_, NULL);
+#endif
+    this->is_running_ = false;
+  }
+
+ private:
+#ifdef _WIN32
+  static unsigned int __stdcall Run(void* thread) {
+    Thread* this_thread = reinterpret_cast<Thread*>(thread);
+    this_thread->proc_(this_thread->argument_);
+    return 0;
+  }
+
+  HANDLE handle_;
+#else
+  static void* Run(void* thread) {
+    Thread* this_thread = reinterpret_cast<Thread*>(thread);
+    this_thread->proc_(this_thread->argument_);
+    return NULL;
+  }
+
+  pthread_t handle_;
+#endif
+
+  ThreadProc proc_;
+  void* argument_;
+  bool is_running_;
+
+  DISALLOW_COPY_AND_ASSIGN(Thread);
+};
+
+// An auto-reset event: Set() wakes one waiting thread, or the next thread
+// to wait if none is waiting yet.
+class Event {
+ public:
+  Event(void) {
+#ifdef _WIN32
+    this->event_ = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+    pthread_mutex_init(&this->lock_, NULL);
+    pthread_cond_init(&this->condition_, NULL);
+    this->is_set_ = false;
+#endif
+  }
+
+  ~Event(void) {
+#ifdef _WIN32
+    ::CloseHandle(this->event_);
+#else
+    pthread_cond_destroy(&this->condition_);
+    pthread_mutex_destroy(&this->lock_);
+#endif
+  }
+
+  void Set(void) {
+#ifdef _WIN32
+    ::SetEvent(this->event_);
+#else
+    pthread_mutex_lock(&this->lock_);
+    this->is_set_ = true;
+    pthread_cond_signal(&this->condition_);
+    pthread_mutex_unlock(&this->lock_);
+#endif
+  }
+
+  // Waits until the event is set, or until the timeout expires. Returns
+  // true if the event was set.
+  bool Wait(const int timeout_in_milliseconds) {
+#ifdef _WIN32
+    return ::WaitForSingleObject(this->event_,
+                                 timeout_in_milliseconds) == WAIT_OBJECT_0;
+#else
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long long deadline_in_microseconds = now.tv_usec +
+        static_cast<long long>(timeout_in_milliseconds) * 1000;
+    struct timespec deadline;
+    deadline.tv_sec = now.tv_sec +
+        static_cast<time_t>(deadline_in_microseconds / 1000000);
+    deadline.tv_nsec = static_cast<long>(deadline_in_microseconds % 1000000) *
+        1000;
+
+    pthread_mutex_lock(&this->lock_);
+    int result = 0;
+    while (!this->is_set_ && result != ETIMEDOUT) {
+      result = pthread_cond_timedwait(&this->condition_,
+                                      &this->lock_,
+                                      &deadline);
+    }
+    bool was_set = this->is_set_;
+    this->is_set_ = false;
+    pthread_mutex_unlock(&this->lock_);
+    return was_set;
+#endif
+  }
+
+ private:
+#ifdef _WIN32
+  HANDLE event_;
+#else
+  pthread_mutex_t lock_;
+  pthread_cond_t condition_;
+  bool is_set_;
+#endif
+
+  DISALLOW_COPY_AND_ASSIGN(Event);
+};
+
+}  // namespace webdriver
+
+#endif  // WEBDRIVER_SERVER_THREAD_H_
@@ -1044,10 +1044,11 @@ Utils.waitForNativeEventsProcessing = function(element, nativeEvents, pageUnload
 
   do {
 
-    // This sleep is needed so that Firefox on Linux will manage to process
-    // all of the keyboard events before returning control to the caller
-    // code (otherwise the caller may not find all of the keystrokes it
-    // has entered).
+    // Firefox on Linux must process all of the keyboard events before
+    // control returns to the caller code (otherwise the caller may not find
+    // all of the keystrokes it has entered). The native code reports as soon
+    // as they have all been handled, so it is asked again after every event
+    // processed; the timeout only bounds each round of waiting.
     var doneNativeEventWait = false;
 
     var callback = function() {
@@ -1069,6 +1070,7 @@ Utils.waitForNativeEventsProcessing = function(element, nativeEvents, pageUnload
            (!pageUnloadedData.wasUnloaded) && (numEventsProcessed < 350)) {
       thread.processNextEvent(true);
       numEventsProcessed += 1;
+      nativeEvents.hasUnhandledEvents(node, hasEvents);
     }
     fxdriver.logging.info('Extra events processed: ' + numEventsProcessed +
                  ' Page Unloaded: ' + pageUnloadedData.wasUnloaded);
@@ -2,6 +2,8 @@
 # define CPPTL_JSON_H_INCLUDED
 
 # include "forwards.h"
+# include <cstddef>
+# include <new>
 # include <string>
 # include <vector>
 
@@ -81,6 +83,132 @@ namespace Json {
       const char *str_;
    };
 
+   /** \brief Scope in which the Values built by the current thread take their memory from an arena.
+    *
+    * While a ValueArena is alive, the strings, member names and object/array
+    * nodes allocated by Value on the thread that created it are carved from
+    * large chunks instead of being allocated one by one. A chunk is freed in
+    * one shot once the arena has moved past it and all the blocks carved from
+    * it have been released, so Values may safely outlive the arena and be
+    * destroyed on any thread; they merely keep their chunk alive.
+    *
+    * Arenas nest, and must be destroyed on the thread that created them, in
+    * reverse order of creation. Typical usage is one arena per request:
+    * \code
+    * {
+    *    Json::ValueArena arena;
+    *    Json::Value root;
+    *    reader.parse( document, root );
+    *    ...
+    * } // chunks freed here, unless a Value built above is still alive.
+    * \endcode
+    */
+   class JSON_API ValueArena
+   {
+   public:
+      ValueArena();
+      ~ValueArena();
+
+      /// Allocates from the current thread's arena, or from the heap if there is none.
+      static void *allocate( size_t size );
+      /// Releases memory returned by allocate(), whichever arena it came from.
+      static void release( void *block );
+
+   private:
+      ValueArena( const ValueArena & );
+      void operator =( const ValueArena & );
+
+      union Chunk;
+      union BlockHeader;
+
+      BlockHeader *allocateBlock( size_t blockSize );
+      void retireChunk();
+
+      ValueArena *previous_;
+      Chunk *chunk_;
+      char *next_;
+      char *end_;
+      size_t chunkSize_;
+      long allocationCount_;
+   };
+
+   /** \brief Scope in which the Values built by the current thread take their memory from the heap.
+    *
+    * Suspends the current ValueArena, if any, until the scope ends. Use it
+    * when building Values that outlive the request by far, such as copies
+    * kept by long-lived objects, so that they do not keep the arena's
+    * chunks alive.
+    */
+   class JSON_API NoValueArena
+   {
+   public:
+      NoValueArena();
+      ~NoValueArena();
+
+   private:
+      NoValueArena( const NoValueArena & );
+      void operator =( const NoValueArena & );
+
+      ValueArena *suspended_;
+   };
+
+   /** \brief Standard allocator over ValueArena, used for the nodes of objects and arrays.
+    */
+   template<typename T>
+   class ValueArenaAllocator
+   {
+   public:
+      typedef T value_type;
+      typedef T *pointer;
+      typedef const T *const_pointer;
+      typedef T &reference;
+      typedef const T &const_reference;
+      typedef size_t size_type;
+      typedef ptrdiff_t difference_type;
+
+      template<typename U>
+      struct rebind
+      {
+         typedef ValueArenaAllocator<U> other;
+      };
+
+      ValueArenaAllocator() {}
+      ValueArenaAllocator( const ValueArenaAllocator & ) {}
+      template<typename U>
+      ValueArenaAllocator( const ValueArenaAllocator<U> & ) {}
+
+      pointer address( reference value ) const { return &value; }
+      const_pointer address( const_reference value ) const { return &value; }
+
+      pointer allocate( size_type count, const void * = 0 )
+      {
+         return static_cast<pointer>( ValueArena::allocate( count * sizeof(T) ) );
+      }
+
+      void deallocate( pointer block, size_type )
+      {
+         ValueArena::release( block );
+      }
+
+      size_type max_size() const
+      {
+         return size_type(-1) / sizeof(T);
+      }
+
+      void construct( pointer block, const T &value )
+      {
+         new ( static_cast<void *>( block ) ) T( value );
+      }
+
+      void destroy( pointer block )
+      {
+         block->~T();
+      }
+
+      bool operator ==( const ValueArenaAllocator & ) const { return true; }
+      bool operator !=( const ValueArenaAllocator & ) const { return false; }
+   };
+
    /** \brief Represents a <a HREF="http://www.json.org">JSON</a> value.
     *
     * This class is a discriminated union wrapper that can represents a:
@@ -158,7 +286,8 @@ namespace Json {
 
    public:
 #  ifndef JSON_USE_CPPTL_SMALLMAP
-      typedef std::map<CZString, Value> ObjectValues;
+      typedef std::map<CZString, Value, std::less<CZString>,
+                       ValueArenaAllocator<std::pair<const CZString, Value> > > ObjectValues;
 #  else
       typedef CppTL::SmallMap<CZString, Value> ObjectValues;
 #  endif // ifndef JSON_USE_CPPTL_SMALLMAP
@@ -12,6 +12,15 @@
 #ifndef JSON_USE_SIMPLE_INTERNAL_ALLOCATOR
 # include "json_batchallocator.h"
 #endif // #ifndef JSON_USE_SIMPLE_INTERNAL_ALLOCATOR
+#ifdef _MSC_VER
+# ifndef NOMINMAX
+#  define NOMINMAX
+# endif
+# include <windows.h>
+# include <intrin.h>
+# pragma intrinsic( _InterlockedExchangeAdd )
+# pragma intrinsic( _InterlockedCompareExchange )
+#endif
 
 #define JSON_ASSERT_UNREACHABLE assert( false )
 #define JSON_ASSERT( condition ) assert( condition );  // @todo <= change this into an exception throw
@@ -52,6 +61,199 @@ const UInt Value::maxUInt = UInt(-1);
 //   return 0;
 //}
 
+// //////////////////////////////////////////////////////////////////
+// //////////////////////////////////////////////////////////////////
+// //////////////////////////////////////////////////////////////////
+// class ValueArena
+// //////////////////////////////////////////////////////////////////
+// //////////////////////////////////////////////////////////////////
+// //////////////////////////////////////////////////////////////////
+
+// Every block starts with a header naming the chunk it was carved from,
+// or null if it came from the heap. A chunk starts with the number of its
+// blocks still alive, counted down as they are released and brought back
+// up by the number of blocks carved once the arena retires the chunk, so
+// that it reaches zero exactly once: when the chunk can be freed. This
+// keeps allocation free of atomic operations.
+union ValueArena::Chunk
+{
+   volatile long liveCount_;
+   double align_;
+};
+
+union ValueArena::BlockHeader
+{
+   ValueArena::Chunk *chunk_;
+   double align_;
+};
+
+static const size_t minArenaChunkSize = 4096;
+static const size_t maxArenaChunkSize = 65536;
+// Larger blocks, such as big strings, come from the heap.
+static const size_t maxArenaBlockSize = 1024;
+
+// The arena of the current thread. Variables declared __declspec(thread)
+// are not set up in DLLs loaded with LoadLibrary before Windows Vista, so
+// MSVC builds keep it in a TLS slot instead. If no slot can be had, Values
+// simply take their memory from the heap.
+#ifdef _MSC_VER
+static DWORD valueArenaSlot()
+{
+   // One more than the slot, so that zero means none has been allocated.
+   static volatile long slotNumber = 0;
+   long current = slotNumber;
+   if ( current == 0 )
+   {
+      DWORD slot = TlsAlloc();
+      if ( slot == TLS_OUT_OF_INDEXES )
+         return TLS_OUT_OF_INDEXES;
+      current = _InterlockedCompareExchange( &slotNumber, long(slot) + 1, 0 );
+      if ( current == 0 )
+         current = long(slot) + 1;
+      else
+         TlsFree( slot );
+   }
+   return DWORD( current - 1 );
+}
+
+static ValueArena *currentValueArena()
+{
+   DWORD slot = valueArenaSlot();
+   if ( slot == TLS_OUT_OF_INDEXES )
+      return 0;
+   // TlsGetValue clears the last error, which the caller may not have read yet.
+   DWORD lastError = GetLastError();
+   ValueArena *arena = static_cast<ValueArena *>( TlsGetValue( slot ) );
+   SetLastError( lastError );
+   return arena;
+}
+
+static void setCurrentValueArena( ValueArena *arena )
+{
+   DWORD slot = valueArenaSlot();
+   if ( slot != TLS_OUT_OF_INDEXES )
+      TlsSetValue( slot, arena );
+}
+#else
+static __thread ValueArena *threadValueArena = 0;
+
+static ValueArena *currentValueArena()
+{
+   return threadValueArena;
+}
+
+static void setCurrentValueArena( ValueArena *arena )
+{
+   threadValueArena = arena;
+}
+#endif
+
+static long atomicAdd( volatile long *value, long amount )
+{
+#ifdef _MSC_VER
+   return _InterlockedExchangeAdd( value, amount ) + amount;
+#else
+   return __sync_add_and_fetch( value, amount );
+#endif
+}
+
+ValueArena::ValueArena()
+   : previous_( currentValueArena() )
+   , chunk_( 0 )
+   , next_( 0 )
+   , end_( 0 )
+   , chunkSize_( minArenaChunkSize )
+   , allocationCount_( 0 )
+{
+   setCurrentValueArena( this );
+}
+
+ValueArena::~ValueArena()
+{
+   retireChunk();
+   setCurrentValueArena( previous_ );
+}
+
+void *
+ValueArena::allocate( size_t size )
+{
+   const size_t alignment = sizeof(BlockHeader);
+   size_t blockSize = sizeof(BlockHeader) + ( size + alignment - 1 ) / alignment * alignment;
+   ValueArena *arena = currentValueArena();
+   BlockHeader *header;
+   if ( arena  &&  blockSize <= maxArenaBlockSize )
+      header = arena->allocateBlock( blockSize );
+   else
+   {
+      header = static_cast<BlockHeader *>( malloc( blockSize ) );
+      if ( !header )
+         throw std::bad_alloc();
+      header->chunk_ = 0;
+   }
+   return header + 1;
+}
+
+void 
+ValueArena::release( void *block )
+{
+   if ( !block )
+      return;
+   BlockHeader *header = static_cast<BlockHeader *>( block ) - 1;
+   Chunk *chunk = header->chunk_;
+   if ( !chunk )
+      free( header );
+   else if ( atomicAdd( &chunk->liveCount_, -1 ) == 0 )
+      free( chunk );
+}
+
+ValueArena::BlockHeader *
+ValueArena::allocateBlock( size_t blockSize )
+{
+   if ( !chunk_  ||  blockSize > size_t( end_ - next_ ) )
+   {
+      retireChunk();
+      chunk_ = static_cast<Chunk *>( malloc( chunkSize_ ) );
+      if ( !chunk_ )
+         throw std::bad_alloc();
+      chunk_->liveCount_ = 0;
+      next_ = reinterpret_cast<char *>( chunk_ + 1 );
+      end_ = reinterpret_cast<char *>( chunk_ ) + chunkSize_;
+      if ( chunkSize_ < maxArenaChunkSize )
+         chunkSize_ *= 2;
+   }
+   BlockHeader *header = reinterpret_cast<BlockHeader *>( next_ );
+   next_ += blockSize;
+   header->chunk_ = chunk_;
+   ++allocationCount_;
+   return header;
+}
+
+void 
+ValueArena::retireChunk()
+{
+   if ( !chunk_ )
+      return;
+   if ( atomicAdd( &chunk_->liveCount_, allocationCount_ ) == 0 )
+      free( chunk_ );
+   chunk_ = 0;
+   next_ = 0;
+   end_ = 0;
+   allocationCount_ = 0;
+}
+
+
+NoValueArena::NoValueArena()
+   : suspended_( currentValueArena() )
+{
+   setCurrentValueArena( 0 );
+}
+
+NoValueArena::~NoValueArena()
+{
+   setCurrentValueArena( suspended_ );
+}
+
+
 ValueAllocator::~ValueAllocator()
 {
 }
@@ -82,7 +284,7 @@ public:
 
       if ( length == unknown )
          length = (unsigned int)strlen(value);
-      char *newString = static_cast<char *>( malloc( length + 1 ) );
+      char *newString = static_cast<char *>( ValueArena::allocate( length + 1 ) );
       memcpy( newString, value, length );
       newString[length] = 0;
       return newString;
@@ -90,8 +292,7 @@ public:
 
    virtual void releaseStringValue( char *value )
    {
-      if ( value )
-         free( value );
+      ValueArena::release( value );
    }
 };
 
@@ -102,6 +303,33 @@ static ValueAllocator *&valueAllocator()
    return valueAllocator;
 }
 
+// Objects and arrays are allocated like their nodes.
+static Value::ObjectValues *newObjectValues()
+{
+   return new ( ValueArena::allocate( sizeof(Value::ObjectValues) ) ) Value::ObjectValues();
+}
+
+static Value::ObjectValues *newObjectValues( const Value::ObjectValues &other )
+{
+   void *block = ValueArena::allocate( sizeof(Value::ObjectValues) );
+   try
+   {
+      return new ( block ) Value::ObjectValues( other );
+   }
+   catch ( ... )
+   {
+      ValueArena::release( block );
+      throw;
+   }
+}
+
+static void deleteObjectValues( Value::ObjectValues *map )
+{
+   typedef Value::ObjectValues ObjectValues;
+   map->~ObjectValues();
+   ValueArena::release( map );
+}
+
 static struct DummyValueAllocatorInitializer {
    DummyValueAllocatorInitializer() 
    {
@@ -290,7 +518,7 @@ Value::Value( ValueType type )
 #ifndef JSON_VALUE_USE_INTERNAL_MAP
    case arrayValue:
    case objectValue:
-      value_.map_ = new ObjectValues();
+      value_.map_ = newObjectValues();
       break;
 #else
    case arrayValue:
@@ -443,7 +671,7 @@ Value::Value( const Value &other )
 #ifndef JSON_VALUE_USE_INTERNAL_MAP
    case arrayValue:
    case objectValue:
-      value_.map_ = new ObjectValues( *other.value_.map_ );
+      value_.map_ = newObjectValues( *other.value_.map_ );
       break;
 #else
    case arrayValue:
@@ -486,7 +714,7 @@ Value::~Value()
 #ifndef JSON_VALUE_USE_INTERNAL_MAP
    case arrayValue:
    case objectValue:
-      delete value_.map_;
+      deleteObjectValues( value_.map_ );
       break;
 #else
    case arrayValue:
@@ -23,6 +23,10 @@
 #else
 #define _XOPEN_SOURCE 600 // For flockfile() on Linux
 #define _LARGEFILE_SOURCE // Enable 64-bit file offsets
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define _GNU_SOURCE // For accept4() on Linux
+#define USE_EPOLL   // Wait for sockets with epoll rather than select()
+#endif
 #ifndef __STDC_FORMAT_MACROS
 #define __STDC_FORMAT_MACROS // <inttypes.h> wants this for C++
 #endif
@@ -174,7 +178,11 @@ typedef struct DIR {
 #else    // UNIX  specific
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/select.h>
+#if defined(USE_EPOLL)
+#include <sys/epoll.h>
+#endif
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
@@ -401,16 +409,30 @@ struct socket {
   struct usa rsa;       // Remote socket address
   int is_ssl;           // Is socket SSL-ed
   int is_proxy;
+  unsigned long queued_ms; // When an accepted socket was put in the queue
+};
+
+// Keep-alive connection with no pending request. It is watched by the
+// master thread, with epoll or select(), instead of occupying a worker
+// thread.
+struct idle_socket {
+  struct idle_socket *prev;  // Linkage, oldest first
+  struct idle_socket *next;
+  struct socket client;      // The connection
+  unsigned long idle_ms;     // When the connection became idle
 };
 
+static int add_idle_socket(struct mg_context *ctx, const struct socket *sp);
+static int get_buffered_len(const struct mg_connection *conn);
+
 enum {
   CGI_EXTENSIONS, CGI_ENVIRONMENT, PUT_DELETE_PASSWORDS_FILE, CGI_INTERPRETER,
   PROTECT_URI, AUTHENTICATION_DOMAIN, SSI_EXTENSIONS, ACCESS_LOG_FILE,
   SSL_CHAIN_FILE, ENABLE_DIRECTORY_LISTING, ERROR_LOG_FILE,
   GLOBAL_PASSWORDS_FILE, INDEX_FILES,
-  ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST, MAX_REQUEST_SIZE,
+  ENABLE_KEEP_ALIVE, KEEP_ALIVE_TIMEOUT, ACCESS_CONTROL_LIST, MAX_REQUEST_SIZE,
   EXTRA_MIME_TYPES, LISTENING_PORTS,
-  DOCUMENT_ROOT, SSL_CERTIFICATE, NUM_THREADS, RUN_AS_USER,
+  DOCUMENT_ROOT, SSL_CERTIFICATE, NUM_THREADS, QUEUE_SIZE, RUN_AS_USER,
   NUM_OPTIONS
 };
 
@@ -429,6 +451,7 @@ static const char *config_options[] = {
   "g", "global_passwords_file", NULL,
   "i", "index_files", "index.html,index.htm,index.cgi",
   "k", "enable_keep_alive", "no",
+  "K", "keep_alive_timeout_ms", "0",
   "l", "access_control_list", NULL,
   "M", "max_request_size", "16384",
   "m", "extra_mime_types", NULL,
@@ -436,6 +459,7 @@ static const char *config_options[] = {
   "r", "document_root",  ".",
   "s", "ssl_certificate", NULL,
   "t", "num_threads", "10",
+  "q", "queue_size", "20",
   "u", "run_as_user", NULL,
   NULL
 };
@@ -454,11 +478,27 @@ struct mg_context {
   pthread_mutex_t mutex;     // Protects (max|num)_threads
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
 
-  struct socket queue[20];   // Accepted sockets
+  struct socket *queue;      // Accepted sockets
+  int queue_size;            // Number of elements in the queue array
   volatile int sq_head;      // Head of the socket queue
   volatile int sq_tail;      // Tail of the socket queue
   pthread_cond_t sq_full;    // Singaled when socket is produced
   pthread_cond_t sq_empty;   // Signaled when socket is consumed
+
+  // Socket queue statistics, protected by the mutex
+  long long num_dequeued;    // Sockets taken from the queue by workers
+  long long num_rejected;    // Sockets refused because the queue was full
+  long long total_wait_ms;   // Time dequeued sockets spent in the queue
+  long long max_wait_ms;     // Longest time a socket spent in the queue
+
+#if defined(USE_EPOLL)
+  int epoll_fd;              // Listening and idle sockets, or -1 for select()
+#endif // USE_EPOLL
+  SOCKET wake_sock;          // Wakes select() to watch new idle sockets
+  int max_idle;              // Most idle sockets select() can watch
+  int num_idle;              // Idle connections, protected by the mutex
+  struct idle_socket *idle_head; // Idle connections, protected by the mutex
+  struct idle_socket *idle_tail;
 };
 
 struct mg_connection {
@@ -471,10 +511,19 @@ struct mg_connection {
   int64_t num_bytes_sent;     // Total bytes sent to client
   int64_t content_len;        // Content-Length header value
   int64_t consumed_content;   // How many bytes of content is already read
+  int64_t buffered_content;   // consumed_content at buf + request_len
   char *buf;                  // Buffer for received data
   int buf_size;               // Buffer size
   int request_len;            // Size of the request + headers in a buffer
   int data_len;               // Total size of data in a buffer
+  int is_chunked;             // Body uses chunked transfer encoding
+  int is_chunked_body_done;   // Last chunk of a chunked body has been read
+  int64_t chunk_remaining;    // Bytes left to read in the current chunk
+  int must_close;             // Close the connection after this request
+  int is_idle;                // Kept-alive, waiting for the next request
+  int is_suspended;           // Handler will finish the request later
+  int is_released;            // Worker thread has let go of the connection
+  int is_resume_pending;      // mg_resume() called before worker let go
 };
 
 const char **mg_get_valid_option_names(void) {
@@ -786,9 +835,57 @@ static int match_extension(const char *path, const char *ext_list) {
 static int should_keep_alive(const struct mg_connection *conn) {
   const char *http_version = conn->request_info.http_version;
   const char *header = mg_get_header(conn, "Connection");
-  return (!mg_strcasecmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes") &&
-          (header == NULL && http_version && !strcmp(http_version, "1.1"))) ||
-          (header != NULL && !mg_strcasecmp(header, "keep-alive"));
+  return !conn->must_close &&
+         !mg_strcasecmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes") &&
+         ((header == NULL && http_version && !strcmp(http_version, "1.1")) ||
+          (header != NULL && !mg_strcasecmp(header, "keep-alive")));
+}
+
+int mg_should_keep_alive(const struct mg_connection *conn) {
+  return should_keep_alive(conn);
+}
+
+void mg_set_must_close(struct mg_connection *conn) {
+  conn->must_close = 1;
+}
+
+int mg_suspend(struct mg_connection *conn) {
+  // Only a plain connection with nothing of the request left unread, and
+  // nothing pipelined behind it, can be finished on another thread.
+  if (conn->ssl != NULL || conn->peer != NULL || conn->client.is_proxy ||
+      conn->ctx->stop_flag != 0 ||
+      (conn->is_chunked ? !conn->is_chunked_body_done :
+                          conn->consumed_content < conn->content_len) ||
+      get_buffered_len(conn) > 0) {
+    return 0;
+  }
+  conn->is_suspended = 1;
+  conn->is_released = 0;
+  conn->is_resume_pending = 0;
+  return 1;
+}
+
+int mg_client_disconnected(struct mg_connection *conn) {
+  char c;
+  int n;
+#if defined(_WIN32)
+  fd_set read_set;
+  struct timeval tv;
+
+  FD_ZERO(&read_set);
+  FD_SET(conn->client.sock, &read_set);
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  if (select(0, &read_set, NULL, NULL, &tv) <= 0) {
+    return 0;
+  }
+  n = recv(conn->client.sock, &c, 1, MSG_PEEK);
+  return n == 0 || (n < 0 && WSAGetLastError() != WSAEWOULDBLOCK);
+#else
+  n = recv(conn->client.sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n == 0 ||
+      (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+#endif // _WIN32
 }
 
 static const char *suggest_connection_header(const struct mg_connection *conn) {
@@ -1314,6 +1411,32 @@ static int set_non_blocking_mode(SOCKET sock) {
 }
 #endif // _WIN32
 
+// Limit the time a blocking receive on the socket may wait for data.
+// A timeout of zero makes receives wait forever.
+static void set_receive_timeout(SOCKET sock, int milliseconds) {
+#if defined(_WIN32)
+  DWORD timeout = (DWORD) milliseconds;
+#else
+  struct timeval timeout;
+  timeout.tv_sec = milliseconds / 1000;
+  timeout.tv_usec = (milliseconds % 1000) * 1000;
+#endif // _WIN32
+  (void) setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *) &timeout,
+                    sizeof(timeout));
+}
+
+// Return a millisecond clock reading for measuring short intervals. The
+// value wraps around, so only the difference of two readings is meaningful.
+static unsigned long get_tick_count_ms(void) {
+#if defined(_WIN32)
+  return (unsigned long) GetTickCount();
+#else
+  struct timeval tv;
+  (void) gettimeofday(&tv, NULL);
+  return (unsigned long) tv.tv_sec * 1000 + (unsigned long) tv.tv_usec / 1000;
+#endif // _WIN32
+}
+
 // Write data to the IO channel - opened file descriptor, socket or SSL
 // descriptor. Return number of bytes written.
 static int64_t push(FILE *fp, SOCKET sock, SSL *ssl, const char *buf,
@@ -1367,15 +1490,182 @@ static int pull(FILE *fp, SOCKET sock, SSL *ssl, char *buf, int len) {
   return nread;
 }
 
-int mg_read(struct mg_connection *conn, void *buf, size_t len) {
-  int n, buffered_len, nread;
+// Return number of request body bytes buffered after the request headers
+// that have not been read yet. They end at conn->buf + conn->data_len.
+static int get_buffered_len(const struct mg_connection *conn) {
+  int64_t buffered_len = conn->data_len - conn->request_len -
+      (conn->consumed_content - conn->buffered_content);
+  return buffered_len > 0 ? (int) buffered_len : 0;
+}
+
+// Move the unread buffered body bytes right behind the request headers, and
+// read more from the socket after them. Return number of bytes read, 0 if
+// there is no room left in the buffer or the connection failed.
+static int fill_body_buffer(struct mg_connection *conn) {
+  int n, buffered_len;
+
+  buffered_len = get_buffered_len(conn);
+  memmove(conn->buf + conn->request_len,
+          conn->buf + conn->data_len - buffered_len, (size_t) buffered_len);
+  conn->data_len = conn->request_len + buffered_len;
+  conn->buffered_content = conn->consumed_content;
+
+  if (conn->data_len >= conn->buf_size) {
+    return 0;
+  }
+  n = pull(NULL, conn->client.sock, conn->ssl, conn->buf + conn->data_len,
+           conn->buf_size - conn->data_len);
+  if (n <= 0) {
+    conn->must_close = 1;
+    return 0;
+  }
+  conn->data_len += n;
+  return n;
+}
+
+// Read request body bytes as they were sent by the client: first the data
+// that was buffered together with the request headers, then from the
+// socket. Return number of bytes read, which is less than len only if the
+// connection failed.
+static int read_raw_body(struct mg_connection *conn, char *buf, int len) {
   const char *buffered;
+  int n, buffered_len, nread;
+
+  nread = 0;
+
+  // How many bytes of data we have buffered in the request buffer?
+  buffered_len = get_buffered_len(conn);
+
+  // Return buffered data back if we haven't done that yet.
+  if (buffered_len > 0) {
+    buffered = conn->buf + conn->data_len - buffered_len;
+    if (len < buffered_len) {
+      buffered_len = len;
+    }
+    memcpy(buf, buffered, (size_t)buffered_len);
+    len -= buffered_len;
+    buf += buffered_len;
+    conn->consumed_content += buffered_len;
+    nread = buffered_len;
+  }
+
+  // We have returned all buffered data. Read new data from the remote socket.
+  while (len > 0) {
+    n = pull(NULL, conn->client.sock, conn->ssl, buf, len);
+    if (n <= 0) {
+      conn->must_close = 1;
+      break;
+    }
+    buf += n;
+    conn->consumed_content += n;
+    nread += n;
+    len -= n;
+  }
+  return nread;
+}
+
+// Read one line of chunked encoding framing, without the trailing CRLF.
+// The line is taken from the request buffer, which is refilled from the
+// socket in blocks, like read_request() does for the headers.
+// Return 1 on success, 0 if the line is too long or the connection failed.
+static int read_chunk_line(struct mg_connection *conn, char *line, int size) {
+  const char *data, *eol;
+  int len, n, buffered_len;
+
+  len = 0;
+  for (;;) {
+    if ((buffered_len = get_buffered_len(conn)) == 0 &&
+        (buffered_len = fill_body_buffer(conn)) == 0) {
+      return 0;
+    }
+    data = conn->buf + conn->data_len - buffered_len;
+    eol = (const char *) memchr(data, '\n', (size_t) buffered_len);
+    n = eol == NULL ? buffered_len : (int) (eol - data);
+    if (len + n >= size) {
+      return 0;
+    }
+    memcpy(line + len, data, (size_t) n);
+    len += n;
+    conn->consumed_content += n;
+    if (eol != NULL) {
+      conn->consumed_content++;
+      if (len > 0 && line[len - 1] == '\r') {
+        len--;
+      }
+      line[len] = '\0';
+      return 1;
+    }
+  }
+}
+
+// Read and decode a body sent with "Transfer-Encoding: chunked".
+// Return number of bytes read, 0 after the last chunk, or -1 if the
+// framing is malformed or the connection failed.
+static int read_chunked_body(struct mg_connection *conn, char *buf,
+                             size_t len) {
+  char line[BUFSIZ], *end;
+  int64_t chunk_len;
+  int n, to_read, nread, is_line_read;
+
+  nread = 0;
+  while (len > 0 && !conn->is_chunked_body_done) {
+    if (conn->chunk_remaining == 0) {
+      // Chunk header: hex chunk size, optionally followed by extensions.
+      if (!read_chunk_line(conn, line, sizeof(line))) {
+        break;
+      }
+      chunk_len = strtoll(line, &end, 16);
+      if (end == line || chunk_len < 0) {
+        break;
+      }
+      if (chunk_len == 0) {
+        // Last chunk. Skip the trailer headers up to the empty line.
+        while ((is_line_read = read_chunk_line(conn, line, sizeof(line))) &&
+               line[0] != '\0') {
+        }
+        if (!is_line_read) {
+          break;
+        }
+        conn->is_chunked_body_done = 1;
+        return nread;
+      }
+      conn->chunk_remaining = chunk_len;
+    }
+
+    to_read = conn->chunk_remaining < (int64_t) len ?
+        (int) conn->chunk_remaining : (int) len;
+    n = read_raw_body(conn, buf, to_read);
+    nread += n;
+    if (n < to_read) {
+      break;
+    }
+    buf += n;
+    len -= n;
+    conn->chunk_remaining -= n;
+
+    // Every chunk's data is followed by CRLF.
+    if (conn->chunk_remaining == 0 &&
+        (!read_chunk_line(conn, line, sizeof(line)) || line[0] != '\0')) {
+      break;
+    }
+  }
+
+  if (len > 0 && !conn->is_chunked_body_done) {
+    conn->must_close = 1;
+    return -1;
+  }
+  return nread;
+}
+
+int mg_read(struct mg_connection *conn, void *buf, size_t len) {
+  if (conn->is_chunked) {
+    return read_chunked_body(conn, (char *) buf, len);
+  }
 
   assert((conn->content_len == -1 && conn->consumed_content == 0) ||
          conn->consumed_content <= conn->content_len);
   DEBUG_TRACE(("%p %zu %lld %lld", buf, len,
                conn->content_len, conn->consumed_content));
-  nread = 0;
   if (conn->consumed_content < conn->content_len) {
 
     // Adjust number of bytes to read.
@@ -1383,43 +1673,89 @@ int mg_read(struct mg_connection *conn, void *buf, size_t len) {
     if (to_read < (int64_t) len) {
       len = (int) to_read;
     }
+    return read_raw_body(conn, (char *) buf, (int) len);
+  }
+  return 0;
+}
 
-    // How many bytes of data we have buffered in the request buffer?
-    buffered = conn->buf + conn->request_len + conn->consumed_content;
-    buffered_len = conn->data_len - conn->request_len;
-    assert(buffered_len >= 0);
+int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
+  return (int) push(NULL, conn->client.sock, conn->ssl,
+      (const char *) buf, (int64_t) len);
+}
 
-    // Return buffered data back if we haven't done that yet.
-    if (conn->consumed_content < (int64_t) buffered_len) {
-      buffered_len -= (int) conn->consumed_content;
-      if (len < (size_t) buffered_len) {
-        buffered_len = len;
-      }
-      memcpy(buf, buffered, (size_t)buffered_len);
-      len -= buffered_len;
-      buf = (char *) buf + buffered_len;
-      conn->consumed_content += buffered_len;
-      nread = buffered_len;
+// Maximum number of buffers sent with one gather write by mg_write_buffers().
+#define MAX_WRITE_BUFFERS 16
+
+int mg_write_buffers(struct mg_connection *conn,
+                     const struct mg_buffer *buffers, int count) {
+#if defined(_WIN32)
+  WSABUF vec[MAX_WRITE_BUFFERS];
+  DWORD n;
+#else
+  struct iovec vec[MAX_WRITE_BUFFERS];
+  ssize_t n;
+#endif // _WIN32
+  int64_t sent;
+  int i, first;
+
+  sent = 0;
+  if (conn->ssl != NULL || count > MAX_WRITE_BUFFERS) {
+    // SSL has no gather write; send the buffers one at a time.
+    for (i = 0; i < count; i++) {
+      sent += push(NULL, conn->client.sock, conn->ssl,
+                   (const char *) buffers[i].data, (int64_t) buffers[i].len);
     }
+    return (int) sent;
+  }
 
-    // We have returned all buffered data. Read new data from the remote socket.
-    while (len > 0) {
-      n = pull(NULL, conn->client.sock, conn->ssl, (char *) buf, (int) len);
-      if (n <= 0) {
+  for (i = 0; i < count; i++) {
+#if defined(_WIN32)
+    vec[i].buf = (char *) buffers[i].data;
+    vec[i].len = (ULONG) buffers[i].len;
+#else
+    vec[i].iov_base = (void *) buffers[i].data;
+    vec[i].iov_len = buffers[i].len;
+#endif // _WIN32
+  }
+
+  first = 0;
+  while (first < count) {
+#if defined(_WIN32)
+    if (WSASend(conn->client.sock, vec + first, (DWORD) (count - first), &n,
+                0, NULL, NULL) != 0) {
+      break;
+    }
+#else
+    n = writev(conn->client.sock, vec + first, count - first);
+    if (n < 0) {
+      break;
+    }
+#endif // _WIN32
+    sent += n;
+
+    // Skip the buffers that were sent completely, and advance into the
+    // one that was sent partially, if any.
+    while (first < count) {
+#if defined(_WIN32)
+      if ((size_t) n < vec[first].len) {
+        vec[first].buf += n;
+        vec[first].len -= (ULONG) n;
         break;
       }
-      buf = (char *) buf + n;
-      conn->consumed_content += n;
-      nread += n;
-      len -= n;
+      n -= vec[first].len;
+#else
+      if ((size_t) n < vec[first].iov_len) {
+        vec[first].iov_base = (char *) vec[first].iov_base + n;
+        vec[first].iov_len -= (size_t) n;
+        break;
+      }
+      n -= (ssize_t) vec[first].iov_len;
+#endif // _WIN32
+      first++;
     }
   }
-  return nread;
-}
 
-int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
-  return (int) push(NULL, conn->client.sock, conn->ssl,
-      (const char *) buf, (int64_t) len);
+  return (int) sent;
 }
 
 int mg_printf(struct mg_connection *conn, const char *fmt, ...) {
@@ -3790,8 +4126,11 @@ static void reset_per_request_attributes(struct mg_connection *conn) {
   ri->status_code = -1;
 
   conn->num_bytes_sent = conn->consumed_content = 0;
+  conn->buffered_content = 0;
   conn->content_len = -1;
-  conn->request_len = conn->data_len = 0;
+  conn->request_len = 0;
+  conn->is_chunked = conn->is_chunked_body_done = 0;
+  conn->chunk_remaining = 0;
 }
 
 static void close_socket_gracefully(SOCKET sock) {
@@ -3836,20 +4175,24 @@ static void close_connection(struct mg_connection *conn) {
 }
 
 static void discard_current_request_from_buffer(struct mg_connection *conn) {
-  char *buffered;
+  char buf[BUFSIZ];
   int buffered_len, body_len;
 
-  buffered = conn->buf + conn->request_len;
+  // If the handler did not read the whole body, read and drop the rest of
+  // it, so that the next request on a kept-alive connection starts at the
+  // right place. A connection that is going to be closed is not drained.
+  while (!conn->must_close &&
+         (conn->is_chunked ? !conn->is_chunked_body_done :
+                             conn->consumed_content < conn->content_len) &&
+         mg_read(conn, buf, sizeof(buf)) > 0) {
+  }
+
   buffered_len = conn->data_len - conn->request_len;
   assert(buffered_len >= 0);
 
-  if (conn->content_len == -1) {
-    body_len = 0;
-  } else if (conn->content_len < (int64_t) buffered_len) {
-    body_len = (int) conn->content_len;
-  } else {
-    body_len = buffered_len;
-  }
+  // Drop the part of the body that was in the buffer. Whatever is left
+  // unread was pipelined behind this request.
+  body_len = buffered_len - get_buffered_len(conn);
 
   conn->data_len -= conn->request_len + body_len;
   memmove(conn->buf, conn->buf + conn->request_len + body_len,
@@ -3930,17 +4273,49 @@ static int is_valid_uri(const char *uri) {
   return (uri[0] == '/' || (uri[0] == '*' && uri[1] == '\0'));
 }
 
-static void process_new_connection(struct mg_connection *conn) {
+// Called by the worker thread once the handler that suspended a connection
+// has returned. Return 1 if the connection was already resumed, in which
+// case the worker thread carries on with it, or 0 if it now belongs to
+// whichever thread calls mg_resume().
+static int release_suspended_connection(struct mg_connection *conn) {
+  int resumed;
+
+  (void) pthread_mutex_lock(&conn->ctx->mutex);
+  resumed = conn->is_resume_pending;
+  if (resumed) {
+    conn->is_suspended = 0;
+    conn->is_resume_pending = 0;
+  } else {
+    conn->is_released = 1;
+  }
+  (void) pthread_mutex_unlock(&conn->ctx->mutex);
+
+  return resumed;
+}
+
+// Serve requests on a connection. Return 1 if a request was suspended and
+// the connection handed off, in which case the caller must not touch it.
+static int process_new_connection(struct mg_connection *conn) {
   struct mg_request_info *ri = &conn->request_info;
-  int keep_alive_enabled;
-  const char *cl;
+  int keep_alive_enabled, keep_alive_timeout, keep_alive;
+  const char *cl, *te;
 
   keep_alive_enabled = !strcmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes");
+  keep_alive_timeout = atoi(conn->ctx->config[KEEP_ALIVE_TIMEOUT]);
 
+  // Idle clients must not hold on to a worker thread forever.
+  if (keep_alive_enabled && keep_alive_timeout > 0) {
+    set_receive_timeout(conn->client.sock, keep_alive_timeout);
+  }
+
+  conn->data_len = 0;
+  conn->must_close = 0;
   do {
     reset_per_request_attributes(conn);
+    keep_alive = 0;
 
-    // If next request is not pipelined, read it in
+    // If next request is not pipelined, read it in. Pipelined requests
+    // are already in the buffer and are served in the order received.
     if ((conn->request_len = get_request_len(conn->buf, conn->data_len)) == 0) {
       conn->request_len = read_request(NULL, conn->client.sock, conn->ssl,
           conn->buf, conn->buf_size, &conn->data_len);
@@ -3948,9 +4323,9 @@ static void process_new_connection(struct mg_connection *conn) {
     assert(conn->data_len >= conn->request_len);
     if (conn->request_len == 0 && conn->data_len == conn->buf_size) {
       send_http_error(conn, 413, "Request Too Large", "");
-      return;
+      return 0;
     } if (conn->request_len <= 0) {
-      return;  // Remote end closed the connection
+      return 0;  // Remote end closed the connection
     }
 
     // Nul-terminate the request cause parse_http_request() uses sscanf
@@ -3967,24 +4342,49 @@ static void process_new_connection(struct mg_connection *conn) {
       log_access(conn);
     } else {
       // Request is valid, handle it
+      // A chunked body takes precedence over Content-Length (RFC 2616 4.4).
+      te = get_header(ri, "Transfer-Encoding");
+      conn->is_chunked = te != NULL && !mg_strcasecmp(te, "chunked");
       cl = get_header(ri, "Content-Length");
-      conn->content_len = cl == NULL ? -1 : strtoll(cl, NULL, 10);
+      conn->content_len = cl == NULL || conn->is_chunked ?
+          -1 : strtoll(cl, NULL, 10);
       conn->birth_time = time(NULL);
       if (conn->client.is_proxy) {
         handle_proxy_request(conn);
       } else {
         handle_request(conn);
       }
+      if (conn->is_suspended && !release_suspended_connection(conn)) {
+        return 1;
+      }
       log_access(conn);
+      // Decide before the request is discarded from the buffer, because
+      // the request headers point into it.
+      keep_alive = should_keep_alive(conn);
       discard_current_request_from_buffer(conn);
+      if (conn->must_close) {
+        keep_alive = 0;
+      }
+    }
+    // Rather than wait here for the next request on a kept-alive connection,
+    // hand it back to the master thread until there is something to read.
+    // If it cannot take the connection, keep waiting here as before.
+    if (keep_alive_enabled && keep_alive && conn->data_len == 0 &&
+        conn->ssl == NULL && conn->peer == NULL &&
+        add_idle_socket(conn->ctx, &conn->client)) {
+      conn->is_idle = 1;
+      break;
     }
     // conn->peer is not NULL only for SSL-ed proxy connections
   } while (conn->ctx->stop_flag == 0 &&
-           (conn->peer || (keep_alive_enabled && should_keep_alive(conn))));
+           (conn->peer || (keep_alive_enabled && keep_alive)));
+  return 0;
 }
 
 // Worker threads take accepted socket from the queue
 static int consume_socket(struct mg_context *ctx, struct socket *sp) {
+  unsigned long wait_ms;
+
   (void) pthread_mutex_lock(&ctx->mutex);
   DEBUG_TRACE(("going idle"));
 
@@ -3996,14 +4396,21 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp) {
   // If we're stopping, sq_head may be equal to sq_tail.
   if (ctx->sq_head > ctx->sq_tail) {
     // Copy socket from the queue and increment tail
-    *sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
+    *sp = ctx->queue[ctx->sq_tail % ctx->queue_size];
     ctx->sq_tail++;
     DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
 
+    wait_ms = get_tick_count_ms() - sp->queued_ms;
+    ctx->num_dequeued++;
+    ctx->total_wait_ms += wait_ms;
+    if ((long long) wait_ms > ctx->max_wait_ms) {
+      ctx->max_wait_ms = wait_ms;
+    }
+
     // Wrap pointers if needed
-    while (ctx->sq_tail > (int) ARRAY_SIZE(ctx->queue)) {
-      ctx->sq_tail -= ARRAY_SIZE(ctx->queue);
-      ctx->sq_head -= ARRAY_SIZE(ctx->queue);
+    while (ctx->sq_tail > ctx->queue_size) {
+      ctx->sq_tail -= ctx->queue_size;
+      ctx->sq_head -= ctx->queue_size;
     }
   }
 
@@ -4013,13 +4420,22 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp) {
   return !ctx->stop_flag;
 }
 
-static void worker_thread(struct mg_context *ctx) {
+static struct mg_connection *alloc_connection(struct mg_context *ctx) {
   struct mg_connection *conn;
   int buf_size = atoi(ctx->config[MAX_REQUEST_SIZE]);
 
   conn = (struct mg_connection *) calloc(1, sizeof(*conn) + buf_size);
-  conn->buf_size = buf_size;
-  conn->buf = (char *) (conn + 1);
+  if (conn != NULL) {
+    conn->buf_size = buf_size;
+    conn->buf = (char *) (conn + 1);
+  }
+  return conn;
+}
+
+static void worker_thread(struct mg_context *ctx) {
+  struct mg_connection *conn;
+
+  conn = alloc_connection(ctx);
   assert(conn != NULL);
 
   // Call consume_socket() even when ctx->stop_flag > 0, to let it signal
@@ -4039,9 +4455,20 @@ static void worker_thread(struct mg_context *ctx) {
 
     if (!conn->client.is_ssl ||
         (conn->client.is_ssl && sslize(conn, SSL_accept))) {
-      process_new_connection(conn);
+      if (process_new_connection(conn)) {
+        // The connection now belongs to mg_resume(); carry on with a new one.
+        if ((conn = alloc_connection(ctx)) == NULL) {
+          break;
+        }
+        continue;
+      }
     }
 
+    // An idle connection now belongs to the master thread.
+    if (conn->is_idle) {
+      conn->is_idle = 0;
+      continue;
+    }
     close_connection(conn);
   }
   free(conn);
@@ -4056,57 +4483,382 @@ static void worker_thread(struct mg_context *ctx) {
   DEBUG_TRACE(("exiting"));
 }
 
-// Master thread adds accepted socket to a queue
-static void produce_socket(struct mg_context *ctx, const struct socket *sp) {
-  (void) pthread_mutex_lock(&ctx->mutex);
+// Master thread adds accepted socket to a queue. If the queue is full, the
+// client is told that the server is busy instead of waiting for a worker
+// thread to free up. Return 1 if the socket was queued, 0 if refused.
+static int produce_socket(struct mg_context *ctx, struct socket *sp) {
+  int queued;
 
-  // If the queue is full, wait
-  while (ctx->stop_flag == 0 &&
-         ctx->sq_head - ctx->sq_tail >= (int) ARRAY_SIZE(ctx->queue)) {
-    (void) pthread_cond_wait(&ctx->sq_empty, &ctx->mutex);
-  }
+  (void) pthread_mutex_lock(&ctx->mutex);
 
-  if (ctx->sq_head - ctx->sq_tail < (int) ARRAY_SIZE(ctx->queue)) {
+  queued = 0;
+  if (ctx->stop_flag == 0 &&
+      ctx->sq_head - ctx->sq_tail < ctx->queue_size) {
     // Copy socket to the queue and increment head
-    ctx->queue[ctx->sq_head % ARRAY_SIZE(ctx->queue)] = *sp;
+    sp->queued_ms = get_tick_count_ms();
+    ctx->queue[ctx->sq_head % ctx->queue_size] = *sp;
     ctx->sq_head++;
+    queued = 1;
     DEBUG_TRACE(("queued socket %d", sp->sock));
+  } else {
+    ctx->num_rejected++;
   }
 
   (void) pthread_cond_signal(&ctx->sq_full);
   (void) pthread_mutex_unlock(&ctx->mutex);
+
+  return queued;
+}
+
+void mg_resume(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  int keep_alive;
+
+  // If the handler that suspended the request has not returned yet, leave
+  // the connection to its worker thread, which finishes it as usual.
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (!conn->is_released) {
+    conn->is_resume_pending = 1;
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    return;
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  log_access(conn);
+  keep_alive = should_keep_alive(conn);
+  discard_current_request_from_buffer(conn);
+  keep_alive = keep_alive && !conn->must_close && ctx->stop_flag == 0 &&
+      conn->data_len == 0;
+
+  // A kept-alive connection goes back to waiting for its next request,
+  // exactly as if a worker thread had finished it.
+  if (keep_alive && add_idle_socket(ctx, &conn->client)) {
+    free(conn);
+    return;
+  }
+  if (!keep_alive || !produce_socket(ctx, &conn->client)) {
+    close_connection(conn);
+  }
+  free(conn);
+}
+
+// Tell a client that the server is too busy, and close the connection.
+static void reject_busy_socket(const struct socket *sp) {
+  static const char busy_response[] =
+      "HTTP/1.1 503 Service Unavailable\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n\r\n";
+
+  // Plain sockets get a short reply; SSL cannot be set up here without
+  // blocking the master thread.
+  if (!sp->is_ssl) {
+    (void) push(NULL, sp->sock, NULL, busy_response,
+                (int64_t) (sizeof(busy_response) - 1));
+  }
+  close_socket_gracefully(sp->sock);
 }
 
-static void accept_new_connection(const struct socket *listener,
-                                  struct mg_context *ctx) {
+// Accept one connection on the listening socket. Return 1 if a connection
+// was accepted, 0 if there was none waiting.
+static int accept_new_connection(const struct socket *listener,
+                                 struct mg_context *ctx) {
   struct socket accepted;
   int allowed;
 
   accepted.rsa.len = sizeof(accepted.rsa.u.sin);
   accepted.lsa = listener->lsa;
+#if defined(USE_EPOLL)
+  accepted.sock = accept4(listener->sock, &accepted.rsa.u.sa,
+                          &accepted.rsa.len, SOCK_CLOEXEC);
+#else
   accepted.sock = accept(listener->sock, &accepted.rsa.u.sa, &accepted.rsa.len);
-  if (accepted.sock != INVALID_SOCKET) {
-    allowed = check_acl(ctx, &accepted.rsa);
-    if (allowed) {
-      // Put accepted socket structure into the queue
-      DEBUG_TRACE(("accepted socket %d", accepted.sock));
-      accepted.is_ssl = listener->is_ssl;
-      accepted.is_proxy = listener->is_proxy;
-      produce_socket(ctx, &accepted);
+#endif // USE_EPOLL
+  if (accepted.sock == INVALID_SOCKET) {
+    return 0;
+  }
+
+  allowed = check_acl(ctx, &accepted.rsa);
+  if (allowed) {
+    // Put accepted socket structure into the queue
+    DEBUG_TRACE(("accepted socket %d", accepted.sock));
+    accepted.is_ssl = listener->is_ssl;
+    accepted.is_proxy = listener->is_proxy;
+    if (!produce_socket(ctx, &accepted)) {
+      reject_busy_socket(&accepted);
+    }
+  } else {
+    cry(fc(ctx), "%s: %s is not allowed to connect",
+        __func__, inet_ntoa(accepted.rsa.u.sin.sin_addr));
+    (void) closesocket(accepted.sock);
+  }
+  return 1;
+}
+
+#if defined(USE_EPOLL)
+// Maximum number of events handled per epoll_wait() call.
+#define MAX_EPOLL_EVENTS 64
+#endif // USE_EPOLL
+
+static int uses_epoll(const struct mg_context *ctx) {
+#if defined(USE_EPOLL)
+  return ctx->epoll_fd != -1;
+#else
+  (void) ctx;
+  return 0;
+#endif // USE_EPOLL
+}
+
+static void unlink_idle_socket(struct mg_context *ctx,
+                               struct idle_socket *idle) {
+  if (idle->prev != NULL) {
+    idle->prev->next = idle->next;
+  } else {
+    ctx->idle_head = idle->next;
+  }
+  if (idle->next != NULL) {
+    idle->next->prev = idle->prev;
+  } else {
+    ctx->idle_tail = idle->prev;
+  }
+  ctx->num_idle--;
+}
+
+// Start watching an idle connection. Called with the mutex held. Return 1
+// on success, 0 if the master thread cannot watch the connection.
+static int watch_idle_socket(struct mg_context *ctx,
+                             struct idle_socket *idle) {
+#if defined(USE_EPOLL)
+  struct epoll_event ev;
+
+  if (ctx->epoll_fd != -1) {
+    // Edge-triggered and one-shot: the master thread hears about the
+    // socket once, when the next request arrives or the client disconnects.
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    ev.data.ptr = idle;
+    return epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, idle->client.sock, &ev) == 0;
+  }
+#endif // USE_EPOLL
+
+  // select() watches a limited number of sockets, which on UNIX must also
+  // have descriptors below FD_SETSIZE. The master thread is woken up to
+  // add the socket to its read set.
+  if (ctx->wake_sock == INVALID_SOCKET || ctx->num_idle >= ctx->max_idle) {
+    return 0;
+  }
+#if !defined(_WIN32)
+  if (idle->client.sock >= FD_SETSIZE) {
+    return 0;
+  }
+#endif // !_WIN32
+  (void) send(ctx->wake_sock, "", 1, 0);
+  return 1;
+}
+
+// Called by a worker thread to hand a kept-alive connection with no
+// pending request back to the master thread, which queues it again once
+// the client sends more data. Return 1 on success, 0 if the connection
+// must stay with its worker thread.
+static int add_idle_socket(struct mg_context *ctx, const struct socket *sp) {
+  struct idle_socket *idle;
+  int added;
+
+  if ((idle = (struct idle_socket *) calloc(1, sizeof(*idle))) == NULL) {
+    return 0;
+  }
+  idle->client = *sp;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  added = ctx->stop_flag == 0 && watch_idle_socket(ctx, idle);
+  if (added) {
+    idle->idle_ms = get_tick_count_ms();
+    idle->prev = ctx->idle_tail;
+    if (ctx->idle_tail != NULL) {
+      ctx->idle_tail->next = idle;
     } else {
-      cry(fc(ctx), "%s: %s is not allowed to connect",
-          __func__, inet_ntoa(accepted.rsa.u.sin.sin_addr));
-      (void) closesocket(accepted.sock);
+      ctx->idle_head = idle;
     }
+    ctx->idle_tail = idle;
+    ctx->num_idle++;
   }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  if (!added) {
+    free(idle);
+  }
+  return added;
 }
 
+// Close idle connections that have been idle for at least timeout_ms, or
+// all of them if timeout_ms is negative.
+static void close_idle_sockets(struct mg_context *ctx, int timeout_ms) {
+  struct idle_socket *idle;
+  unsigned long now;
+
+  now = get_tick_count_ms();
+  (void) pthread_mutex_lock(&ctx->mutex);
+  while ((idle = ctx->idle_head) != NULL &&
+         (timeout_ms < 0 || now - idle->idle_ms >= (unsigned long) timeout_ms)) {
+    unlink_idle_socket(ctx, idle);
+#if defined(USE_EPOLL)
+    if (ctx->epoll_fd != -1) {
+      (void) epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, idle->client.sock, NULL);
+    }
+#endif // USE_EPOLL
+    close_socket_gracefully(idle->client.sock);
+    free(idle);
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+// Create a UDP socket connected to itself. A worker thread that adds an
+// idle connection sends a byte on it, which wakes up the master thread
+// waiting in select() to add the connection to its read set.
+static SOCKET create_wake_socket(void) {
+  struct usa sa;
+  SOCKET sock;
+
+  if ((sock = socket(PF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET) {
+    return INVALID_SOCKET;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.len = sizeof(sa.u.sin);
+  sa.u.sin.sin_family = AF_INET;
+  sa.u.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sa.u.sin.sin_port = 0;
+  if (bind(sock, &sa.u.sa, sa.len) != 0 ||
+      getsockname(sock, &sa.u.sa, &sa.len) != 0 ||
+      connect(sock, &sa.u.sa, sa.len) != 0) {
+    (void) closesocket(sock);
+    return INVALID_SOCKET;
+  }
+  set_close_on_exec(sock);
+  (void) set_non_blocking_mode(sock);
+  return sock;
+}
+
+// Add the idle connections to the read set of the master thread's select().
+static void add_idle_sockets_to_set(struct mg_context *ctx, fd_set *read_set,
+                                    int *max_fd) {
+  struct idle_socket *idle;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (idle = ctx->idle_head; idle != NULL; idle = idle->next) {
+    add_to_set(idle->client.sock, read_set, max_fd);
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+// Queue the idle connections that select() found readable for the worker
+// threads. Only the master thread removes idle connections, so those in
+// the read set are all still idle.
+static void resume_readable_idle_sockets(struct mg_context *ctx,
+                                         fd_set *read_set) {
+  struct idle_socket *idle, *next, *readable;
+  char buf[16];
+
+  // Read the wake-up bytes, if any.
+  if (FD_ISSET(ctx->wake_sock, read_set)) {
+    while (recv(ctx->wake_sock, buf, sizeof(buf), 0) > 0) {
+    }
+  }
+
+  readable = NULL;
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (idle = ctx->idle_head; idle != NULL; idle = next) {
+    next = idle->next;
+    if (FD_ISSET(idle->client.sock, read_set)) {
+      unlink_idle_socket(ctx, idle);
+      idle->next = readable;
+      readable = idle;
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  while ((idle = readable) != NULL) {
+    readable = idle->next;
+    if (!produce_socket(ctx, &idle->client)) {
+      reject_busy_socket(&idle->client);
+    }
+    free(idle);
+  }
+}
+
+#if defined(USE_EPOLL)
+// Called by the master thread when an idle connection becomes readable.
+static void resume_idle_socket(struct mg_context *ctx,
+                               struct idle_socket *idle) {
+  (void) pthread_mutex_lock(&ctx->mutex);
+  unlink_idle_socket(ctx, idle);
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  (void) epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, idle->client.sock, NULL);
+  if (!produce_socket(ctx, &idle->client)) {
+    reject_busy_socket(&idle->client);
+  }
+  free(idle);
+}
+
+static int is_listening_socket(const struct mg_context *ctx, const void *p) {
+  const struct socket *sp;
+
+  for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
+    if (sp == p) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Master thread event loop for Linux. Listening sockets are non-blocking
+// and edge-triggered, so each readiness event is drained with accept4()
+// until it would block. Idle keep-alive connections cost nothing here
+// until they become readable.
+static void epoll_master_loop(struct mg_context *ctx) {
+  struct epoll_event events[MAX_EPOLL_EVENTS], ev;
+  struct socket *sp;
+  int i, n, idle_timeout;
+
+  for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
+    set_non_blocking_mode(sp->sock);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = sp;
+    if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, sp->sock, &ev) != 0) {
+      cry(fc(ctx), "%s: epoll_ctl: %s", __func__, strerror(ERRNO));
+    }
+  }
+
+  idle_timeout = atoi(ctx->config[KEEP_ALIVE_TIMEOUT]);
+  while (ctx->stop_flag == 0) {
+    n = epoll_wait(ctx->epoll_fd, events, MAX_EPOLL_EVENTS, 200);
+    for (i = 0; i < n && ctx->stop_flag == 0; i++) {
+      if (is_listening_socket(ctx, events[i].data.ptr)) {
+        sp = (struct socket *) events[i].data.ptr;
+        while (ctx->stop_flag == 0 && accept_new_connection(sp, ctx)) {
+        }
+      } else {
+        resume_idle_socket(ctx, (struct idle_socket *) events[i].data.ptr);
+      }
+    }
+    if (idle_timeout > 0) {
+      close_idle_sockets(ctx, idle_timeout);
+    }
+  }
+}
+#endif // USE_EPOLL
+
 static void master_thread(struct mg_context *ctx) {
   fd_set read_set;
   struct timeval tv;
   struct socket *sp;
-  int max_fd;
+  int max_fd, idle_timeout;
+
+#if defined(USE_EPOLL)
+  if (ctx->epoll_fd != -1) {
+    epoll_master_loop(ctx);
+  }
+#endif // USE_EPOLL
 
+  idle_timeout = atoi(ctx->config[KEEP_ALIVE_TIMEOUT]);
   while (ctx->stop_flag == 0) {
     FD_ZERO(&read_set);
     max_fd = -1;
@@ -4115,6 +4867,10 @@ static void master_thread(struct mg_context *ctx) {
     for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
       add_to_set(sp->sock, &read_set, &max_fd);
     }
+    if (ctx->wake_sock != INVALID_SOCKET) {
+      add_to_set(ctx->wake_sock, &read_set, &max_fd);
+      add_idle_sockets_to_set(ctx, &read_set, &max_fd);
+    }
 
     tv.tv_sec = 0;
     tv.tv_usec = 200 * 1000;
@@ -4132,6 +4888,12 @@ static void master_thread(struct mg_context *ctx) {
           accept_new_connection(sp, ctx);
         }
       }
+      if (ctx->stop_flag == 0 && ctx->wake_sock != INVALID_SOCKET) {
+        resume_readable_idle_sockets(ctx, &read_set);
+      }
+    }
+    if (idle_timeout > 0 && !uses_epoll(ctx)) {
+      close_idle_sockets(ctx, idle_timeout);
     }
   }
   DEBUG_TRACE(("stopping workers"));
@@ -4149,6 +4911,17 @@ static void master_thread(struct mg_context *ctx) {
   }
   (void) pthread_mutex_unlock(&ctx->mutex);
 
+  // No worker can add idle connections any more
+  close_idle_sockets(ctx, -1);
+#if defined(USE_EPOLL)
+  if (ctx->epoll_fd != -1) {
+    (void) close(ctx->epoll_fd);
+  }
+#endif // USE_EPOLL
+  if (ctx->wake_sock != INVALID_SOCKET) {
+    (void) closesocket(ctx->wake_sock);
+  }
+
   // All threads exited, no sync is needed. Destroy mutex and condvars
   (void) pthread_mutex_destroy(&ctx->mutex);
   (void) pthread_cond_destroy(&ctx->cond);
@@ -4168,6 +4941,11 @@ static void master_thread(struct mg_context *ctx) {
 static void free_context(struct mg_context *ctx) {
   int i;
 
+  // Deallocate the socket queue
+  if (ctx->queue != NULL) {
+    free(ctx->queue);
+  }
+
   // Deallocate config parameters
   for (i = 0; i < NUM_OPTIONS; i++) {
     if (ctx->config[i] != NULL)
@@ -4202,9 +4980,22 @@ void mg_stop(struct mg_context *ctx) {
 #endif // _WIN32
 }
 
+void mg_get_queue_stats(struct mg_context *ctx, struct mg_queue_stats *stats) {
+  (void) pthread_mutex_lock(&ctx->mutex);
+  stats->num_threads = ctx->num_threads;
+  stats->queue_size = ctx->queue_size;
+  stats->queue_length = ctx->sq_head - ctx->sq_tail;
+  stats->num_dequeued = ctx->num_dequeued;
+  stats->num_rejected = ctx->num_rejected;
+  stats->total_wait_ms = ctx->total_wait_ms;
+  stats->max_wait_ms = ctx->max_wait_ms;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
 struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
                             const char **options) {
   struct mg_context *ctx;
+  struct socket *sp;
   const char *name, *value, *default_value;
   int i;
 
@@ -4267,6 +5058,36 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
   (void) signal(SIGCHLD, SIG_IGN);
 #endif // !_WIN32
 
+  ctx->queue_size = atoi(ctx->config[QUEUE_SIZE]);
+  if (ctx->queue_size <= 0 || (ctx->queue = (struct socket *)
+      calloc((size_t) ctx->queue_size, sizeof(*ctx->queue))) == NULL) {
+    cry(fc(ctx), "Invalid queue size: %s", ctx->config[QUEUE_SIZE]);
+    free_context(ctx);
+    return NULL;
+  }
+
+#if defined(USE_EPOLL)
+  // Fall back to select() if epoll is not available
+  ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (ctx->epoll_fd == -1) {
+    cry(fc(ctx), "%s: epoll_create1: %s", __func__, strerror(ERRNO));
+  }
+#endif // USE_EPOLL
+
+  // Without epoll, select() watches the idle connections, up to the size
+  // of its read set, less the listening sockets and the wake-up socket.
+  // Without a wake-up socket, they stay with their worker threads.
+  ctx->wake_sock = INVALID_SOCKET;
+  if (!uses_epoll(ctx)) {
+    ctx->max_idle = FD_SETSIZE - 1;
+    for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
+      ctx->max_idle--;
+    }
+    if ((ctx->wake_sock = create_wake_socket()) == INVALID_SOCKET) {
+      cry(fc(ctx), "%s: cannot create wake-up socket: %d", __func__, ERRNO);
+    }
+  }
+
   (void) pthread_mutex_init(&ctx->mutex, NULL);
   (void) pthread_cond_init(&ctx->cond, NULL);
   (void) pthread_cond_init(&ctx->sq_empty, NULL);
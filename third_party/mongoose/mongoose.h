@@ -118,6 +118,25 @@ struct mg_context *mg_start(mg_callback_t callback, void *user_data,
 void mg_stop(struct mg_context *);
 
 
+// Statistics for the queue of accepted connections waiting for a free
+// worker thread.
+struct mg_queue_stats {
+  int num_threads;          // Number of running worker threads
+  int queue_size;           // Maximum number of queued connections
+  int queue_length;         // Number of connections queued right now
+  long long num_dequeued;   // Connections taken from the queue by workers
+  long long num_rejected;   // Connections refused with 503, queue was full
+  long long total_wait_ms;  // Time dequeued connections spent in the queue
+  long long max_wait_ms;    // Longest time a connection spent in the queue
+};
+
+
+// Get a snapshot of the connection queue statistics. When all worker
+// threads are busy and "queue_size" connections are already waiting, new
+// connections are answered with "503 Service Unavailable" and closed.
+void mg_get_queue_stats(struct mg_context *, struct mg_queue_stats *);
+
+
 // Get the value of particular configuration parameter.
 // The value returned is read-only. Mongoose does not allow changing
 // configuration at run time.
@@ -154,6 +173,20 @@ int mg_modify_passwords_file(const char *passwords_file_name,
 int mg_write(struct mg_connection *, const void *buf, size_t len);
 
 
+// A buffer to be sent to the client by mg_write_buffers().
+struct mg_buffer {
+  const void *data;  // Start of the data
+  size_t len;        // Length of the data, in bytes
+};
+
+// Send several buffers to the client, in order, without first copying them
+// into one contiguous block. Plain sockets use a single gather write
+// (writev() or WSASend()) for all of the buffers.
+// Return the total number of bytes sent.
+int mg_write_buffers(struct mg_connection *,
+                     const struct mg_buffer *buffers, int count);
+
+
 // Send data to the browser using printf() semantics.
 //
 // Works exactly like mg_write(), but allows to do message formatting.
@@ -168,9 +201,51 @@ void mg_send_file(struct mg_connection *conn, const char *path);
 
 
 // Read data from the remote end, return number of bytes read.
+// Bodies sent with "Transfer-Encoding: chunked" are decoded; for them,
+// 0 means the last chunk has been read, and -1 that the framing was
+// malformed or the connection failed.
 int mg_read(struct mg_connection *, void *buf, size_t len);
 
 
+// Return 1 if the connection will be kept open for the next request after
+// the current request is served (HTTP keep-alive), or 0 if it will be closed.
+// Handlers should use this to set the "Connection:" header of their reply.
+int mg_should_keep_alive(const struct mg_connection *);
+
+
+// Close the connection after the current request is served, even if the
+// client asked for it to be kept alive. The rest of an unread request body
+// is not drained. Call this before writing the reply, so that
+// mg_should_keep_alive() reports the change.
+void mg_set_must_close(struct mg_connection *);
+
+
+// Finish the current request later, from any thread. Call this from the
+// MG_NEW_REQUEST handler after the whole request body has been read, and
+// return a non-NULL value from the handler without writing a reply. The
+// reply is then written with mg_write() and friends from another thread,
+// which must call mg_resume() when it is done. Until then the worker thread
+// is free to serve other connections.
+// Return 1 if the request was suspended, 0 if it must be finished before
+// the handler returns: SSL and proxied connections, and connections with
+// pipelined requests waiting behind the current one, are never suspended.
+// Every suspended request must be resumed before mg_stop() is called.
+int mg_suspend(struct mg_connection *);
+
+
+// Finish a request suspended with mg_suspend(). The connection is kept
+// alive or closed as for any other request; call mg_set_must_close() first
+// to close it, for example when abandoning a request without a reply.
+// The connection must not be used after this call.
+void mg_resume(struct mg_connection *);
+
+
+// Return 1 if the client has closed its end of the connection, 0 otherwise.
+// Does not block. Meant for noticing that nobody is waiting any longer for
+// the reply to a suspended request.
+int mg_client_disconnected(struct mg_connection *);
+
+
 // Get the value of particular HTTP header.
 //
 // This is a helper function. It traverses request_info->http_headers array,